@@ -5,7 +5,7 @@ TEMPLATE		 = app
 CONFIG		+= c++11
 QMAKESPEC = macx-g++
 QMAKE_CXX = g++-6
-QMAKE_CXXFLAGS += -std=c++11
+QMAKE_CXXFLAGS += -std=c++11 -fopenmp
 QMAKE_LN = g++-6
 QMAKE_LFLAGS = -fopenmp
 
@@ -13,4 +13,6 @@ LIBS			+= -L kernels/lib -lskepuimg -framework OpenCL
 INCLUDEPATH	+= kernels/include ../../include
 
 FORMS			 = mainwindow.ui
-SOURCES		 = main.cpp lodepng.cpp
+SOURCES		 = main.cpp lodepng.cpp compression.cpp
+
+include(compression.pri)
@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cstdlib>
+#include <mutex>
+
+#ifdef SKEPICTURE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "compression.h"
+
+namespace Compression
+{
+namespace
+{
+
+#ifdef SKEPICTURE_ZLIB
+
+	// Appends the zlib stream of the input to *out, like lodepng_zlib_compress.
+	unsigned zlib_compress(unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize,
+		const LodePNGCompressSettings *settings)
+	{
+		int level = Z_DEFAULT_COMPRESSION, strategy = Z_DEFAULT_STRATEGY;
+		switch (settings->level)
+		{
+			case LCL_STORED:  level = 0; break;
+			case LCL_FASTEST: level = 1; break;
+			case LCL_RLE:     level = 1; strategy = Z_RLE; break;
+			case LCL_MAX:     level = 9; break;
+			case LCL_ARCHIVE: level = 9; break;
+			default:          if (settings->btype == 0) level = 0; break;
+		}
+
+		z_stream stream = {};
+		if (deflateInit2(&stream, level, Z_DEFLATED, 15, 8, strategy) != Z_OK)
+			return 83;
+
+		size_t bound = deflateBound(&stream, insize);
+		unsigned char *buffer = (unsigned char*)realloc(*out, *outsize + bound);
+		if (!buffer)
+		{
+			deflateEnd(&stream);
+			return 83;
+		}
+		*out = buffer;
+
+		stream.next_in = const_cast<unsigned char*>(in);
+		stream.avail_in = insize;
+		stream.next_out = buffer + *outsize;
+		stream.avail_out = bound;
+		int result = deflate(&stream, Z_FINISH);
+		*outsize += stream.total_out;
+		deflateEnd(&stream);
+		return (result == Z_STREAM_END) ? 0 : 83;
+	}
+
+	// Appends the inflated zlib stream to *out, like lodepng_zlib_decompress.
+	unsigned zlib_decompress(unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize,
+		const LodePNGDecompressSettings *)
+	{
+		z_stream stream = {};
+		if (inflateInit(&stream) != Z_OK)
+			return 83;
+
+		stream.next_in = const_cast<unsigned char*>(in);
+		stream.avail_in = insize;
+		int result = Z_OK;
+		while (result == Z_OK)
+		{
+			// PNG scanlines inflate to a few times the compressed size, grow from there
+			size_t capacity = std::max<size_t>(*outsize * 2, insize * 4 + 1024);
+			unsigned char *buffer = (unsigned char*)realloc(*out, capacity);
+			if (!buffer)
+			{
+				result = Z_MEM_ERROR;
+				break;
+			}
+			*out = buffer;
+			stream.next_out = buffer + *outsize;
+			stream.avail_out = capacity - *outsize;
+			result = inflate(&stream, Z_NO_FLUSH);
+			*outsize = capacity - stream.avail_out;
+			if (result == Z_BUF_ERROR && stream.avail_out > 0)
+				break; // input ends before the stream does
+			if (result == Z_BUF_ERROR)
+				result = Z_OK;
+		}
+		inflateEnd(&stream);
+
+		switch (result)
+		{
+			case Z_STREAM_END: return 0;
+			case Z_MEM_ERROR:  return 83; // memory allocation failed
+			case Z_BUF_ERROR:  return 23; // end of in buffer memory reached while inflating
+			default:           return 20; // invalid deflate data
+		}
+	}
+
+#endif
+
+	std::mutex registryMutex;
+	std::string currentBackend = "lodepng";
+
+	std::vector<Backend> &registry()
+	{
+		static std::vector<Backend> backends
+		{
+			{ "lodepng", nullptr, nullptr },
+#ifdef SKEPICTURE_ZLIB
+			{ "zlib", zlib_compress, zlib_decompress },
+#endif
+		};
+		return backends;
+	}
+
+	// Only call with registryMutex locked
+	const Backend *find(const std::string &name)
+	{
+		for (const Backend &backend : registry())
+			if (backend.name == name)
+				return &backend;
+		return nullptr;
+	}
+
+}
+
+	const std::vector<Preset> &presets()
+	{
+		static const std::vector<Preset> list
+		{
+			{ "Uncompressed", LCL_STORED },
+			{ "Fastest",      LCL_FASTEST },
+			{ "RLE",          LCL_RLE },
+			{ "Balanced",     LCL_CUSTOM },
+			{ "Smallest",     LCL_MAX },
+			{ "Archive",      LCL_ARCHIVE },
+		};
+		return list;
+	}
+
+	void registerBackend(Backend backend)
+	{
+		std::lock_guard<std::mutex> lock(registryMutex);
+		for (Backend &existing : registry())
+			if (existing.name == backend.name)
+			{
+				existing = backend;
+				return;
+			}
+		registry().push_back(backend);
+	}
+
+	std::vector<std::string> backendNames()
+	{
+		std::lock_guard<std::mutex> lock(registryMutex);
+		std::vector<std::string> names;
+		for (const Backend &backend : registry())
+			names.push_back(backend.name);
+		return names;
+	}
+
+	bool setBackend(std::string name)
+	{
+		std::lock_guard<std::mutex> lock(registryMutex);
+		if (!find(name))
+			return false;
+		currentBackend = name;
+		return true;
+	}
+
+	std::string getBackend()
+	{
+		std::lock_guard<std::mutex> lock(registryMutex);
+		return currentBackend;
+	}
+
+	bool configure(LodePNGCompressSettings *settings, std::string name)
+	{
+		std::lock_guard<std::mutex> lock(registryMutex);
+		const Backend *backend = find(name);
+		if (!backend)
+			return false;
+		settings->custom_zlib = backend->compress;
+		settings->custom_deflate = nullptr;
+		return true;
+	}
+
+	bool configure(LodePNGDecompressSettings *settings, std::string name)
+	{
+		std::lock_guard<std::mutex> lock(registryMutex);
+		const Backend *backend = find(name);
+		if (!backend)
+			return false;
+		settings->custom_zlib = backend->decompress;
+		settings->custom_inflate = nullptr;
+		return true;
+	}
+
+	bool configure(LodePNGState *state, std::string name)
+	{
+		return configure(&state->encoder.zlibsettings, name) && configure(&state->decoder.zlibsettings, name);
+	}
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "lodepng.h"
+
+// Zlib implementations for lodepng, selectable per encode and decode without changing lodepng itself.
+namespace Compression
+{
+	// A backend is installed through the custom_zlib hooks of the lodepng settings.
+	// A null function leaves lodepng's built-in implementation in place.
+	struct Backend
+	{
+		std::string name;
+		unsigned (*compress)(unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize,
+			const LodePNGCompressSettings *settings);
+		unsigned (*decompress)(unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize,
+			const LodePNGDecompressSettings *settings);
+	};
+
+	// Speed/size trade-offs for encoding, from fastest to smallest.
+	struct Preset
+	{
+		std::string name;
+		LodePNGCompressLevel level;
+	};
+
+	const std::vector<Preset> &presets();
+
+	// Built in are "lodepng", and "zlib" when the system zlib was found at build time.
+	// Registering a backend with an existing name replaces it.
+	void registerBackend(Backend backend);
+	std::vector<std::string> backendNames();
+
+	// The backend configure() uses by default, initially "lodepng". False for an unknown name.
+	bool setBackend(std::string name);
+	std::string getBackend();
+
+	// Installs the hooks of a backend into the settings. False (and no change) for an unknown name.
+	bool configure(LodePNGCompressSettings *settings, std::string name = getBackend());
+	bool configure(LodePNGDecompressSettings *settings, std::string name = getBackend());
+	bool configure(LodePNGState *state, std::string name = getBackend());
+}
@@ -0,0 +1,6 @@
+# The system zlib is an optional PNG compression backend, used when pkg-config finds it
+packagesExist(zlib) {
+	CONFIG		+= link_pkgconfig
+	PKGCONFIG	+= zlib
+	DEFINES		+= SKEPICTURE_ZLIB
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <iostream>
+#include <vector>
 //#include <skepu2.hpp>
 
 struct GrayscalePixel
@@ -13,6 +14,13 @@ struct GrayscalePixel
 		unsigned char red, green, blue;
 	};
 	
+	// RGB padded to four bytes, so that pixels are aligned to vector lanes and match the layout
+	// of 32-bit images. Filters copy x through from their input; images keep it at 255, opaque.
+	struct RGBXPixel
+	{
+		unsigned char red, green, blue, x;
+	};
+	
 namespace SkePUImageProcessing
 {
 	
@@ -25,33 +33,182 @@ namespace SkePUImageProcessing
 	
 	
 	
+	// Color properties of an image that follow from how it was made, so that saving
+	// it can pick a PNG color type without scanning the pixels. Every filter takes
+	// an optional pointer to the record of its image and keeps it up to date.
+	struct ImageProperties
+	{
+		bool grayscale = false;        // red, green and blue are equal in every pixel
+		unsigned bitDepth = 8;         // 1, 2, 4 or 8: every channel is a multiple of 255 / (2^bitDepth - 1)
+		std::vector<RGBPixel> palette; // all colors of the image, empty if not known
+		
+		// Nothing is known about the colors anymore.
+		void reset()
+		{
+			*this = ImageProperties();
+		}
+		
+		// New channel values were computed the same way for each channel: gray stays gray.
+		void mixed()
+		{
+			this->bitDepth = 8;
+			this->palette.clear();
+		}
+	};
+	
 	template<typename T> struct PixelTypeID;
 	template<> struct PixelTypeID<GrayscalePixel>: std::integral_constant<size_t, 0> {};
 	template<> struct PixelTypeID<RGBPixel>: std::integral_constant<size_t, 1> {};
+	template<> struct PixelTypeID<RGBXPixel>: std::integral_constant<size_t, 2> {};
+	
+	// Index in tuples of kernels that only exist for color pixels
+	template<typename T> struct ColorTypeID: std::integral_constant<size_t, PixelTypeID<T>::value - 1> {};
 	
 	template<typename PixelType>
-	float gaussian(skepu2::Matrix<PixelType> *img, float blur_sigma);
+	float gaussian(skepu2::Matrix<PixelType> *img, float blur_sigma, ImageProperties *properties = nullptr);
 	
-	float median(skepu2::Matrix<RGBPixel> *img, size_t radius);
+	template<typename PixelType>
+	float median(skepu2::Matrix<PixelType> *img, size_t radius, ImageProperties *properties = nullptr);
+	
+	float edge_gray(skepu2::Matrix<GrayscalePixel> *img, ImageProperties *properties = nullptr);
 	
-	float edge_gray(skepu2::Matrix<GrayscalePixel> *img);
-	float edge_rgb(skepu2::Matrix<RGBPixel> *img);
+	template<typename PixelType>
+	float edge_rgb(skepu2::Matrix<PixelType> *img, ImageProperties *properties = nullptr);
 	
-	float stencil(skepu2::Matrix<RGBPixel> *img, skepu2::Matrix<float> *stencil, float scaling);
+	template<typename PixelType>
+	float edge_intensity(skepu2::Matrix<PixelType> *img, skepu2::Matrix<GrayscalePixel> *result); // single channel, img unchanged
+	
+	// Any stencil with odd sides. Stencils of low rank, such as separable ones, run as a sum of
+	// row and column passes when that saves enough taps, other large ones through FFTs on the CPU.
+	template<typename PixelType>
+	float stencil(skepu2::Matrix<PixelType> *img, skepu2::Matrix<float> *stencil, float scaling, ImageProperties *properties = nullptr);
 	
 
-	float desaturate(skepu2::Matrix<RGBPixel> *img, float saturation);
-	float blackwhite(skepu2::Matrix<RGBPixel> *img);
+	template<typename PixelType>
+	float desaturate(skepu2::Matrix<PixelType> *img, float saturation, ImageProperties *properties = nullptr);
+	
+	template<typename PixelType>
+	float blackwhite(skepu2::Matrix<PixelType> *img, ImageProperties *properties = nullptr);
+	
+	template<typename PixelType>
+	float invert(skepu2::Matrix<PixelType> *img, ImageProperties *properties = nullptr);
+	
+	template<typename PixelType>
+	float hue(skepu2::Matrix<PixelType> *img, float hue, ImageProperties *properties = nullptr);
+	
+	// Per-pixel operations that compose() chains into a single pass over the image, applied
+	// left to right: apply(img, compose(point::hue(h), point::desaturate(s), point::invert()))
+	namespace point
+	{
+		enum Type { Invert, Hue, Desaturate, BlackWhite };
+		
+		struct Operation
+		{
+			Type type;
+			float parameter;
+		};
+		
+		inline Operation invert()                     { return { Invert, 0 }; }
+		inline Operation hue(float hue)               { return { Hue, hue }; }
+		inline Operation desaturate(float saturation) { return { Desaturate, saturation }; }
+		inline Operation blackwhite()                 { return { BlackWhite, 0 }; }
+	}
+	
+	typedef std::vector<point::Operation> PointChain;
+	
+	template<typename... Operations>
+	PointChain compose(Operations... operations)
+	{
+		return PointChain { operations... };
+	}
 	
 	template<typename PixelType>
-	float invert(skepu2::Matrix<PixelType> *img);
+	float apply(skepu2::Matrix<PixelType> *img, const PointChain &chain, ImageProperties *properties = nullptr);
+	
+	// Per-channel 256-entry lookup tables. Curves compose into one table with then(), so any
+	// number of adjustments costs one lookup per channel.
+	struct ToneCurve
+	{
+		unsigned char table[3][256]; // red, green, blue
+		
+		static ToneCurve identity();
+		static ToneCurve invert();
+		static ToneCurve threshold(unsigned char level);                      // 255 above level, else 0
+		static ToneCurve levels(unsigned char black, unsigned char white, float gamma = 1); // input levels
+		static ToneCurve gamma(float gamma);
+		static ToneCurve contrast(float amount);                              // around mid gray
+		
+		ToneCurve then(const ToneCurve &next) const; // this curve, followed by next
+	};
+	
+	// What a tone curve is looked up at: each channel's own value, or the pixel intensity for all three.
+	enum class ToneInput { Channels, Intensity };
+	
+	template<typename PixelType>
+	float tone(skepu2::Matrix<PixelType> *img, const ToneCurve &curve, ToneInput input = ToneInput::Channels, ImageProperties *properties = nullptr);
+	
+	// A point chain baked into a size^3 color lookup table, so that any chain costs one tetrahedral
+	// interpolation per pixel. The table is rebuilt only when the chain differs from the last one.
+	// Interpolation is exact for invert and smooth operations, but thresholds such as blackwhite
+	// blur over one grid cell.
+	class ColorLUT
+	{
+	public:
+		explicit ColorLUT(size_t size = 33);
+		template<typename PixelType>
+		float apply(skepu2::Matrix<PixelType> *img, const PointChain &chain, ImageProperties *properties = nullptr);
+		
+	private:
+		void build(const PointChain &chain);
+		
+		size_t size;
+		PointChain baked;
+		bool built = false;
+		skepu2::Vector<float> table; // RGB output per grid node, blue varying fastest
+	};
 	
-	float hue(skepu2::Matrix<RGBPixel> *img, float hue);
+	
+	// An RGB image as three planes of one channel each. The pixels of a plane are contiguous, so
+	// that kernels process many pixels of one channel at a time rather than packed 3-byte pixels,
+	// and the grayscale kernels apply to each plane. A chain of planar filters stays planar until
+	// the image is interleaved again for display or saving.
+	struct PlanarImage
+	{
+		skepu2::Matrix<GrayscalePixel> red, green, blue;
+		
+		size_t total_rows() const { return red.total_rows(); }
+		size_t total_cols() const { return red.total_cols(); }
+	};
+	
+	template<typename PixelType>
+	float deinterleave(skepu2::Matrix<PixelType> *img, PlanarImage *planar);
+	
+	template<typename PixelType>
+	float interleave(PlanarImage *planar, skepu2::Matrix<PixelType> *img);
+	
+	// Planar versions of the filters that treat the channels independently
+	float gaussian_planar(PlanarImage *img, float blur_sigma, ImageProperties *properties = nullptr);
+	float stencil_planar(PlanarImage *img, skepu2::Matrix<float> *stencil, float scaling, ImageProperties *properties = nullptr);
+	float invert_planar(PlanarImage *img, ImageProperties *properties = nullptr);
+	float tone_planar(PlanarImage *img, const ToneCurve &curve, ImageProperties *properties = nullptr); // ToneInput::Channels
+	
+	
+	// Geometric transforms through a cache-blocked transpose on the host. Pixels only move, so
+	// the image properties stay valid.
+	template<typename PixelType>
+	float transpose(skepu2::Matrix<PixelType> *img);
+	
+	template<typename PixelType>
+	float rotate90(skepu2::Matrix<PixelType> *img, bool clockwise);
+	
+	template<typename PixelType>
+	float flip(skepu2::Matrix<PixelType> *img, bool horizontal); // mirrors left and right if horizontal, else top and bottom
 	
 	
 	// Geneators
 //	float mandelbrot(skepu2::Matrix<GrayscalePixel> *img, float scale);
-	float mandelbrot(skepu2::Matrix<RGBPixel> *img, float scale);
+	template<typename PixelType>
+	float mandelbrot(skepu2::Matrix<PixelType> *img, float scale, ImageProperties *properties = nullptr);
 	
 	
 	
@@ -59,6 +216,13 @@ namespace SkePUImageProcessing
 	std::string getBackend();
 	
 	skepu2::BackendSpec backendSpec();
+	bool hostBackend(); // false for GPU backends, whose kernels should not be replaced by host code
+	
+	// Quantizes filter * scaling to 16-bit coefficients of scale 2^shift for the fixed-point kernels
+	// on 8-bit pixels. Fails if the rounding could move a result by more than FIXED_POINT_ERROR.
+	const double FIXED_POINT_ERROR = 0.5;
+	bool quantize_filter(const float *filter, size_t size, float scaling, short *quantized, int &shift);
+	
 	void setCPUThreads(size_t numThreads);
 	size_t getCPUThreads();
 	
@@ -1,5 +1,8 @@
 #include <iostream>
 #include <tuple>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
 #include <algorithm>
 #include <skepu2.hpp>
 
@@ -19,79 +22,12 @@ namespace SkePUImageProcessing
 		return (a < b) ? a : b;
 	}
 	
-	unsigned char intensity(RGBPixel input)
+	template<typename PixelType>
+	inline unsigned char intensity(PixelType input)
 	{
 		return ((unsigned int)input.red + (unsigned int)input.green + (unsigned int)input.blue) / 3;
 	}
 	
-	auto rgb_to_grayscale = skepu2::Map([](RGBPixel input) -> GrayscalePixel
-	{
-		GrayscalePixel output;
-		output.intensity = intensity(input);
-		return output;
-	});
-	
-	auto grayscale_to_rgb = skepu2::Map([](GrayscalePixel input) -> RGBPixel
-	{
-		RGBPixel output;
-		output.red   = input.intensity;
-		output.green = input.intensity;
-		output.blue  = input.intensity;
-		return output;
-	});
-	
-	auto desaturate_kernel_old = skepu2::Map([](RGBPixel input) -> RGBPixel
-	{
-		RGBPixel output;
-		unsigned char in = intensity(input);
-		output.red   = in;
-		output.green = in;
-		output.blue  = in;
-		return output;
-	});
-	
-	auto desaturate_kernel = skepu2::Map([](RGBPixel input, float saturation) -> RGBPixel
-	{
-		RGBPixel output;
-		unsigned char in = intensity(input) * (1 - saturation);
-		output.red   = input.red   * saturation + in;
-		output.green = input.green * saturation + in;
-		output.blue  = input.blue  * saturation + in;
-		return output;
-	});
-	
-	auto bw_kernel = skepu2::Map([](RGBPixel input) -> RGBPixel
-	{
-		RGBPixel output;
-		unsigned char in = (intensity(input) > 127) ? 255 : 0;
-		output.red   = in;
-		output.green = in;
-		output.blue  = in;
-		return output;
-	});
-	
-	float desaturate(skepu2::Matrix<RGBPixel> *img, float saturation)
-	{
-		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
-		{
-			desaturate_kernel.setBackend(backendSpec());
-			desaturate_kernel(*img, *img, saturation);
-		});
-		return time.count() / 1E6; // us -> s
-	}
-	
-	float blackwhite(skepu2::Matrix<RGBPixel> *img)
-	{
-		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
-		{
-			bw_kernel.setBackend(backendSpec());
-			bw_kernel(*img, *img);
-		});
-		return time.count() / 1E6; // us -> s
-	}
-
-
-	
 	auto convolution_grayscale = skepu2::MapOverlap([](int o, size_t stride, const GrayscalePixel *image, const skepu2::Vec<float> filter, float offset, float scaling) -> GrayscalePixel
 	{
 		GrayscalePixel result;
@@ -107,24 +43,108 @@ namespace SkePUImageProcessing
 		return result;
 	});
 	
-	auto convolution_rgb = skepu2::MapOverlap([](int o, size_t stride, const RGBPixel *image, const skepu2::Vec<float> filter, float offset, float scaling) -> RGBPixel
+	// Color kernels are templates over RGBPixel and RGBXPixel. They start the result from the
+	// pixel at the center, which carries the padding of RGBXPixel through.
+	template<typename PixelType>
+	PixelType convolution_color(int o, size_t stride, const PixelType *image, const skepu2::Vec<float> filter, float offset, float scaling)
 	{
 		float r = 0, g = 0, b = 0;
 		for (int i = -o; i <= o; i++)
 		{
-			RGBPixel p = image[i*stride];
+			PixelType p = image[i*stride];
 			r += p.red   * filter[i+o];
 			g += p.green * filter[i+o];
 			b += p.blue  * filter[i+o];
 		}
 		
-		RGBPixel res;
+		PixelType res = image[0];
 		res.red   = min(max(0.f, (r + offset) * scaling), 255.f);
 		res.green = min(max(0.f, (g + offset) * scaling), 255.f);
 		res.blue  = min(max(0.f, (b + offset) * scaling), 255.f);
 		return res;
+	}
+	
+	auto convolution_rgb = skepu2::MapOverlap(convolution_color<RGBPixel>);
+	auto convolution_rgbx = skepu2::MapOverlap(convolution_color<RGBXPixel>);
+	
+	// Fixed-point versions of the convolutions for filters quantize_filter() accepts: coefficients
+	// scaled by 2^shift, integer accumulation, and rounding before the clamp.
+	auto convolution_grayscale_fixed = skepu2::MapOverlap([](int o, size_t stride, const GrayscalePixel *image, const skepu2::Vec<short> filter, int shift) -> GrayscalePixel
+	{
+		int intensity = 1 << (shift - 1);
+		for (int i = -o; i <= o; i++)
+			intensity += image[i*stride].intensity * filter[i+o];
+		
+		GrayscalePixel result;
+		result.intensity = min(max(0, intensity >> shift), 255);
+		return result;
 	});
 	
+	template<typename PixelType>
+	PixelType convolution_color_fixed(int o, size_t stride, const PixelType *image, const skepu2::Vec<short> filter, int shift)
+	{
+		int r = 1 << (shift - 1), g = r, b = r;
+		for (int i = -o; i <= o; i++)
+		{
+			PixelType p = image[i*stride];
+			r += p.red   * filter[i+o];
+			g += p.green * filter[i+o];
+			b += p.blue  * filter[i+o];
+		}
+		
+		PixelType res = image[0];
+		res.red   = min(max(0, r >> shift), 255);
+		res.green = min(max(0, g >> shift), 255);
+		res.blue  = min(max(0, b >> shift), 255);
+		return res;
+	}
+	
+	auto convolution_rgb_fixed = skepu2::MapOverlap(convolution_color_fixed<RGBPixel>);
+	auto convolution_rgbx_fixed = skepu2::MapOverlap(convolution_color_fixed<RGBXPixel>);
+	
+	// The fixed-point convolutions with the overlap known at compile time, so that the loops unroll.
+	// The overlap argument SkePU passes is the same O.
+	template<int O>
+	GrayscalePixel convolution_grayscale_fixed_radius(int o, size_t stride, const GrayscalePixel *image, const skepu2::Vec<short> filter, int shift)
+	{
+		int intensity = 1 << (shift - 1);
+		for (int i = -O; i <= O; i++)
+			intensity += image[i*stride].intensity * filter[i+O];
+		
+		GrayscalePixel result;
+		result.intensity = min(max(0, intensity >> shift), 255);
+		return result;
+	}
+	
+	template<typename PixelType, int O>
+	PixelType convolution_color_fixed_radius(int o, size_t stride, const PixelType *image, const skepu2::Vec<short> filter, int shift)
+	{
+		int r = 1 << (shift - 1), g = r, b = r;
+		for (int i = -O; i <= O; i++)
+		{
+			PixelType p = image[i*stride];
+			r += p.red   * filter[i+O];
+			g += p.green * filter[i+O];
+			b += p.blue  * filter[i+O];
+		}
+		
+		PixelType res = image[0];
+		res.red   = min(max(0, r >> shift), 255);
+		res.green = min(max(0, g >> shift), 255);
+		res.blue  = min(max(0, b >> shift), 255);
+		return res;
+	}
+	
+	auto convolution_grayscale_fixed1 = skepu2::MapOverlap(convolution_grayscale_fixed_radius<1>);
+	auto convolution_grayscale_fixed2 = skepu2::MapOverlap(convolution_grayscale_fixed_radius<2>);
+	auto convolution_grayscale_fixed3 = skepu2::MapOverlap(convolution_grayscale_fixed_radius<3>);
+	auto convolution_rgb_fixed1 = skepu2::MapOverlap(convolution_color_fixed_radius<RGBPixel, 1>);
+	auto convolution_rgb_fixed2 = skepu2::MapOverlap(convolution_color_fixed_radius<RGBPixel, 2>);
+	auto convolution_rgb_fixed3 = skepu2::MapOverlap(convolution_color_fixed_radius<RGBPixel, 3>);
+	auto convolution_rgbx_fixed1 = skepu2::MapOverlap(convolution_color_fixed_radius<RGBXPixel, 1>);
+	auto convolution_rgbx_fixed2 = skepu2::MapOverlap(convolution_color_fixed_radius<RGBXPixel, 2>);
+	auto convolution_rgbx_fixed3 = skepu2::MapOverlap(convolution_color_fixed_radius<RGBXPixel, 3>);
+	
 	auto filter_gen = skepu2::Map<0>([](skepu2::Index1D index, size_t r, float sigma) -> float
 	{
 		const float pi = 3.141592;
@@ -132,22 +152,261 @@ namespace SkePUImageProcessing
 		return exp(-i*i / (2 * sigma * sigma)) / sqrt(2* pi * sigma * sigma);
 	});
 	
-	auto distance = skepu2::Map<2>([](GrayscalePixel x, GrayscalePixel y) -> GrayscalePixel
+	// Sobel edge detection in one pass: both 3x3 gradients come from the three rows around the
+	// pixel, clamped at the border to duplicate the edge. The result is 255 - |gradient| / 4, what
+	// separate row and column passes with 8-bit intermediates computed, without their rounding.
+	unsigned char sobel_magnitude(float topLeft, float top, float topRight, float left, float right, float bottomLeft, float bottom, float bottomRight)
 	{
+		float gx = (topRight + 2.f * right + bottomRight) - (topLeft + 2.f * left + bottomLeft);
+		float gy = (bottomLeft + 2.f * bottom + bottomRight) - (topLeft + 2.f * top + topRight);
+		float magnitude = sqrt(gx * gx + gy * gy) * 0.25f;
+		return 255 - min(magnitude, 255.f);
+	}
+	
+	GrayscalePixel sobel_kernel(skepu2::Index2D index, const skepu2::Mat<GrayscalePixel> image)
+	{
+		int rows = image.rows, cols = image.cols, y = index.row, x = index.col;
+		const GrayscalePixel *above = &image.data[max(y - 1, 0) * cols];
+		const GrayscalePixel *row   = &image.data[y * cols];
+		const GrayscalePixel *below = &image.data[min(y + 1, rows - 1) * cols];
+		int left = max(x - 1, 0), right = min(x + 1, cols - 1);
+		
 		GrayscalePixel result;
-		float xf = (float)x.intensity / 255 - 0.5;
-		float yf = (float)y.intensity / 255 - 0.5;
-		result.intensity = 255 - sqrt(xf*xf + yf*yf) * 2 * 255;
+		result.intensity = sobel_magnitude(
+			above[left].intensity, above[x].intensity, above[right].intensity,
+			row[left].intensity,                       row[right].intensity,
+			below[left].intensity, below[x].intensity, below[right].intensity);
 		return result;
-	});
+	}
+	
+	// The same on the intensity of color pixels, computed as the neighbours are read.
+	template<typename PixelType>
+	GrayscalePixel sobel_color_kernel(skepu2::Index2D index, const skepu2::Mat<PixelType> image)
+	{
+		int rows = image.rows, cols = image.cols, y = index.row, x = index.col;
+		const PixelType *above = &image.data[max(y - 1, 0) * cols];
+		const PixelType *row   = &image.data[y * cols];
+		const PixelType *below = &image.data[min(y + 1, rows - 1) * cols];
+		int left = max(x - 1, 0), right = min(x + 1, cols - 1);
+		
+		GrayscalePixel result;
+		result.intensity = sobel_magnitude(
+			intensity(above[left]), intensity(above[x]), intensity(above[right]),
+			intensity(row[left]),                        intensity(row[right]),
+			intensity(below[left]), intensity(below[x]), intensity(below[right]));
+		return result;
+	}
+	
+	template<typename PixelType>
+	PixelType sobel_color_to_color_kernel(skepu2::Index2D index, const skepu2::Mat<PixelType> image)
+	{
+		int rows = image.rows, cols = image.cols, y = index.row, x = index.col;
+		const PixelType *above = &image.data[max(y - 1, 0) * cols];
+		const PixelType *row   = &image.data[y * cols];
+		const PixelType *below = &image.data[min(y + 1, rows - 1) * cols];
+		int left = max(x - 1, 0), right = min(x + 1, cols - 1);
+		
+		unsigned char edge = sobel_magnitude(
+			intensity(above[left]), intensity(above[x]), intensity(above[right]),
+			intensity(row[left]),                        intensity(row[right]),
+			intensity(below[left]), intensity(below[x]), intensity(below[right]));
+		
+		PixelType result = row[x];
+		result.red   = edge;
+		result.green = edge;
+		result.blue  = edge;
+		return result;
+	}
+	
+	auto sobel = skepu2::Map<0>(sobel_kernel);
+	auto sobel_rgb = skepu2::Map<0>(sobel_color_kernel<RGBPixel>);
+	auto sobel_rgbx = skepu2::Map<0>(sobel_color_kernel<RGBXPixel>);
+	auto sobel_rgb_to_rgb = skepu2::Map<0>(sobel_color_to_color_kernel<RGBPixel>);
+	auto sobel_rgbx_to_rgbx = skepu2::Map<0>(sobel_color_to_color_kernel<RGBXPixel>);
 	
-	auto convkernels = std::tie(convolution_grayscale, convolution_rgb);
+	auto convkernels = std::tie(convolution_grayscale, convolution_rgb, convolution_rgbx);
+	auto fixedkernels = std::tie(convolution_grayscale_fixed, convolution_rgb_fixed, convolution_rgbx_fixed);
+	auto fixedkernels1 = std::tie(convolution_grayscale_fixed1, convolution_rgb_fixed1, convolution_rgbx_fixed1);
+	auto fixedkernels2 = std::tie(convolution_grayscale_fixed2, convolution_rgb_fixed2, convolution_rgbx_fixed2);
+	auto fixedkernels3 = std::tie(convolution_grayscale_fixed3, convolution_rgb_fixed3, convolution_rgbx_fixed3);
+	auto sobelkernels = std::tie(sobel_rgb, sobel_rgbx);
+	auto sobeltocolorkernels = std::tie(sobel_rgb_to_rgb, sobel_rgbx_to_rgbx);
 	
+	template<typename PixelType, typename Kernel>
+	void convolve_fixed(Kernel &convolution, skepu2::Matrix<PixelType> *img, size_t radius, skepu2::Vector<short> &filter, int shift, skepu2::Overlap mode)
+	{
+		convolution.setBackend(backendSpec());
+		convolution.setOverlap(radius);
+		convolution.setEdgeMode(skepu2::Edge::Duplicate);
+		convolution.setOverlapMode(mode);
+		convolution(*img, *img, filter, shift);
+	}
+	
+	// Picks the specialized convolution for the radius, or the generic one.
 	template<typename PixelType>
-	float gaussian(skepu2::Matrix<PixelType> *img, float blur_sigma)
+	void convolve_fixed(skepu2::Matrix<PixelType> *img, size_t radius, skepu2::Vector<short> &filter, int shift, skepu2::Overlap mode)
+	{
+		const size_t id = PixelTypeID<PixelType>::value;
+		switch (radius)
+		{
+			case 1:  convolve_fixed(std::get<id>(fixedkernels1), img, radius, filter, shift, mode); break;
+			case 2:  convolve_fixed(std::get<id>(fixedkernels2), img, radius, filter, shift, mode); break;
+			case 3:  convolve_fixed(std::get<id>(fixedkernels3), img, radius, filter, shift, mode); break;
+			default: convolve_fixed(std::get<id>(fixedkernels), img, radius, filter, shift, mode); break;
+		}
+	}
+	
+	bool quantize_filter(const float *filter, size_t size, float scaling, short *quantized, int &shift)
+	{
+		// The finest scale at which the coefficients fit 16 bits and the sums of 8-bit values 32 bits
+		for (shift = 30; shift >= 1; shift--)
+		{
+			long long total = 0;
+			bool fits = true;
+			for (size_t i = 0; i < size && fits; i++)
+			{
+				long long q = std::llround(std::ldexp((double)filter[i] * scaling, shift));
+				fits = std::abs(q) <= 32767;
+				total += std::abs(q);
+			}
+			if (fits && 255 * total + (1LL << shift) < (1LL << 31))
+				break;
+		}
+		if (shift < 1)
+			return false;
+		
+		double error = 0;
+		for (size_t i = 0; i < size; i++)
+		{
+			quantized[i] = std::llround(std::ldexp((double)filter[i] * scaling, shift));
+			error += 255 * std::abs(std::ldexp((double)quantized[i], -shift) - (double)filter[i] * scaling);
+		}
+		return error <= FIXED_POINT_ERROR;
+	}
+	
+	// Recursive Gaussian (Young & van Vliet 1995) for large sigmas: a causal and an anticausal
+	// third-order IIR filter along each line, so the cost per pixel does not depend on sigma.
+	// Rows and then columns are filtered in parallel on the host. Borders are extended with the
+	// edge value like the convolution does, using the initial conditions of Triggs & Sdika 2006.
+	// The filter gain is exactly one.
+	const float GAUSSIAN_RECURSIVE_SIGMA = 5.0f;
+	const size_t GAUSSIAN_COLUMN_BLOCK = 256;
+	
+	struct RecursiveGaussian
+	{
+		float B, b1, b2, b3;
+		float M[3][3]; // anticausal start values from the last three causal outputs
+		
+		RecursiveGaussian(float sigma)
+		{
+			double q = (sigma >= 2.5f) ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * std::sqrt(1 - 0.26891 * sigma);
+			double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+			double b[4] = { 0, (2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q) / b0, -(1.4281 * q * q + 1.26661 * q * q * q) / b0, 0.422205 * q * q * q / b0 };
+			this->b1 = b[1];
+			this->b2 = b[2];
+			this->b3 = b[3];
+			this->B = 1 - (b[1] + b[2] + b[3]);
+			
+			// Past the end the input stays at its last value, relative to which the causal filter
+			// decays from its last three outputs. Running both filters over that decay, long enough
+			// for it to vanish, gives the anticausal filter's first three outputs for each of them.
+			const size_t length = 20 * q + 64;
+			std::vector<double> causal(length + 3), anticausal(length + 3);
+			for (int j = 0; j < 3; j++)
+			{
+				std::fill(causal.begin(), causal.end(), 0.0);
+				causal[2 - j] = 1;
+				for (size_t n = 3; n < length + 3; n++)
+					causal[n] = b[1] * causal[n - 1] + b[2] * causal[n - 2] + b[3] * causal[n - 3];
+				
+				std::fill(anticausal.begin(), anticausal.end(), 0.0);
+				for (size_t n = length; n-- > 3; )
+					anticausal[n] = this->B * causal[n] + b[1] * anticausal[n + 1] + b[2] * anticausal[n + 2] + b[3] * anticausal[n + 3];
+				
+				for (int i = 0; i < 3; i++)
+					this->M[i][j] = anticausal[3 + i];
+			}
+		}
+		
+		// Filters lanes signals of length n in place, value i of lane l is at data[i * stride + l].
+		// Lanes are processed together so that columns vectorize.
+		void filter(float *data, size_t n, size_t stride, size_t lanes) const
+		{
+			float w1[GAUSSIAN_COLUMN_BLOCK], w2[GAUSSIAN_COLUMN_BLOCK], w3[GAUSSIAN_COLUMN_BLOCK], last[GAUSSIAN_COLUMN_BLOCK];
+			
+			for (size_t l = 0; l < lanes; l++)
+				w1[l] = w2[l] = w3[l] = data[l];
+			for (size_t i = 0; i < n; i++)
+			{
+				float *values = &data[i * stride];
+				for (size_t l = 0; l < lanes; l++)
+				{
+					float w = this->B * values[l] + this->b1 * w1[l] + this->b2 * w2[l] + this->b3 * w3[l];
+					last[l] = values[l];
+					w3[l] = w2[l];
+					w2[l] = w1[l];
+					w1[l] = values[l] = w;
+				}
+			}
+			
+			for (size_t l = 0; l < lanes; l++)
+			{
+				float d1 = w1[l] - last[l], d2 = w2[l] - last[l], d3 = w3[l] - last[l];
+				w1[l] = last[l] + this->M[0][0] * d1 + this->M[0][1] * d2 + this->M[0][2] * d3;
+				w2[l] = last[l] + this->M[1][0] * d1 + this->M[1][1] * d2 + this->M[1][2] * d3;
+				w3[l] = last[l] + this->M[2][0] * d1 + this->M[2][1] * d2 + this->M[2][2] * d3;
+			}
+			for (size_t i = n; i-- > 0; )
+			{
+				float *values = &data[i * stride];
+				for (size_t l = 0; l < lanes; l++)
+				{
+					float w = this->B * values[l] + this->b1 * w1[l] + this->b2 * w2[l] + this->b3 * w3[l];
+					w3[l] = w2[l];
+					w2[l] = w1[l];
+					w1[l] = values[l] = w;
+				}
+			}
+		}
+	};
+	
+	template<typename PixelType>
+	void gaussian_recursive(PixelType *pixels, size_t rows, size_t cols, float sigma)
+	{
+		const RecursiveGaussian gaussian(sigma);
+		const size_t channels = sizeof(PixelType), width = cols * channels;
+		unsigned char *bytes = reinterpret_cast<unsigned char *>(pixels);
+		std::vector<float> data(bytes, bytes + rows * width);
+		
+		#pragma omp parallel for num_threads(getCPUThreads())
+		for (long y = 0; y < (long)rows; y++)
+			gaussian.filter(&data[y * width], cols, channels, channels);
+		
+		// Columns in blocks, all columns of a block advance row by row
+		const long blocks = (width + GAUSSIAN_COLUMN_BLOCK - 1) / GAUSSIAN_COLUMN_BLOCK;
+		#pragma omp parallel for num_threads(getCPUThreads())
+		for (long b = 0; b < blocks; b++)
+		{
+			size_t first = b * GAUSSIAN_COLUMN_BLOCK;
+			gaussian.filter(&data[first], rows, width, std::min(GAUSSIAN_COLUMN_BLOCK, width - first));
+		}
+		
+		for (size_t i = 0; i < rows * width; i++)
+			bytes[i] = min(max(0.f, data[i] + 0.5f), 255.f);
+	}
+	
+	template<typename PixelType>
+	float gaussian(skepu2::Matrix<PixelType> *img, float blur_sigma, ImageProperties *properties)
 	{
 		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
 		{
+			if (blur_sigma >= GAUSSIAN_RECURSIVE_SIGMA && hostBackend())
+			{
+				img->updateHost();
+				gaussian_recursive(&(*img)[0], img->total_rows(), img->total_cols(), blur_sigma);
+				return;
+			}
+			
 			auto convolution = std::get<PixelTypeID<PixelType>::value>(convkernels);
 			convolution.setBackend(backendSpec());
 			filter_gen.setBackend(backendSpec());
@@ -158,57 +417,89 @@ namespace SkePUImageProcessing
 			float sum = 0;
 			for (float f : filter) sum += f;
 			
+			skepu2::Vector<short> fixedFilter(filter.size());
+			int shift;
+			const bool fixed = quantize_filter(&filter[0], filter.size(), 1.0 / sum, &fixedFilter[0], shift);
+			
 			convolution.setOverlap(blur_radius);
 			convolution.setEdgeMode(skepu2::Edge::Duplicate);
-			convolution.setOverlapMode(skepu2::Overlap::RowColWise);
-			convolution(*img, *img, filter, 0, 1.0);
+			auto convolve = [&](skepu2::Overlap mode)
+			{
+				if (fixed)
+					convolve_fixed(img, blur_radius, fixedFilter, shift, mode);
+				else
+				{
+					convolution.setOverlapMode(mode);
+					convolution(*img, *img, filter, 0, 1.0 / sum);
+				}
+			};
+			
+			// A column pass strides a whole row per tap. On the CPU it is cheaper as a row pass
+			// between two transposes, which walk the image in cache-sized blocks.
+			if (hostBackend())
+			{
+				convolve(skepu2::Overlap::RowWise);
+				transpose(img);
+				convolve(skepu2::Overlap::RowWise);
+				transpose(img);
+			}
+			else
+				convolve(skepu2::Overlap::RowColWise);
 		});
+		
+		if (properties)
+			properties->mixed();
 		return time.count() / 1E6; // us -> s
 	}
 	
 	
-	float edge_gray(skepu2::Matrix<GrayscalePixel> *img)
+	float edge_gray(skepu2::Matrix<GrayscalePixel> *img, ImageProperties *properties)
 	{
 		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
 		{
-			convolution_grayscale.setBackend(backendSpec());
-			distance.setBackend(backendSpec());
-			
-			skepu2::Matrix<GrayscalePixel>
-				tempA(img->total_rows(), img->total_cols()),
-				tempB(img->total_rows(), img->total_cols());
-				
-			// Sobel edge detection
-			skepu2::Vector<float> avrg_filter {  1.0, 2.0, 1.0 };
-			skepu2::Vector<float> diff_filter { -1.0, 0.0, 1.0 };
-			convolution_grayscale.setOverlap(1);
-			
-			convolution_grayscale.setOverlapMode(skepu2::Overlap::RowWise);
-			convolution_grayscale(tempA, *img, diff_filter, 255.0, 0.50); // x-dir
-			convolution_grayscale(tempB, *img, avrg_filter,   0.0, 0.25); // y-dir
-			
-			convolution_grayscale.setOverlapMode(skepu2::Overlap::ColWise);
-			convolution_grayscale(*img,  tempA, avrg_filter,   0.0, 0.25); // x-dir
-			convolution_grayscale(tempA, tempB, diff_filter, 255.0, 0.50); // y-dir
-			
-			// Final computation
-			distance(*img, *img, tempA);
+			sobel.setBackend(backendSpec());
+			skepu2::Matrix<GrayscalePixel> result(img->total_rows(), img->total_cols());
+			sobel(result, *img);
+			*img = std::move(result);
 		});
+		
+		if (properties)
+		{
+			properties->grayscale = true;
+			properties->mixed();
+		}
 		return time.count() / 1E6; // us -> s
 	}
 	
-	float edge_rgb(skepu2::Matrix<RGBPixel> *img)
+	template<typename PixelType>
+	float edge_rgb(skepu2::Matrix<PixelType> *img, ImageProperties *properties)
 	{
 		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
 		{
-			rgb_to_grayscale.setBackend(backendSpec());
-			grayscale_to_rgb.setBackend(backendSpec());
-			
-			skepu2::Matrix<GrayscalePixel> temp(img->total_rows(), img->total_cols());
-			
-			rgb_to_grayscale(temp, *img);
-			edge_gray(&temp);
-			grayscale_to_rgb(*img, temp);
+			auto &sobel_to_color = std::get<ColorTypeID<PixelType>::value>(sobeltocolorkernels);
+			sobel_to_color.setBackend(backendSpec());
+			skepu2::Matrix<PixelType> result(img->total_rows(), img->total_cols());
+			sobel_to_color(result, *img);
+			*img = std::move(result);
+		});
+		
+		if (properties)
+		{
+			properties->grayscale = true;
+			properties->mixed();
+		}
+		return time.count() / 1E6; // us -> s
+	}
+	
+	template<typename PixelType>
+	float edge_intensity(skepu2::Matrix<PixelType> *img, skepu2::Matrix<GrayscalePixel> *result)
+	{
+		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		{
+			auto &sobel_color = std::get<ColorTypeID<PixelType>::value>(sobelkernels);
+			sobel_color.setBackend(backendSpec());
+			result->resize(img->total_rows(), img->total_cols());
+			sobel_color(*result, *img);
 		});
 		return time.count() / 1E6; // us -> s
 	}
@@ -221,6 +512,11 @@ namespace SkePUImageProcessing
 		return spec;
 	}
 	
+	bool hostBackend()
+	{
+		return spec.backend() != skepu2::Backend::Type::OpenCL && spec.backend() != skepu2::Backend::Type::CUDA;
+	}
+	
 	void setBackend(std::string backend)
 	{
 		spec = skepu2::BackendSpec{skepu2::Backend::typeFromString(backend)};
@@ -244,6 +540,11 @@ namespace SkePUImageProcessing
 	}
 	
 	
-	template float gaussian(skepu2::Matrix<GrayscalePixel> *img, float blur_sigma);
-	template float gaussian(skepu2::Matrix<RGBPixel> *img, float blur_sigma);
+	template float gaussian(skepu2::Matrix<GrayscalePixel> *img, float blur_sigma, ImageProperties *properties);
+	template float gaussian(skepu2::Matrix<RGBPixel> *img, float blur_sigma, ImageProperties *properties);
+	template float gaussian(skepu2::Matrix<RGBXPixel> *img, float blur_sigma, ImageProperties *properties);
+	template float edge_rgb(skepu2::Matrix<RGBPixel> *img, ImageProperties *properties);
+	template float edge_rgb(skepu2::Matrix<RGBXPixel> *img, ImageProperties *properties);
+	template float edge_intensity(skepu2::Matrix<RGBPixel> *img, skepu2::Matrix<GrayscalePixel> *result);
+	template float edge_intensity(skepu2::Matrix<RGBXPixel> *img, skepu2::Matrix<GrayscalePixel> *result);
 }
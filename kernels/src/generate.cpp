@@ -1,5 +1,6 @@
 #include <iostream>
 #include <tuple>
+#include <cstring>
 #include <skepu2.hpp>
 
 #include "../include/skepuimg.h"
@@ -41,9 +42,9 @@ namespace SkePUImageProcessing
 		return r;
 	}
 	
-	auto mandelbroter = skepu2::Map<0>([](skepu2::Index2D index, skepu2::Vec<RGBPixel> colors, size_t height, size_t width, float scale, size_t maxiters) -> RGBPixel
+	template<typename PixelType>
+	PixelType mandelbrot_kernel(skepu2::Index2D index, const skepu2::Vec<PixelType> colors, size_t height, size_t width, float scale, size_t maxiters)
 	{
-		RGBPixel r;
 		ComplexFloat a;
 		a.r = scale / height * (index.col - width/2.f) + CENTER_X;
 		a.i = scale / height * (index.row - width/2.f) + CENTER_Y;
@@ -56,14 +57,19 @@ namespace SkePUImageProcessing
 				return colors.data[(size_t)((float)i / maxiters * colors.size)];
 		}
 		return colors.data[colors.size-1];
-	});
+	}
+	
+	auto mandelbroter = skepu2::Map<0>(mandelbrot_kernel<RGBPixel>);
+	auto mandelbroter_x = skepu2::Map<0>(mandelbrot_kernel<RGBXPixel>);
+	auto mandelbrotkernels = std::tie(mandelbroter, mandelbroter_x);
 	
-	skepu2::Vector<RGBPixel> generateColors(size_t numColors)
+	template<typename PixelType>
+	skepu2::Vector<PixelType> generateColors(size_t numColors)
 	{
 		// Gradient color
 		RGBPixel start, stop;
 		
-		skepu2::Vector<RGBPixel> colors(numColors);
+		skepu2::Vector<PixelType> colors(numColors);
 		
 		// Start color
 		start.red   = 219;
@@ -78,7 +84,8 @@ namespace SkePUImageProcessing
 		// Initialize the color vector
 		for (size_t i = 0; i < numColors; i++)
 		{
-			RGBPixel pixel;
+			PixelType pixel;
+			std::memset(&pixel, 255, sizeof(pixel)); // any padding is opaque
 			pixel.green = (stop.green - start.green) * ((double) i / numColors) + start.green;
 			pixel.red   = (stop.red   - start.red  ) * ((double) i / numColors) + start.red;
 			pixel.blue  = (stop.blue  - start.blue ) * ((double) i / numColors) + start.blue;
@@ -88,14 +95,35 @@ namespace SkePUImageProcessing
 		return colors;
 	}
 	
-	float mandelbrot(skepu2::Matrix<RGBPixel> *img, float scale)
+	template<typename PixelType>
+	float mandelbrot(skepu2::Matrix<PixelType> *img, float scale, ImageProperties *properties)
 	{
-		static skepu2::Vector<RGBPixel> colors = generateColors(64);
+		static skepu2::Vector<PixelType> colors = generateColors<PixelType>(64);
 		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
 		{
-			mandelbroter.setBackend(backendSpec());
-			mandelbroter(*img, colors, img->total_rows(), img->total_cols(), scale, 50);
+			auto &kernel = std::get<ColorTypeID<PixelType>::value>(mandelbrotkernels);
+			kernel.setBackend(backendSpec());
+			kernel(*img, colors, img->total_rows(), img->total_cols(), scale, 50);
 		});
+		
+		// every pixel gets one of the gradient colors
+		if (properties)
+		{
+			properties->reset();
+			for (PixelType pixel : colors)
+			{
+				RGBPixel color = { pixel.red, pixel.green, pixel.blue };
+				bool known = false;
+				for (RGBPixel other : properties->palette)
+					known = known || (other.red == color.red && other.green == color.green && other.blue == color.blue);
+				if (!known)
+					properties->palette.push_back(color);
+			}
+		}
 		return time.count() / 1E6; // us -> s
 	}
+	
+	
+	template float mandelbrot(skepu2::Matrix<RGBPixel> *img, float scale, ImageProperties *properties);
+	template float mandelbrot(skepu2::Matrix<RGBXPixel> *img, float scale, ImageProperties *properties);
 }
@@ -1,9 +1,21 @@
 #include <iostream>
 #include <tuple>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cstdint>
+#include <cmath>
+#include <complex>
 #include <skepu2.hpp>
 
 #include "../include/skepuimg.h"
 
+// Unclamped pixel for the intermediate results of separable stencils
+struct RGBFloatPixel
+{
+	float red, green, blue;
+};
+
 namespace SkePUImageProcessing
 {
 	template<typename T>
@@ -18,194 +30,971 @@ namespace SkePUImageProcessing
 		return (a < b) ? a : b;
 	}
 	
-	auto invert_rgb = skepu2::Map<1>([](RGBPixel input)
+	// Histograms of all three channels, interleaved so that the channels of a bin are neighbours
+	// (the fourth lane is padding). 16-bit counts hold windows up to MEDIAN_SHORT_RADIUS, larger
+	// ones take 32-bit counts.
+	const size_t MEDIAN_SHORT_RADIUS = 127; // (2r+1)^2 <= 65535
+	
+	template<typename Count, typename PixelType>
+	void median_add(Count *fineHistogram, Count *coarseHistogram, PixelType pixel)
 	{
-		RGBPixel output;
-		output.red   = 255 - input.red;
-		output.green = 255 - input.green;
-		output.blue  = 255 - input.blue;
-		return output;
-	});
+		fineHistogram[pixel.red   * 4 + 0]++;
+		fineHistogram[pixel.green * 4 + 1]++;
+		fineHistogram[pixel.blue  * 4 + 2]++;
+		coarseHistogram[pixel.red   / 16 * 4 + 0]++;
+		coarseHistogram[pixel.green / 16 * 4 + 1]++;
+		coarseHistogram[pixel.blue  / 16 * 4 + 2]++;
+	}
 	
-	auto invert_grayscale = skepu2::Map<1>([](GrayscalePixel input)
+	// Finds the value at index rank of each channel, searching the coarse bins of all channels together.
+	// The channels are stored into retval, which keeps any padding it has.
+	template<typename Count, typename PixelType>
+	PixelType median_resolve(const Count *fineHistogram, const Count *coarseHistogram, int rank, PixelType retval)
 	{
-		GrayscalePixel output;
-		output.intensity = 255 - input.intensity;
-		return output;
-	});
+		// Per lane: the coarse bin holding the median and the number of values below that bin
+		int coarseIndex[4] = { 0, 0, 0, 0 }, below[4] = { 0, 0, 0, 0 }, sum[4] = { 0, 0, 0, 0 };
+		for (int k = 0; k < 16; k++)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				sum[c] += coarseHistogram[k * 4 + c];
+				int passed = sum[c] <= rank;
+				coarseIndex[c] += passed;
+				below[c] += passed * coarseHistogram[k * 4 + c];
+			}
+		}
+		
+		unsigned char median[3];
+		for (int c = 0; c < 3; c++)
+		{
+			const Count *bins = &fineHistogram[coarseIndex[c] * 16 * 4 + c];
+			int fineIndex = 0, count = below[c];
+			for (int i = 0; i < 15; i++)
+			{
+				count += bins[i * 4];
+				fineIndex += count <= rank;
+			}
+			median[c] = coarseIndex[c] * 16 + fineIndex;
+		}
+		
+		retval.red   = median[0];
+		retval.green = median[1];
+		retval.blue  = median[2];
+		return retval;
+	}
 	
-	float clampf(float min, float val, float max)
+	// Median of each channel over the window, in one pass over the window. Away from the border
+	// the window is read straight from the image, near it the coordinates are clamped, which
+	// duplicates the edge pixels without a padded copy of the image.
+	template<typename PixelType, typename Count>
+	PixelType median_kernel(skepu2::Index2D index, const skepu2::Mat<PixelType> image, int radius)
 	{
-		return (val > max) ? max : ((val < min) ? min : val);
+		Count fineHistogram[256 * 4], coarseHistogram[16 * 4];
+		
+		for (int i = 0; i < 256 * 4; i++)
+			fineHistogram[i] = 0;
+		
+		for (int i = 0; i < 16 * 4; i++)
+			coarseHistogram[i] = 0;
+		
+		int rows = image.rows, cols = image.cols, y = index.row, x = index.col;
+		if (y >= radius && x >= radius && y + radius < rows && x + radius < cols)
+		{
+			const PixelType *center = &image.data[y * cols + x];
+			for (int row = -radius; row <= radius; row++)
+				for (int column = -radius; column <= radius; column++)
+					median_add(fineHistogram, coarseHistogram, center[row * cols + column]);
+		}
+		else
+		{
+			for (int row = -radius; row <= radius; row++)
+			{
+				int sourceRow = min(max(0, y + row), rows - 1);
+				for (int column = -radius; column <= radius; column++)
+					median_add(fineHistogram, coarseHistogram, image.data[sourceRow * cols + min(max(0, x + column), cols - 1)]);
+			}
+		}
+		
+		return median_resolve(fineHistogram, coarseHistogram, 2 * radius * (radius + 1), image.data[y * cols + x]);
 	}
 	
+	auto calculateMedian = skepu2::Map<0>(median_kernel<RGBPixel, unsigned short>);
+	auto calculateMedianX = skepu2::Map<0>(median_kernel<RGBXPixel, unsigned short>);
+	auto calculateMedianWide = skepu2::Map<0>(median_kernel<RGBPixel, unsigned int>);
+	auto calculateMedianWideX = skepu2::Map<0>(median_kernel<RGBXPixel, unsigned int>);
+	auto mediankernels = std::tie(calculateMedian, calculateMedianX);
+	auto widemediankernels = std::tie(calculateMedianWide, calculateMedianWideX);
+	
+	// Constant-time median (Perreault & Hebert 2007) for large radii. Every column keeps a
+	// histogram of the 2r+1 pixels around the current row, and the window histogram slides
+	// along the row by adding the column entering on the right and removing the one leaving on
+	// the left. The window only keeps the 16 coarse bins up to date, the 16 fine bins under a
+	// coarse bin are caught up when the median falls into it. Borders duplicate the edge pixels.
+	const size_t MEDIAN_SLIDING_RADIUS = 4;
+	const size_t MEDIAN_STRIP_WIDTH = 256;
 	
+	struct ColumnHistogram
+	{
+		uint16_t coarse[3][16];
+		uint16_t fine[3][256];
+	};
+	
+	inline size_t clampIndex(long index, size_t size)
+	{
+		return (index < 0) ? 0 : ((size_t)index >= size) ? size - 1 : index;
+	}
+	
+	template<typename PixelType>
+	inline void column_update(ColumnHistogram &column, PixelType pixel, int delta)
+	{
+		const unsigned char *channels = (const unsigned char *)&pixel;
+		for (int c = 0; c < 3; c++)
+		{
+			column.coarse[c][channels[c] / 16] += delta;
+			column.fine[c][channels[c]] += delta;
+		}
+	}
 	
-	auto hue_rgb = skepu2::Map<1>([](RGBPixel input, float H)
+	// Filters the columns [x0, x1) of all rows.
+	template<typename PixelType>
+	void median_strip(const PixelType *in, PixelType *out, size_t rows, size_t cols, size_t radius, size_t x0, size_t x1)
 	{
-		// input RGB values
-		float R = input.red   / 255.0f;
-		float G = input.green / 255.0f;
-		float B = input.blue  / 255.0f;
+		const long r = radius;
+		const uint32_t rank = 2 * radius * (radius + 1); // of the median in the sorted window
 		
-		// Transform to HSI color space
-		float I     = (R + G + B) / 3.0f;
-		float alpha = 1.5f * (R - I);
-		float beta  = sqrt(3.0f) * 0.5f * (G - B);
-	//	float H2 = atan2(beta, alpha);
-		float C     = sqrt(alpha * alpha + beta * beta);
+		// The columns windows in this strip can reach
+		const size_t first = (x0 > radius) ? x0 - radius : 0;
+		const size_t last = std::min(x1 + radius, cols);
+		std::vector<ColumnHistogram> columns(last - first);
+		auto column = [&](long x) -> ColumnHistogram & { return columns[clampIndex(x, cols) - first]; };
 		
-		// Transform back to RGB
-		beta  = sin(H) * C;
-		alpha = cos(H) * C;
+		for (size_t x = first; x < last; x++)
+			for (long dy = -r; dy <= r; dy++)
+				column_update(columns[x - first], in[clampIndex(dy, rows) * cols + x], 1);
 		
-		// update RGB values
-		RGBPixel output;
-		output.red   = clampf(0.f, I + (2.0f / 3.0f) * alpha, 1.f) * 255.0;
-		output.green = clampf(0.f, I - alpha / 3.0f + beta / sqrt(3.0f), 1.f) * 255.0;
-		output.blue  = clampf(0.f, I - alpha / 3.0f - beta / sqrt(3.0f), 1.f) * 255.0;
-		return output;
-	});
+		for (size_t y = 0; y < rows; y++)
+		{
+			if (y > 0)
+				for (size_t x = first; x < last; x++)
+				{
+					column_update(columns[x - first], in[clampIndex((long)y - r - 1, rows) * cols + x], -1);
+					column_update(columns[x - first], in[clampIndex((long)y + r, rows) * cols + x], 1);
+				}
+			
+			for (int c = 0; c < 3; c++)
+			{
+				uint32_t coarse[16] = {0}, fine[16][16];
+				long updated[16]; // the x the fine bins were last caught up to
+				for (int k = 0; k < 16; k++)
+					updated[k] = -1;
+				
+				for (long dx = -r; dx <= r; dx++)
+					for (int k = 0; k < 16; k++)
+						coarse[k] += column(x0 + dx).coarse[c][k];
+				
+				for (long x = x0; x < (long)x1; x++)
+				{
+					if (x > (long)x0)
+					{
+						const uint16_t *enter = column(x + r).coarse[c], *leave = column(x - r - 1).coarse[c];
+						for (int k = 0; k < 16; k++)
+							coarse[k] += enter[k] - leave[k];
+					}
+					
+					uint32_t count = 0;
+					int k = 0;
+					while (count + coarse[k] <= rank)
+						count += coarse[k++];
+					
+					if (updated[k] < 0 || x - updated[k] > 2 * r + 1)
+					{
+						for (int i = 0; i < 16; i++)
+							fine[k][i] = 0;
+						for (long dx = -r; dx <= r; dx++)
+						{
+							const uint16_t *bins = &column(x + dx).fine[c][k * 16];
+							for (int i = 0; i < 16; i++)
+								fine[k][i] += bins[i];
+						}
+					}
+					else
+					{
+						for (long xs = updated[k] + 1; xs <= x; xs++)
+						{
+							const uint16_t *enter = &column(xs + r).fine[c][k * 16], *leave = &column(xs - r - 1).fine[c][k * 16];
+							for (int i = 0; i < 16; i++)
+								fine[k][i] += enter[i] - leave[i];
+						}
+					}
+					updated[k] = x;
+					
+					int i = 0;
+					while (count + fine[k][i] <= rank)
+						count += fine[k][i++];
+					((unsigned char *)&out[y * cols + x])[c] = k * 16 + i;
+				}
+			}
+		}
+	}
 	
+	template<typename PixelType>
+	void median_sliding(const PixelType *in, PixelType *out, size_t rows, size_t cols, size_t radius)
+	{
+		// Strips narrow enough for the column histograms to stay in cache, but wide compared to
+		// the 2r columns of overlap each strip keeps on its sides.
+		const size_t width = std::max(MEDIAN_STRIP_WIDTH, 4 * radius);
+		const long strips = (cols + width - 1) / width;
+		
+		#pragma omp parallel for schedule(dynamic) num_threads(getCPUThreads())
+		for (long s = 0; s < strips; s++)
+			median_strip(in, out, rows, cols, radius, s * width, std::min((s + 1) * width, cols));
+	}
 	
 	template<typename PixelType>
-	float invert(skepu2::Matrix<PixelType> *img)
+	float median(skepu2::Matrix<PixelType> *img, size_t radius, ImageProperties *properties)
 	{
 		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
 		{
-			auto kernel = std::get<PixelTypeID<PixelType>::value>(std::tie(invert_grayscale, invert_rgb));
-			kernel.setBackend(backendSpec());
-			kernel(*img, *img);
+			if (radius >= MEDIAN_SLIDING_RADIUS && hostBackend())
+			{
+				img->updateHost();
+				std::vector<PixelType> source(&(*img)[0], &(*img)[0] + img->size());
+				median_sliding(source.data(), &(*img)[0], img->total_rows(), img->total_cols(), radius);
+				return;
+			}
+			
+			skepu2::Matrix<PixelType> result(img->total_rows(), img->total_cols());
+			if (radius <= MEDIAN_SHORT_RADIUS)
+			{
+				auto &kernel = std::get<ColorTypeID<PixelType>::value>(mediankernels);
+				kernel.setBackend(backendSpec());
+				kernel(result, *img, (int)radius);
+			}
+			else
+			{
+				auto &kernel = std::get<ColorTypeID<PixelType>::value>(widemediankernels);
+				kernel.setBackend(backendSpec());
+				kernel(result, *img, (int)radius);
+			}
+			*img = std::move(result);
 		});
+		
+		// every channel value comes from the neighbourhood, but the channels can come from different pixels
+		if (properties && !properties->grayscale)
+			properties->palette.clear();
 		return time.count() / 1E6; // us -> s
 	}
 	
-	float hue(skepu2::Matrix<RGBPixel> *img, float hue)
+	
+	// Weighted sum over the window the size of the filter. Like the median, only pixels near the
+	// border pay for clamping their coordinates.
+	template<typename PixelType>
+	PixelType stencil_kernel(skepu2::Index2D index, const skepu2::Mat<PixelType> image, const skepu2::Mat<float> filter, float scaling)
 	{
-		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		int rows = image.rows, cols = image.cols, y = index.row, x = index.col;
+		int ox = (filter.cols - 1) / 2, oy = (filter.rows - 1) / 2;
+		
+		float red = 0, green = 0, blue = 0;
+		if (y >= oy && x >= ox && y + oy < rows && x + ox < cols)
 		{
-			hue_rgb.setBackend(backendSpec());
-			hue_rgb(*img, *img, hue);
-		});
-		return time.count() / 1E6; // us -> s
+			const PixelType *center = &image.data[y * cols + x];
+			for (int row = -oy; row <= oy; ++row)
+				for (int column = -ox; column <= ox; ++column)
+				{
+					PixelType elem = center[row * cols + column];
+					float coeff = filter.data[(row + oy) * (2 * ox + 1) + (column + ox)];
+					red   += elem.red   * coeff;
+					green += elem.green * coeff;
+					blue  += elem.blue  * coeff;
+				}
+		}
+		else
+		{
+			for (int row = -oy; row <= oy; ++row)
+			{
+				int sourceRow = min(max(0, y + row), rows - 1);
+				for (int column = -ox; column <= ox; ++column)
+				{
+					PixelType elem = image.data[sourceRow * cols + min(max(0, x + column), cols - 1)];
+					float coeff = filter.data[(row + oy) * (2 * ox + 1) + (column + ox)];
+					red   += elem.red   * coeff;
+					green += elem.green * coeff;
+					blue  += elem.blue  * coeff;
+				}
+			}
+		}
+		
+		PixelType res = image.data[y * cols + x];
+		res.red   = min(max(0.f, red   * scaling), 255.f);
+		res.green = min(max(0.f, green * scaling), 255.f);
+		res.blue  = min(max(0.f, blue  * scaling), 255.f);
+		return res;
 	}
 	
-	unsigned char median_helper(int ox, int oy, size_t stride, const RGBPixel *image [[skepu::overlapArrayForward]], size_t offset)
+	auto calculateStencil = skepu2::Map<0>(stencil_kernel<RGBPixel>);
+	auto calculateStencilX = skepu2::Map<0>(stencil_kernel<RGBXPixel>);
+	auto stencilkernels = std::tie(calculateStencil, calculateStencilX);
+	
+	// The stencil in fixed point, for filters quantize_filter() accepts. Scaling is folded into the coefficients.
+	template<typename PixelType>
+	PixelType stencil_fixed_kernel(skepu2::Index2D index, const skepu2::Mat<PixelType> image, const skepu2::Mat<short> filter, int shift)
 	{
-		long fineHistogram[256], coarseHistogram[16];
+		int rows = image.rows, cols = image.cols, y = index.row, x = index.col;
+		int ox = (filter.cols - 1) / 2, oy = (filter.rows - 1) / 2;
 		
-		for (int i = 0; i < 256; i++)
-			fineHistogram[i] = 0;
+		int red = 1 << (shift - 1), green = red, blue = red;
+		if (y >= oy && x >= ox && y + oy < rows && x + ox < cols)
+		{
+			const PixelType *center = &image.data[y * cols + x];
+			for (int row = -oy; row <= oy; ++row)
+				for (int column = -ox; column <= ox; ++column)
+				{
+					PixelType elem = center[row * cols + column];
+					int coeff = filter.data[(row + oy) * (2 * ox + 1) + (column + ox)];
+					red   += elem.red   * coeff;
+					green += elem.green * coeff;
+					blue  += elem.blue  * coeff;
+				}
+		}
+		else
+		{
+			for (int row = -oy; row <= oy; ++row)
+			{
+				int sourceRow = min(max(0, y + row), rows - 1);
+				for (int column = -ox; column <= ox; ++column)
+				{
+					PixelType elem = image.data[sourceRow * cols + min(max(0, x + column), cols - 1)];
+					int coeff = filter.data[(row + oy) * (2 * ox + 1) + (column + ox)];
+					red   += elem.red   * coeff;
+					green += elem.green * coeff;
+					blue  += elem.blue  * coeff;
+				}
+			}
+		}
 		
-		for (int i = 0; i < 16; i++)
-			coarseHistogram[i] = 0;
+		PixelType res = image.data[y * cols + x];
+		res.red   = min(max(0, red   >> shift), 255);
+		res.green = min(max(0, green >> shift), 255);
+		res.blue  = min(max(0, blue  >> shift), 255);
+		return res;
+	}
+	
+	auto calculateStencilFixed = skepu2::Map<0>(stencil_fixed_kernel<RGBPixel>);
+	auto calculateStencilFixedX = skepu2::Map<0>(stencil_fixed_kernel<RGBXPixel>);
+	
+	// stencil_fixed_kernel for square stencils with the radius known at compile time, so that the
+	// window loops unroll and the coefficient indices are constants.
+	template<typename PixelType, int R>
+	PixelType stencil_fixed_radius_kernel(skepu2::Index2D index, const skepu2::Mat<PixelType> image, const skepu2::Mat<short> filter, int shift)
+	{
+		int rows = image.rows, cols = image.cols, y = index.row, x = index.col;
 		
-		for (int row = -oy; row <= oy; row++)
+		int red = 1 << (shift - 1), green = red, blue = red;
+		if (y >= R && x >= R && y + R < rows && x + R < cols)
 		{
-			for (int column = -ox; column <= ox; column += 1)
-			{ 
-				unsigned char imageValue = ((unsigned char *)(&image[row * stride + column]))[offset];
-				fineHistogram[imageValue]++;
-				coarseHistogram[imageValue / 16]++;
+			const PixelType *center = &image.data[y * cols + x];
+			for (int row = -R; row <= R; ++row)
+				for (int column = -R; column <= R; ++column)
+				{
+					PixelType elem = center[row * cols + column];
+					int coeff = filter.data[(row + R) * (2 * R + 1) + (column + R)];
+					red   += elem.red   * coeff;
+					green += elem.green * coeff;
+					blue  += elem.blue  * coeff;
+				}
+		}
+		else
+		{
+			for (int row = -R; row <= R; ++row)
+			{
+				int sourceRow = min(max(0, y + row), rows - 1);
+				for (int column = -R; column <= R; ++column)
+				{
+					PixelType elem = image.data[sourceRow * cols + min(max(0, x + column), cols - 1)];
+					int coeff = filter.data[(row + R) * (2 * R + 1) + (column + R)];
+					red   += elem.red   * coeff;
+					green += elem.green * coeff;
+					blue  += elem.blue  * coeff;
+				}
 			}
 		}
 		
-		int count = 2 * oy * (oy + 1);
+		PixelType res = image.data[y * cols + x];
+		res.red   = min(max(0, red   >> shift), 255);
+		res.green = min(max(0, green >> shift), 255);
+		res.blue  = min(max(0, blue  >> shift), 255);
+		return res;
+	}
+	
+	auto calculateStencilFixed3x3 = skepu2::Map<0>(stencil_fixed_radius_kernel<RGBPixel, 1>);
+	auto calculateStencilFixed5x5 = skepu2::Map<0>(stencil_fixed_radius_kernel<RGBPixel, 2>);
+	auto calculateStencilFixed7x7 = skepu2::Map<0>(stencil_fixed_radius_kernel<RGBPixel, 3>);
+	auto calculateStencilFixedX3x3 = skepu2::Map<0>(stencil_fixed_radius_kernel<RGBXPixel, 1>);
+	auto calculateStencilFixedX5x5 = skepu2::Map<0>(stencil_fixed_radius_kernel<RGBXPixel, 2>);
+	auto calculateStencilFixedX7x7 = skepu2::Map<0>(stencil_fixed_radius_kernel<RGBXPixel, 3>);
+	
+	auto stencilfixedkernels = std::tie(calculateStencilFixed, calculateStencilFixedX);
+	auto stencilfixed3x3kernels = std::tie(calculateStencilFixed3x3, calculateStencilFixedX3x3);
+	auto stencilfixed5x5kernels = std::tie(calculateStencilFixed5x5, calculateStencilFixedX5x5);
+	auto stencilfixed7x7kernels = std::tie(calculateStencilFixed7x7, calculateStencilFixedX7x7);
+	
+	template<typename PixelType, typename Kernel>
+	void run_stencil_fixed(Kernel &kernel, skepu2::Matrix<PixelType> &result, skepu2::Matrix<PixelType> &img, skepu2::Matrix<short> &filter, int shift)
+	{
+		kernel.setBackend(backendSpec());
+		kernel(result, img, filter, shift);
+	}
+	
+	// Picks the specialized kernel for the stencil size, or the generic one.
+	template<typename PixelType>
+	void stencil_fixed(skepu2::Matrix<PixelType> &result, skepu2::Matrix<PixelType> &img, skepu2::Matrix<short> &filter, int shift)
+	{
+		const size_t id = ColorTypeID<PixelType>::value;
+		const size_t radius = (filter.total_rows() == filter.total_cols()) ? (filter.total_rows() - 1) / 2 : 0;
+		switch (radius)
+		{
+			case 1:  run_stencil_fixed(std::get<id>(stencilfixed3x3kernels), result, img, filter, shift); break;
+			case 2:  run_stencil_fixed(std::get<id>(stencilfixed5x5kernels), result, img, filter, shift); break;
+			case 3:  run_stencil_fixed(std::get<id>(stencilfixed7x7kernels), result, img, filter, shift); break;
+			default: run_stencil_fixed(std::get<id>(stencilfixedkernels), result, img, filter, shift); break;
+		}
+	}
+	
+	// Row and column passes of one rank-1 term of a stencil. Unlike convolution_rgb they keep
+	// the intermediate in float: signed terms such as the halves of a Sobel filter would be
+	// clamped to 0 otherwise, and the terms of a low-rank stencil only make sense summed.
+	template<typename PixelType>
+	RGBFloatPixel separable_rows_kernel(int o, size_t stride, const PixelType *image, const skepu2::Vec<float> filter)
+	{
+		RGBFloatPixel res = { 0, 0, 0 };
+		for (int i = -o; i <= o; i++)
+		{
+			PixelType p = image[i*stride];
+			res.red   += p.red   * filter[i+o];
+			res.green += p.green * filter[i+o];
+			res.blue  += p.blue  * filter[i+o];
+		}
+		return res;
+	}
+	
+	auto separable_rows = skepu2::MapOverlap(separable_rows_kernel<RGBPixel>);
+	auto separable_rows_x = skepu2::MapOverlap(separable_rows_kernel<RGBXPixel>);
+	
+	auto separable_columns = skepu2::MapOverlap([](int o, size_t stride, const RGBFloatPixel *image, const skepu2::Vec<float> filter) -> RGBFloatPixel
+	{
+		RGBFloatPixel res = { 0, 0, 0 };
+		for (int i = -o; i <= o; i++)
+		{
+			RGBFloatPixel p = image[i*stride];
+			res.red   += p.red   * filter[i+o];
+			res.green += p.green * filter[i+o];
+			res.blue  += p.blue  * filter[i+o];
+		}
+		return res;
+	});
+	
+	auto separable_add = skepu2::Map<2>([](RGBFloatPixel a, RGBFloatPixel b) -> RGBFloatPixel
+	{
+		RGBFloatPixel res;
+		res.red   = a.red   + b.red;
+		res.green = a.green + b.green;
+		res.blue  = a.blue  + b.blue;
+		return res;
+	});
+	
+	// Takes the original pixel for the padding of RGBXPixel
+	template<typename PixelType>
+	PixelType separable_finish_kernel(PixelType original, RGBFloatPixel p, float scaling)
+	{
+		PixelType res = original;
+		res.red   = min(max(0.f, p.red   * scaling), 255.f);
+		res.green = min(max(0.f, p.green * scaling), 255.f);
+		res.blue  = min(max(0.f, p.blue  * scaling), 255.f);
+		return res;
+	}
+	
+	auto separable_finish = skepu2::Map<2>(separable_finish_kernel<RGBPixel>);
+	auto separable_finish_x = skepu2::Map<2>(separable_finish_kernel<RGBXPixel>);
+	
+	auto separablerowkernels = std::tie(separable_rows, separable_rows_x);
+	auto separablefinishkernels = std::tie(separable_finish, separable_finish_x);
+	
+	// A separable term makes three passes over the image through float intermediates where the
+	// direct kernel makes one, so it has to save at least this factor in taps to be worth it.
+	const size_t STENCIL_SEPARABLE_COST = 2;
+	
+	// One rank-1 term of a stencil: coefficient (i, j) is column[i] * row[j].
+	struct SeparableTerm
+	{
+		std::vector<float> column, row;
+	};
+	
+	// Splits the stencil into rank-1 terms by a one-sided Jacobi SVD, largest first. Terms with
+	// a singular value below float precision of the largest are dropped, so the terms add up to
+	// the stencil up to rounding, and a separable stencil comes out as a single term.
+	std::vector<SeparableTerm> separable_terms(const float *stencil, size_t rows, size_t cols)
+	{
+		// Rotating pairs of columns of a until they are orthogonal, v collects the rotations: a = stencil * v
+		std::vector<double> a(stencil, stencil + rows * cols), v(cols * cols, 0);
+		for (size_t j = 0; j < cols; j++)
+			v[j * cols + j] = 1;
+		
+		for (int sweep = 0; sweep < 64; sweep++)
+		{
+			bool rotated = false;
+			for (size_t p = 0; p < cols; p++)
+				for (size_t q = p + 1; q < cols; q++)
+				{
+					double alpha = 0, beta = 0, gamma = 0;
+					for (size_t i = 0; i < rows; i++)
+					{
+						double ap = a[i * cols + p], aq = a[i * cols + q];
+						alpha += ap * ap;
+						beta  += aq * aq;
+						gamma += ap * aq;
+					}
+					if (std::abs(gamma) <= 1E-15 * std::sqrt(alpha * beta))
+						continue;
+					
+					rotated = true;
+					double zeta = (beta - alpha) / (2 * gamma);
+					double t = std::copysign(1.0, zeta) / (std::abs(zeta) + std::sqrt(1 + zeta * zeta));
+					double c = 1 / std::sqrt(1 + t * t), s = c * t;
+					auto rotate = [&](std::vector<double> &m, size_t n, size_t stride)
+					{
+						for (size_t i = 0; i < n; i++)
+						{
+							double mp = m[i * stride + p], mq = m[i * stride + q];
+							m[i * stride + p] = c * mp - s * mq;
+							m[i * stride + q] = s * mp + c * mq;
+						}
+					};
+					rotate(a, rows, cols);
+					rotate(v, cols, cols);
+				}
+			if (!rotated)
+				break;
+		}
+		
+		// The columns of a are now the left singular vectors scaled by the singular values
+		std::vector<double> sigma(cols, 0);
+		for (size_t j = 0; j < cols; j++)
+		{
+			for (size_t i = 0; i < rows; i++)
+				sigma[j] += a[i * cols + j] * a[i * cols + j];
+			sigma[j] = std::sqrt(sigma[j]);
+		}
 		
-		unsigned char coarseIndex;
-		for (coarseIndex = 0; coarseIndex < 16; ++coarseIndex)
+		std::vector<size_t> order(cols);
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&](size_t x, size_t y) { return sigma[x] > sigma[y]; });
+		
+		std::vector<SeparableTerm> terms;
+		for (size_t j : order)
 		{
-			if ((long)count - coarseHistogram[coarseIndex] < 0) break;
-			count -= coarseHistogram[coarseIndex];
+			if (sigma[j] == 0 || sigma[j] < 1E-6 * sigma[order[0]])
+				break;
+			
+			SeparableTerm term;
+			for (size_t i = 0; i < rows; i++)
+				term.column.push_back(a[i * cols + j]);
+			for (size_t i = 0; i < cols; i++)
+				term.row.push_back(v[i * cols + j]);
+			terms.push_back(term);
 		}
+		return terms;
+	}
+	
+	template<typename PixelType>
+	void stencil_separable(skepu2::Matrix<PixelType> *img, const std::vector<SeparableTerm> &terms, float scaling)
+	{
+		const size_t rows = img->total_rows(), cols = img->total_cols();
+		skepu2::Matrix<RGBFloatPixel> horizontal(rows, cols), sum(rows, cols), term(rows, cols);
+		auto &separable_rows = std::get<ColorTypeID<PixelType>::value>(separablerowkernels);
+		auto &separable_finish = std::get<ColorTypeID<PixelType>::value>(separablefinishkernels);
 		
-		unsigned char fineIndex = coarseIndex * 16;
-		while ((long)count - fineHistogram[fineIndex] >= 0)
-			count -= fineHistogram[fineIndex++];
+		separable_rows.setBackend(backendSpec());
+		separable_rows.setEdgeMode(skepu2::Edge::Duplicate);
+		separable_rows.setOverlapMode(skepu2::Overlap::RowWise);
+		separable_columns.setBackend(backendSpec());
+		separable_columns.setEdgeMode(skepu2::Edge::Duplicate);
+		separable_columns.setOverlapMode(skepu2::Overlap::ColWise);
+		separable_add.setBackend(backendSpec());
+		separable_finish.setBackend(backendSpec());
 		
-		return fineIndex;
+		for (size_t t = 0; t < terms.size(); t++)
+		{
+			skepu2::Vector<float> row(terms[t].row.size()), column(terms[t].column.size());
+			for (size_t i = 0; i < row.size(); i++)
+				row[i] = terms[t].row[i];
+			for (size_t i = 0; i < column.size(); i++)
+				column[i] = terms[t].column[i];
+			
+			separable_rows.setOverlap((row.size() - 1) / 2);
+			separable_rows(horizontal, *img, row);
+			separable_columns.setOverlap((column.size() - 1) / 2);
+			if (t == 0)
+				separable_columns(sum, horizontal, column);
+			else
+			{
+				separable_columns(term, horizontal, column);
+				separable_add(sum, sum, term);
+			}
+		}
+		separable_finish(*img, *img, sum, scaling);
 	}
 	
-	RGBPixel median_kernel(int ox, int oy, size_t stride, const RGBPixel *image)
+	// FFT convolution for large stencils that are not separable. The image is cut into tiles that
+	// are transformed together with a border of the stencil size read with clamped coordinates
+	// (overlap-save), so the edges are duplicated like in the direct kernel and every tile writes
+	// its own part of the result. Red and green are transformed as the real and imaginary parts
+	// of one complex tile, which is exact because the stencil is real.
+	typedef std::complex<float> Complex;
+	
+	// Without -ffast-math the operator of std::complex calls into a library routine to handle NaNs
+	inline Complex multiply(Complex a, Complex b)
 	{
-		RGBPixel retval;
-		retval.red   = median_helper(ox, oy, stride, image, 0);
-		retval.green = median_helper(ox, oy, stride, image, 1);
-		retval.blue  = median_helper(ox, oy, stride, image, 2);
-		return retval;
+		return Complex(a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real());
 	}
-	auto calculateMedian = skepu2::MapOverlap(median_kernel);
 	
-	template<typename T>
-	T oversample_kernel(skepu2::Index2D index, const skepu2::Mat<T> img, size_t radiusY, size_t radiusX)
+	// Radix-2 FFT of a power-of-two size, in place. The inverse is not normalized.
+	class FFT
 	{
-		size_t x = min(max(radiusX, index.col), img.cols + radiusX - 1) - radiusX;
-		size_t y = min(max(radiusY, index.row), img.rows + radiusY - 1) - radiusY;
-		return img.data[y * img.cols + x];
+	public:
+		explicit FFT(size_t size): size(size), twiddles(size / 2), reversed(size)
+		{
+			const double pi = std::acos(-1.0);
+			for (size_t k = 0; k < size / 2; k++)
+				twiddles[k] = std::polar(1.0, -2 * pi * k / size);
+			
+			for (size_t i = 0, j = 0; i < size; i++)
+			{
+				reversed[i] = j;
+				size_t bit = size >> 1;
+				for (; j & bit; bit >>= 1)
+					j ^= bit;
+				j |= bit;
+			}
+		}
+		
+		void operator()(Complex *data, bool inverse) const
+		{
+			for (size_t i = 0; i < size; i++)
+				if (i < reversed[i])
+					std::swap(data[i], data[reversed[i]]);
+			
+			for (size_t half = 1; half < size; half *= 2)
+			{
+				const size_t step = size / (2 * half);
+				for (size_t start = 0; start < size; start += 2 * half)
+					for (size_t k = 0; k < half; k++)
+					{
+						Complex w = inverse ? std::conj(twiddles[k * step]) : twiddles[k * step];
+						Complex a = data[start + k], b = multiply(w, data[start + k + half]);
+						data[start + k] = a + b;
+						data[start + k + half] = a - b;
+					}
+			}
+		}
+		
+	private:
+		size_t size;
+		std::vector<Complex> twiddles;
+		std::vector<size_t> reversed;
+	};
+	
+	// Transforms the rows [0, rowCount) of a P x Q tile along x, and all columns along y.
+	// Forward transforms do the rows first and inverse ones the columns, so that the inverse
+	// only needs the rows that are kept.
+	void fft2d(Complex *tile, size_t P, size_t Q, size_t rowCount, const FFT &rowFFT, const FFT &columnFFT, Complex *column, bool inverse)
+	{
+		auto rows = [&]
+		{
+			for (size_t u = 0; u < rowCount; u++)
+				rowFFT(&tile[u * Q], inverse);
+		};
+		
+		if (!inverse)
+			rows();
+		for (size_t v = 0; v < Q; v++)
+		{
+			for (size_t u = 0; u < P; u++)
+				column[u] = tile[u * Q + v];
+			columnFFT(column, inverse);
+			for (size_t u = 0; u < P; u++)
+				tile[u * Q + v] = column[u];
+		}
+		if (inverse)
+			rows();
 	}
 	
-	auto oversampler = skepu2::Map<0>(oversample_kernel<RGBPixel>);
+	// Cost model, in multiply-adds of the direct kernel per output pixel and channel. A butterfly
+	// costs about FFT_BUTTERFLY_COST of them, and every tile takes four 2D transforms (red and
+	// green packed, blue, and both inverses) and two products with the stencil spectrum.
+	const double FFT_BUTTERFLY_COST = 5;
+	const size_t FFT_MAX_TILE = 256;
 	
-	template<typename T>
-	skepu2::Matrix<T> oversample(skepu2::Matrix<T> &img, size_t radiusY, size_t radiusX)
+	double fft_cost(size_t P, size_t Q, size_t kh, size_t kw)
 	{
-		// Create a matrix which fits the image and the padding needed.
-		skepu2::Matrix<T> res(img.total_rows() + 2 * radiusY, img.total_cols() + 2 * radiusX);
-		oversampler.setBackend(backendSpec());
-		oversampler(res, img, radiusY, radiusX);
-		return res;
+		const double outputs = (double)(P - kh + 1) * (Q - kw + 1);
+		const double butterflies = P * Q / 2.0 * std::log2((double)P * Q);
+		return (4 * FFT_BUTTERFLY_COST * butterflies + 2 * P * Q) / (3 * outputs);
 	}
 	
-	float median(skepu2::Matrix<RGBPixel> *img, size_t radius)
+	// The cheapest tile size for the stencil, zero by zero if no tile fits
+	void fft_tile(size_t rows, size_t cols, size_t kh, size_t kw, size_t &P, size_t &Q, double &cost)
+	{
+		P = Q = 0;
+		cost = 0;
+		for (size_t p = 2; p <= FFT_MAX_TILE; p *= 2)
+			for (size_t q = 2; q <= FFT_MAX_TILE; q *= 2)
+			{
+				// Tiles beyond the image plus its border are wasted
+				if (p < kh || q < kw || p / 2 >= rows + kh - 1 || q / 2 >= cols + kw - 1)
+					continue;
+				double c = fft_cost(p, q, kh, kw);
+				if (P == 0 || c < cost)
+				{
+					P = p;
+					Q = q;
+					cost = c;
+				}
+			}
+	}
+	
+	template<typename PixelType>
+	void stencil_fft(const PixelType *in, PixelType *out, size_t rows, size_t cols, const float *stencil, size_t kh, size_t kw, float scaling, size_t P, size_t Q)
 	{
+		const FFT rowFFT(Q), columnFFT(P);
+		const size_t oy = (kh - 1) / 2, ox = (kw - 1) / 2;
+		const size_t th = P - kh + 1, tw = Q - kw + 1;
+		
+		// Stencil coefficient (i, j) goes to (-i, -j), which turns the circular convolution of a tile
+		// into the stencil applied at the tile's top left corner. Scaling and the normalization of
+		// the inverse transform are folded in.
+		std::vector<Complex> spectrum(P * Q), column(P);
+		for (size_t i = 0; i < kh; i++)
+			for (size_t j = 0; j < kw; j++)
+				spectrum[(P - i) % P * Q + (Q - j) % Q] = stencil[i * kw + j] * scaling / (P * Q);
+		fft2d(spectrum.data(), P, Q, P, rowFFT, columnFFT, column.data(), false);
+		
+		const long tilesX = (cols + tw - 1) / tw, tiles = (rows + th - 1) / th * tilesX;
+		
+		#pragma omp parallel num_threads(getCPUThreads())
+		{
+			std::vector<Complex> redGreen(P * Q), blue(P * Q), column(P);
+			
+			#pragma omp for schedule(dynamic)
+			for (long t = 0; t < tiles; t++)
+			{
+				const size_t y0 = t / tilesX * th, x0 = t % tilesX * tw;
+				for (size_t u = 0; u < P; u++)
+				{
+					const PixelType *source = &in[clampIndex((long)(y0 + u) - oy, rows) * cols];
+					for (size_t v = 0; v < Q; v++)
+					{
+						PixelType p = source[clampIndex((long)(x0 + v) - ox, cols)];
+						redGreen[u * Q + v] = Complex(p.red, p.green);
+						blue[u * Q + v] = Complex(p.blue, 0);
+					}
+				}
+				
+				for (Complex *channels : { redGreen.data(), blue.data() })
+				{
+					fft2d(channels, P, Q, P, rowFFT, columnFFT, column.data(), false);
+					for (size_t i = 0; i < P * Q; i++)
+						channels[i] = multiply(channels[i], spectrum[i]);
+					fft2d(channels, P, Q, th, rowFFT, columnFFT, column.data(), true);
+				}
+				
+				for (size_t u = 0; u < th && y0 + u < rows; u++)
+					for (size_t v = 0; v < tw && x0 + v < cols; v++)
+					{
+						PixelType &res = out[(y0 + u) * cols + x0 + v];
+						res.red   = min(max(0.f, redGreen[u * Q + v].real()), 255.f);
+						res.green = min(max(0.f, redGreen[u * Q + v].imag()), 255.f);
+						res.blue  = min(max(0.f, blue[u * Q + v].real()), 255.f);
+					}
+			}
+		}
+	}
+	
+	// How stencil() applies a stencil to an image of a given size
+	struct StencilPlan
+	{
+		enum Path { Direct, Separable, FFT } path = Direct;
+		std::vector<SeparableTerm> terms; // for Separable
+		size_t P = 0, Q = 0;              // FFT tile size
+	};
+	
+	StencilPlan plan_stencil(const float *stencil, size_t rows, size_t cols, size_t imageRows, size_t imageCols)
+	{
+		StencilPlan plan;
+		plan.terms = separable_terms(stencil, rows, cols);
+		if (!plan.terms.empty() && plan.terms.size() * (rows + cols) * STENCIL_SEPARABLE_COST <= rows * cols)
+		{
+			plan.path = StencilPlan::Separable;
+			return plan;
+		}
+		
+		double cost;
+		fft_tile(imageRows, imageCols, rows, cols, plan.P, plan.Q, cost);
+		if (plan.P != 0 && cost < rows * cols && hostBackend())
+			plan.path = StencilPlan::FFT;
+		return plan;
+	}
+	
+	template<typename PixelType>
+	float stencil(skepu2::Matrix<PixelType> *img, skepu2::Matrix<float> *stencil, float scaling, ImageProperties *properties)
+	{
+		// The FFT path transforms blue apart from red and green, so gray pixels can come out
+		// slightly colored. The other paths compute every channel the same way.
+		bool sameChannels = true;
 		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
 		{
-			skepu2::Matrix<RGBPixel> temp = oversample(*img, radius, radius);
-			std::cout << temp.total_cols() << "\n";
-			calculateMedian.setBackend(backendSpec());
-			calculateMedian.setOverlap(radius);
-			calculateMedian(*img, temp);
+			const size_t rows = stencil->total_rows(), cols = stencil->total_cols();
+			stencil->updateHost();
+			const StencilPlan plan = plan_stencil(&(*stencil)[0], rows, cols, img->total_rows(), img->total_cols());
+			if (plan.path == StencilPlan::Separable)
+			{
+				stencil_separable(img, plan.terms, scaling);
+				return;
+			}
+			
+			if (plan.path == StencilPlan::FFT)
+			{
+				img->updateHost();
+				std::vector<PixelType> source(&(*img)[0], &(*img)[0] + img->size());
+				stencil_fft(source.data(), &(*img)[0], img->total_rows(), img->total_cols(), &(*stencil)[0], rows, cols, scaling, plan.P, plan.Q);
+				sameChannels = false;
+				return;
+			}
+			
+			skepu2::Matrix<PixelType> result(img->total_rows(), img->total_cols());
+			skepu2::Matrix<short> fixedStencil(rows, cols);
+			int shift;
+			if (quantize_filter(&(*stencil)[0], rows * cols, scaling, &fixedStencil[0], shift))
+				stencil_fixed(result, *img, fixedStencil, shift);
+			else
+			{
+				auto &kernel = std::get<ColorTypeID<PixelType>::value>(stencilkernels);
+				kernel.setBackend(backendSpec());
+				kernel(result, *img, *stencil, scaling);
+			}
+			*img = std::move(result);
 		});
+		
+		if (properties)
+		{
+			properties->mixed();
+			properties->grayscale = properties->grayscale && sameChannels;
+		}
 		return time.count() / 1E6; // us -> s
 	}
 	
 	
-	auto stencil_kernel = skepu2::MapOverlap([](int ox, int oy, size_t stride, const RGBPixel *m, const skepu2::Mat<float> filter, float scaling) -> RGBPixel
+	// The direct stencil kernels for one plane of a planar image
+	GrayscalePixel stencil_plane_kernel(skepu2::Index2D index, const skepu2::Mat<GrayscalePixel> image, const skepu2::Mat<float> filter, float scaling)
 	{
-		float red = 0, green = 0, blue = 0;
-		for (int y = -oy; y <= oy; ++y)
-			for (int x = -ox; x <= ox; ++x)
+		int rows = image.rows, cols = image.cols, y = index.row, x = index.col;
+		int ox = (filter.cols - 1) / 2, oy = (filter.rows - 1) / 2;
+		
+		float sum = 0;
+		if (y >= oy && x >= ox && y + oy < rows && x + ox < cols)
+		{
+			const GrayscalePixel *center = &image.data[y * cols + x];
+			for (int row = -oy; row <= oy; ++row)
+				for (int column = -ox; column <= ox; ++column)
+					sum += center[row * cols + column].intensity * filter.data[(row + oy) * (2 * ox + 1) + (column + ox)];
+		}
+		else
+		{
+			for (int row = -oy; row <= oy; ++row)
 			{
-				RGBPixel elem = m[y*(int)stride+x];
-				float coeff = filter.data[(y+oy)*(2*ox+1) + (x+ox)];
-				red   += elem.red   * coeff;
-				green += elem.green * coeff;
-				blue  += elem.blue  * coeff;
+				int sourceRow = min(max(0, y + row), rows - 1);
+				for (int column = -ox; column <= ox; ++column)
+					sum += image.data[sourceRow * cols + min(max(0, x + column), cols - 1)].intensity * filter.data[(row + oy) * (2 * ox + 1) + (column + ox)];
 			}
+		}
 		
-		RGBPixel res;
-		res.red   = min(max(0.f, red   * scaling), 255.f);
-		res.green = min(max(0.f, green * scaling), 255.f);
-		res.blue  = min(max(0.f, blue  * scaling), 255.f);
+		GrayscalePixel res;
+		res.intensity = min(max(0.f, sum * scaling), 255.f);
 		return res;
-	});
+	}
+	
+	GrayscalePixel stencil_plane_fixed_kernel(skepu2::Index2D index, const skepu2::Mat<GrayscalePixel> image, const skepu2::Mat<short> filter, int shift)
+	{
+		int rows = image.rows, cols = image.cols, y = index.row, x = index.col;
+		int ox = (filter.cols - 1) / 2, oy = (filter.rows - 1) / 2;
+		
+		int sum = 1 << (shift - 1);
+		if (y >= oy && x >= ox && y + oy < rows && x + ox < cols)
+		{
+			const GrayscalePixel *center = &image.data[y * cols + x];
+			for (int row = -oy; row <= oy; ++row)
+				for (int column = -ox; column <= ox; ++column)
+					sum += center[row * cols + column].intensity * filter.data[(row + oy) * (2 * ox + 1) + (column + ox)];
+		}
+		else
+		{
+			for (int row = -oy; row <= oy; ++row)
+			{
+				int sourceRow = min(max(0, y + row), rows - 1);
+				for (int column = -ox; column <= ox; ++column)
+					sum += image.data[sourceRow * cols + min(max(0, x + column), cols - 1)].intensity * filter.data[(row + oy) * (2 * ox + 1) + (column + ox)];
+			}
+		}
+		
+		GrayscalePixel res;
+		res.intensity = min(max(0, sum >> shift), 255);
+		return res;
+	}
 	
-	float stencil(skepu2::Matrix<RGBPixel> *img, skepu2::Matrix<float> *stencil, float scaling)
+	auto calculateStencilPlane = skepu2::Map<0>(stencil_plane_kernel);
+	auto calculateStencilPlaneFixed = skepu2::Map<0>(stencil_plane_fixed_kernel);
+	
+	// Stencils that stencil() would not apply directly run on an interleaved copy, as the
+	// separable and FFT paths work on RGB pixels.
+	float stencil_planar(PlanarImage *img, skepu2::Matrix<float> *stencil, float scaling, ImageProperties *properties)
 	{
 		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
 		{
-			size_t overlapX = (stencil->total_cols() - 1) / 2;
-			size_t overlapY = (stencil->total_rows() - 1) / 2;
-			skepu2::Matrix<RGBPixel> temp = oversample(*img, overlapY, overlapX);
+			const size_t rows = stencil->total_rows(), cols = stencil->total_cols();
+			stencil->updateHost();
+			if (plan_stencil(&(*stencil)[0], rows, cols, img->total_rows(), img->total_cols()).path != StencilPlan::Direct)
+			{
+				skepu2::Matrix<RGBPixel> interleaved;
+				interleave(img, &interleaved);
+				SkePUImageProcessing::stencil(&interleaved, stencil, scaling, properties);
+				deinterleave(&interleaved, img);
+				return;
+			}
+			
+			skepu2::Matrix<short> fixedStencil(rows, cols);
+			int shift;
+			const bool fixed = quantize_filter(&(*stencil)[0], rows * cols, scaling, &fixedStencil[0], shift);
+			calculateStencilPlane.setBackend(backendSpec());
+			calculateStencilPlaneFixed.setBackend(backendSpec());
 			
-			stencil_kernel.setBackend(backendSpec());
-			stencil_kernel.setOverlap(overlapX, overlapY);
-			stencil_kernel(*img, temp, *stencil, scaling);
+			for (skepu2::Matrix<GrayscalePixel> *plane : { &img->red, &img->green, &img->blue })
+			{
+				skepu2::Matrix<GrayscalePixel> result(plane->total_rows(), plane->total_cols());
+				if (fixed)
+					calculateStencilPlaneFixed(result, *plane, fixedStencil, shift);
+				else
+					calculateStencilPlane(result, *plane, *stencil, scaling);
+				*plane = std::move(result);
+			}
 		});
+		
+		if (properties)
+			properties->mixed();
 		return time.count() / 1E6; // us -> s
 	}
 	
 	
-	template float invert(skepu2::Matrix<GrayscalePixel> *img);
-	template float invert(skepu2::Matrix<RGBPixel> *img);
+	template float median(skepu2::Matrix<RGBPixel> *img, size_t radius, ImageProperties *properties);
+	template float median(skepu2::Matrix<RGBXPixel> *img, size_t radius, ImageProperties *properties);
+	template float stencil(skepu2::Matrix<RGBPixel> *img, skepu2::Matrix<float> *stencil, float scaling, ImageProperties *properties);
+	template float stencil(skepu2::Matrix<RGBXPixel> *img, skepu2::Matrix<float> *stencil, float scaling, ImageProperties *properties);
 }
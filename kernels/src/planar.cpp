@@ -0,0 +1,105 @@
+#include <iostream>
+#include <cstring>
+#include <tuple>
+#include <skepu2.hpp>
+
+#include "../include/skepuimg.h"
+
+namespace SkePUImageProcessing
+{
+	template<typename PixelType>
+	GrayscalePixel extract_channel_kernel(PixelType pixel, int channel)
+	{
+		GrayscalePixel result;
+		result.intensity = (channel == 0) ? pixel.red : (channel == 1) ? pixel.green : pixel.blue;
+		return result;
+	}
+	
+	// Takes the pixel it replaces, so that any padding of the image is kept
+	template<typename PixelType>
+	PixelType combine_channels_kernel(PixelType pixel, GrayscalePixel red, GrayscalePixel green, GrayscalePixel blue)
+	{
+		PixelType result = pixel;
+		result.red   = red.intensity;
+		result.green = green.intensity;
+		result.blue  = blue.intensity;
+		return result;
+	}
+	
+	auto extract_channel = skepu2::Map<1>(extract_channel_kernel<RGBPixel>);
+	auto extract_channel_x = skepu2::Map<1>(extract_channel_kernel<RGBXPixel>);
+	auto combine_channels = skepu2::Map<4>(combine_channels_kernel<RGBPixel>);
+	auto combine_channels_x = skepu2::Map<4>(combine_channels_kernel<RGBXPixel>);
+	
+	auto extractkernels = std::tie(extract_channel, extract_channel_x);
+	auto combinekernels = std::tie(combine_channels, combine_channels_x);
+	
+	template<typename PixelType>
+	float deinterleave(skepu2::Matrix<PixelType> *img, PlanarImage *planar)
+	{
+		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		{
+			const size_t rows = img->total_rows(), cols = img->total_cols();
+			planar->red   = skepu2::Matrix<GrayscalePixel>(rows, cols);
+			planar->green = skepu2::Matrix<GrayscalePixel>(rows, cols);
+			planar->blue  = skepu2::Matrix<GrayscalePixel>(rows, cols);
+			
+			// A map has a single output, so the kernels take one pass per plane. The host does all three in one.
+			if (hostBackend())
+			{
+				img->updateHost();
+				const PixelType *in = &(*img)[0];
+				GrayscalePixel *red = &planar->red[0], *green = &planar->green[0], *blue = &planar->blue[0];
+				
+				#pragma omp parallel for num_threads(getCPUThreads())
+				for (long i = 0; i < (long)(rows * cols); i++)
+				{
+					red[i].intensity   = in[i].red;
+					green[i].intensity = in[i].green;
+					blue[i].intensity  = in[i].blue;
+				}
+				return;
+			}
+			
+			auto &extract_channel = std::get<ColorTypeID<PixelType>::value>(extractkernels);
+			extract_channel.setBackend(backendSpec());
+			extract_channel(planar->red, *img, 0);
+			extract_channel(planar->green, *img, 1);
+			extract_channel(planar->blue, *img, 2);
+		});
+		return time.count() / 1E6; // us -> s
+	}
+	
+	template<typename PixelType>
+	float interleave(PlanarImage *planar, skepu2::Matrix<PixelType> *img)
+	{
+		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		{
+			const size_t rows = planar->total_rows(), cols = planar->total_cols();
+			*img = skepu2::Matrix<PixelType>(rows, cols);
+			std::memset(&(*img)[0], 255, rows * cols * sizeof(PixelType)); // any padding is opaque
+			
+			auto &combine_channels = std::get<ColorTypeID<PixelType>::value>(combinekernels);
+			combine_channels.setBackend(backendSpec());
+			combine_channels(*img, *img, planar->red, planar->green, planar->blue);
+		});
+		return time.count() / 1E6; // us -> s
+	}
+	
+	float gaussian_planar(PlanarImage *img, float blur_sigma, ImageProperties *properties)
+	{
+		float time = 0;
+		for (skepu2::Matrix<GrayscalePixel> *plane : { &img->red, &img->green, &img->blue })
+			time += gaussian(plane, blur_sigma);
+		
+		if (properties)
+			properties->mixed();
+		return time;
+	}
+	
+	
+	template float deinterleave(skepu2::Matrix<RGBPixel> *img, PlanarImage *planar);
+	template float deinterleave(skepu2::Matrix<RGBXPixel> *img, PlanarImage *planar);
+	template float interleave(PlanarImage *planar, skepu2::Matrix<RGBPixel> *img);
+	template float interleave(PlanarImage *planar, skepu2::Matrix<RGBXPixel> *img);
+}
@@ -0,0 +1,560 @@
+#include <iostream>
+#include <tuple>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <skepu2.hpp>
+
+#include "../include/skepuimg.h"
+
+namespace SkePUImageProcessing
+{
+	template<typename T>
+	T max(T a, T b)
+	{
+		return (a > b) ? a : b;
+	}
+	
+	template<typename T>
+	T min(T a, T b)
+	{
+		return (a < b) ? a : b;
+	}
+	
+	[[skepu::userconstant]] constexpr int
+		POINT_INVERT     = 0,
+		POINT_HUE        = 1,
+		POINT_DESATURATE = 2,
+		POINT_BLACKWHITE = 3;
+	
+	static_assert(POINT_INVERT == point::Invert && POINT_HUE == point::Hue && POINT_DESATURATE == point::Desaturate
+		&& POINT_BLACKWHITE == point::BlackWhite, "kernel constants must match point::Type");
+	
+	template<typename PixelType>
+	inline unsigned char intensity(PixelType input)
+	{
+		return ((unsigned int)input.red + (unsigned int)input.green + (unsigned int)input.blue) / 3;
+	}
+	
+	float clampf(float min, float val, float max)
+	{
+		return (val > max) ? max : ((val < min) ? min : val);
+	}
+	
+	
+	// The color operations start from the input pixel, so that RGBXPixel keeps its padding
+	template<typename PixelType>
+	PixelType invert_color(PixelType input)
+	{
+		PixelType output = input;
+		output.red   = 255 - input.red;
+		output.green = 255 - input.green;
+		output.blue  = 255 - input.blue;
+		return output;
+	}
+	
+	template<typename PixelType>
+	PixelType hue_color(PixelType input, float H)
+	{
+		// input RGB values
+		float R = input.red   / 255.0f;
+		float G = input.green / 255.0f;
+		float B = input.blue  / 255.0f;
+		
+		// Transform to HSI color space
+		float I     = (R + G + B) / 3.0f;
+		float alpha = 1.5f * (R - I);
+		float beta  = sqrt(3.0f) * 0.5f * (G - B);
+	//	float H2 = atan2(beta, alpha);
+		float C     = sqrt(alpha * alpha + beta * beta);
+		
+		// Transform back to RGB
+		beta  = sin(H) * C;
+		alpha = cos(H) * C;
+		
+		// update RGB values
+		PixelType output = input;
+		output.red   = clampf(0.f, I + (2.0f / 3.0f) * alpha, 1.f) * 255.0;
+		output.green = clampf(0.f, I - alpha / 3.0f + beta / sqrt(3.0f), 1.f) * 255.0;
+		output.blue  = clampf(0.f, I - alpha / 3.0f - beta / sqrt(3.0f), 1.f) * 255.0;
+		return output;
+	}
+	
+	template<typename PixelType>
+	PixelType desaturate_color(PixelType input, float saturation)
+	{
+		PixelType output = input;
+		unsigned char in = intensity(input) * (1 - saturation);
+		output.red   = input.red   * saturation + in;
+		output.green = input.green * saturation + in;
+		output.blue  = input.blue  * saturation + in;
+		return output;
+	}
+	
+	template<typename PixelType>
+	PixelType blackwhite_color(PixelType input)
+	{
+		PixelType output = input;
+		unsigned char in = (intensity(input) > 127) ? 255 : 0;
+		output.red   = in;
+		output.green = in;
+		output.blue  = in;
+		return output;
+	}
+	
+	// A chain of point operations in one pass, given as (type, parameter) pairs in order.
+	// Every pixel takes the same branches, so on GPUs the chain does not diverge.
+	template<typename PixelType>
+	PixelType point_chain_kernel(PixelType pixel, const skepu2::Vec<float> chain)
+	{
+		for (size_t i = 0; i + 1 < chain.size; i += 2)
+		{
+			int type = chain[i];
+			float parameter = chain[i + 1];
+			if (type == POINT_INVERT)
+				pixel = invert_color(pixel);
+			else if (type == POINT_HUE)
+				pixel = hue_color(pixel, parameter);
+			else if (type == POINT_DESATURATE)
+				pixel = desaturate_color(pixel, parameter);
+			else if (type == POINT_BLACKWHITE)
+				pixel = blackwhite_color(pixel);
+		}
+		return pixel;
+	}
+	
+	// Tetrahedral interpolation in a size^3 table of RGB floats: of the six tetrahedra splitting
+	// the grid cell, the one holding the pixel is chosen by the order of the fractional parts.
+	template<typename PixelType>
+	PixelType lut_kernel(PixelType pixel, const skepu2::Vec<float> table, int size)
+	{
+		float scale = (size - 1) / 255.f;
+		float r = pixel.red * scale, g = pixel.green * scale, b = pixel.blue * scale;
+		int ri = min((int)r, size - 2), gi = min((int)g, size - 2), bi = min((int)b, size - 2);
+		float fr = r - ri, fg = g - gi, fb = b - bi;
+		
+		int sb = 3, sg = 3 * size, sr = 3 * size * size;
+		int base = ri * sr + gi * sg + bi * sb;
+		
+		// weights of the cell corners 000, first, second and 111
+		float w0, w1, w2, w3;
+		int first, second;
+		if (fr > fg)
+		{
+			if (fg > fb)      { w0 = 1 - fr; w1 = fr - fg; w2 = fg - fb; w3 = fb; first = sr; second = sr + sg; }
+			else if (fr > fb) { w0 = 1 - fr; w1 = fr - fb; w2 = fb - fg; w3 = fg; first = sr; second = sr + sb; }
+			else              { w0 = 1 - fb; w1 = fb - fr; w2 = fr - fg; w3 = fg; first = sb; second = sr + sb; }
+		}
+		else
+		{
+			if (fb > fg)      { w0 = 1 - fb; w1 = fb - fg; w2 = fg - fr; w3 = fr; first = sb; second = sg + sb; }
+			else if (fb > fr) { w0 = 1 - fg; w1 = fg - fb; w2 = fb - fr; w3 = fr; first = sg; second = sg + sb; }
+			else              { w0 = 1 - fg; w1 = fg - fr; w2 = fr - fb; w3 = fb; first = sg; second = sr + sg; }
+		}
+		int last = sr + sg + sb;
+		
+		float channels[3];
+		for (int c = 0; c < 3; c++)
+			channels[c] = w0 * table[base + c] + w1 * table[base + first + c] + w2 * table[base + second + c] + w3 * table[base + last + c];
+		
+		PixelType output = pixel;
+		output.red   = clampf(0.f, channels[0] + 0.5f, 255.f);
+		output.green = clampf(0.f, channels[1] + 0.5f, 255.f);
+		output.blue  = clampf(0.f, channels[2] + 0.5f, 255.f);
+		return output;
+	}
+	
+	// Each channel at its value or, for fromIntensity, at the pixel intensity, in a 3 x 256 table
+	template<typename PixelType>
+	PixelType tone_kernel(PixelType input, const skepu2::Vec<unsigned char> table, int fromIntensity)
+	{
+		unsigned char red = input.red, green = input.green, blue = input.blue;
+		if (fromIntensity)
+			red = green = blue = intensity(input);
+		
+		PixelType output = input;
+		output.red   = table[red];
+		output.green = table[256 + green];
+		output.blue  = table[512 + blue];
+		return output;
+	}
+	
+	
+	auto invert_grayscale = skepu2::Map<1>([](GrayscalePixel input)
+	{
+		GrayscalePixel output;
+		output.intensity = 255 - input.intensity;
+		return output;
+	});
+	
+	auto hue_rgb = skepu2::Map<1>(hue_color<RGBPixel>);
+	auto hue_rgbx = skepu2::Map<1>(hue_color<RGBXPixel>);
+	auto desaturate_rgb = skepu2::Map<1>(desaturate_color<RGBPixel>);
+	auto desaturate_rgbx = skepu2::Map<1>(desaturate_color<RGBXPixel>);
+	auto tone_rgb = skepu2::Map<1>(tone_kernel<RGBPixel>);
+	auto tone_rgbx = skepu2::Map<1>(tone_kernel<RGBXPixel>);
+	auto tone_plane = skepu2::Map<1>([](GrayscalePixel input, const skepu2::Vec<unsigned char> table) -> GrayscalePixel
+	{
+		GrayscalePixel output;
+		output.intensity = table[input.intensity];
+		return output;
+	});
+	auto point_chain_rgb = skepu2::Map<1>(point_chain_kernel<RGBPixel>);
+	auto point_chain_rgbx = skepu2::Map<1>(point_chain_kernel<RGBXPixel>);
+	auto lut_rgb = skepu2::Map<1>(lut_kernel<RGBPixel>);
+	auto lut_rgbx = skepu2::Map<1>(lut_kernel<RGBXPixel>);
+	
+	// Indexed by ColorTypeID
+	auto huekernels = std::tie(hue_rgb, hue_rgbx);
+	auto desaturatekernels = std::tie(desaturate_rgb, desaturate_rgbx);
+	auto tonekernels = std::tie(tone_rgb, tone_rgbx);
+	auto pointchainkernels = std::tie(point_chain_rgb, point_chain_rgbx);
+	auto lutkernels = std::tie(lut_rgb, lut_rgbx);
+	
+	
+	// What an operation does to the colors an image is known to have
+	void update_properties(ImageProperties *properties, point::Operation operation)
+	{
+		switch (operation.type)
+		{
+			case point::Invert:
+				// 255 - v keeps gray levels and bit depths, the palette is inverted with the image
+				for (RGBPixel &color : properties->palette)
+					color = invert_color(color);
+				break;
+			
+			case point::Hue:
+				// rounding can make gray pixels slightly colored
+				properties->reset();
+				break;
+			
+			case point::Desaturate:
+				properties->grayscale = properties->grayscale || operation.parameter == 0;
+				properties->mixed();
+				break;
+			
+			case point::BlackWhite:
+				properties->grayscale = true;
+				properties->bitDepth = 1;
+				properties->palette = { { 0, 0, 0 }, { 255, 255, 255 } };
+				break;
+		}
+	}
+	
+	// Gray images keep their own kernel, color images are inverted with a tone curve
+	float invert_image(skepu2::Matrix<GrayscalePixel> *img)
+	{
+		return skepu2::benchmark::measureExecTime([&]
+		{
+			invert_grayscale.setBackend(backendSpec());
+			invert_grayscale(*img, *img);
+		}).count() / 1E6; // us -> s
+	}
+	
+	template<typename PixelType>
+	float invert_image(skepu2::Matrix<PixelType> *img)
+	{
+		return tone(img, ToneCurve::invert());
+	}
+	
+	template<typename PixelType>
+	float invert(skepu2::Matrix<PixelType> *img, ImageProperties *properties)
+	{
+		float time = invert_image(img);
+		if (properties)
+			update_properties(properties, point::invert());
+		return time;
+	}
+	
+	template<typename PixelType>
+	float hue(skepu2::Matrix<PixelType> *img, float hue, ImageProperties *properties)
+	{
+		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		{
+			auto &kernel = std::get<ColorTypeID<PixelType>::value>(huekernels);
+			kernel.setBackend(backendSpec());
+			kernel(*img, *img, hue);
+		});
+		
+		if (properties)
+			update_properties(properties, point::hue(hue));
+		return time.count() / 1E6; // us -> s
+	}
+	
+	template<typename PixelType>
+	float desaturate(skepu2::Matrix<PixelType> *img, float saturation, ImageProperties *properties)
+	{
+		// without saturation the result is just the intensity
+		if (saturation == 0)
+			return tone(img, ToneCurve::identity(), ToneInput::Intensity, properties);
+		
+		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		{
+			auto &kernel = std::get<ColorTypeID<PixelType>::value>(desaturatekernels);
+			kernel.setBackend(backendSpec());
+			kernel(*img, *img, saturation);
+		});
+		
+		if (properties)
+			update_properties(properties, point::desaturate(saturation));
+		return time.count() / 1E6; // us -> s
+	}
+	
+	template<typename PixelType>
+	float blackwhite(skepu2::Matrix<PixelType> *img, ImageProperties *properties)
+	{
+		return tone(img, ToneCurve::threshold(127), ToneInput::Intensity, properties);
+	}
+	
+	
+	ToneCurve ToneCurve::identity()
+	{
+		ToneCurve curve;
+		for (int c = 0; c < 3; c++)
+			for (int v = 0; v < 256; v++)
+				curve.table[c][v] = v;
+		return curve;
+	}
+	
+	ToneCurve ToneCurve::invert()
+	{
+		ToneCurve curve;
+		for (int c = 0; c < 3; c++)
+			for (int v = 0; v < 256; v++)
+				curve.table[c][v] = 255 - v;
+		return curve;
+	}
+	
+	ToneCurve ToneCurve::threshold(unsigned char level)
+	{
+		ToneCurve curve;
+		for (int c = 0; c < 3; c++)
+			for (int v = 0; v < 256; v++)
+				curve.table[c][v] = (v > level) ? 255 : 0;
+		return curve;
+	}
+	
+	ToneCurve ToneCurve::levels(unsigned char black, unsigned char white, float gamma)
+	{
+		ToneCurve curve;
+		float range = std::max(white - black, 1);
+		for (int c = 0; c < 3; c++)
+			for (int v = 0; v < 256; v++)
+			{
+				float x = clampf(0.f, (v - black) / range, 1.f);
+				curve.table[c][v] = std::pow(x, 1 / gamma) * 255 + 0.5f;
+			}
+		return curve;
+	}
+	
+	ToneCurve ToneCurve::gamma(float gamma)
+	{
+		return levels(0, 255, gamma);
+	}
+	
+	ToneCurve ToneCurve::contrast(float amount)
+	{
+		ToneCurve curve;
+		for (int c = 0; c < 3; c++)
+			for (int v = 0; v < 256; v++)
+				curve.table[c][v] = clampf(0.f, 127.5f + (v - 127.5f) * amount + 0.5f, 255.f);
+		return curve;
+	}
+	
+	ToneCurve ToneCurve::then(const ToneCurve &next) const
+	{
+		ToneCurve curve;
+		for (int c = 0; c < 3; c++)
+			for (int v = 0; v < 256; v++)
+				curve.table[c][v] = next.table[c][this->table[c][v]];
+		return curve;
+	}
+	
+	// What a tone curve does to the colors an image is known to have
+	void tone_properties(ImageProperties *properties, const ToneCurve &curve, ToneInput input)
+	{
+		bool sameTables = std::equal(curve.table[0], curve.table[0] + 256, curve.table[1])
+		               && std::equal(curve.table[0], curve.table[0] + 256, curve.table[2]);
+		
+		// The values the curve is looked up at: the levels of the bit depth for channels,
+		// anything for the intensity, which averages channels.
+		unsigned step = (input == ToneInput::Channels) ? 255 / ((1u << properties->bitDepth) - 1) : 1;
+		unsigned bitDepth = 1;
+		for (int c = 0; c < 3; c++)
+			for (int v = 0; v < 256; v += step)
+				while (bitDepth < 8 && curve.table[c][v] % (255 / ((1u << bitDepth) - 1)) != 0)
+					bitDepth *= 2;
+		
+		for (RGBPixel &color : properties->palette)
+		{
+			RGBPixel at = color;
+			if (input == ToneInput::Intensity)
+				at.red = at.green = at.blue = intensity(color);
+			color.red   = curve.table[0][at.red];
+			color.green = curve.table[1][at.green];
+			color.blue  = curve.table[2][at.blue];
+		}
+		
+		// Colors the curve merged are kept once, so that saving sees how many are left
+		auto key = [](RGBPixel p) { return std::make_tuple(p.red, p.green, p.blue); };
+		std::vector<RGBPixel> &palette = properties->palette;
+		std::sort(palette.begin(), palette.end(), [&](RGBPixel a, RGBPixel b) { return key(a) < key(b); });
+		palette.erase(std::unique(palette.begin(), palette.end(), [&](RGBPixel a, RGBPixel b) { return key(a) == key(b); }), palette.end());
+		properties->grayscale = sameTables && (properties->grayscale || input == ToneInput::Intensity);
+		properties->bitDepth = bitDepth;
+	}
+	
+	template<typename PixelType>
+	float tone(skepu2::Matrix<PixelType> *img, const ToneCurve &curve, ToneInput input, ImageProperties *properties)
+	{
+		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		{
+			skepu2::Vector<unsigned char> table(3 * 256);
+			for (int c = 0; c < 3; c++)
+				for (int v = 0; v < 256; v++)
+					table[c * 256 + v] = curve.table[c][v];
+			
+			auto &kernel = std::get<ColorTypeID<PixelType>::value>(tonekernels);
+			kernel.setBackend(backendSpec());
+			kernel(*img, *img, table, (int)(input == ToneInput::Intensity));
+		});
+		
+		if (properties)
+			tone_properties(properties, curve, input);
+		return time.count() / 1E6; // us -> s
+	}
+	
+	float tone_planar(PlanarImage *img, const ToneCurve &curve, ImageProperties *properties)
+	{
+		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		{
+			skepu2::Matrix<GrayscalePixel> *planes[3] = { &img->red, &img->green, &img->blue };
+			tone_plane.setBackend(backendSpec());
+			for (int c = 0; c < 3; c++)
+			{
+				skepu2::Vector<unsigned char> table(256);
+				for (int v = 0; v < 256; v++)
+					table[v] = curve.table[c][v];
+				tone_plane(*planes[c], *planes[c], table);
+			}
+		});
+		
+		if (properties)
+			tone_properties(properties, curve, ToneInput::Channels);
+		return time.count() / 1E6; // us -> s
+	}
+	
+	float invert_planar(PlanarImage *img, ImageProperties *properties)
+	{
+		float time = tone_planar(img, ToneCurve::invert());
+		if (properties)
+			update_properties(properties, point::invert());
+		return time;
+	}
+	
+	template<typename PixelType>
+	float apply(skepu2::Matrix<PixelType> *img, const PointChain &chain, ImageProperties *properties)
+	{
+		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		{
+			if (chain.empty())
+				return;
+			
+			skepu2::Vector<float> encoded(2 * chain.size());
+			for (size_t i = 0; i < chain.size(); i++)
+			{
+				encoded[2 * i]     = chain[i].type;
+				encoded[2 * i + 1] = chain[i].parameter;
+			}
+			
+			auto &kernel = std::get<ColorTypeID<PixelType>::value>(pointchainkernels);
+			kernel.setBackend(backendSpec());
+			kernel(*img, *img, encoded);
+		});
+		
+		if (properties)
+			for (point::Operation operation : chain)
+				update_properties(properties, operation);
+		return time.count() / 1E6; // us -> s
+	}
+	
+	ColorLUT::ColorLUT(size_t size): size(std::max<size_t>(size, 2)) {}
+	
+	void ColorLUT::build(const PointChain &chain)
+	{
+		this->table.resize(this->size * this->size * this->size * 3);
+		
+		// The operations work on 8-bit pixels, so the grid nodes are rounded to them
+		std::vector<unsigned char> levels(this->size);
+		for (size_t i = 0; i < this->size; i++)
+			levels[i] = i * 255.f / (this->size - 1) + 0.5f;
+		
+		std::vector<float> encoded;
+		for (point::Operation operation : chain)
+		{
+			encoded.push_back(operation.type);
+			encoded.push_back(operation.parameter);
+		}
+		
+		size_t node = 0;
+		for (size_t r = 0; r < this->size; r++)
+			for (size_t g = 0; g < this->size; g++)
+				for (size_t b = 0; b < this->size; b++)
+				{
+					RGBPixel pixel;
+					pixel.red   = levels[r];
+					pixel.green = levels[g];
+					pixel.blue  = levels[b];
+					pixel = point_chain_kernel(pixel, skepu2::Vec<float>{ encoded.data(), encoded.size() });
+					this->table[node++] = pixel.red;
+					this->table[node++] = pixel.green;
+					this->table[node++] = pixel.blue;
+				}
+		
+		this->baked = chain;
+		this->built = true;
+	}
+	
+	template<typename PixelType>
+	float ColorLUT::apply(skepu2::Matrix<PixelType> *img, const PointChain &chain, ImageProperties *properties)
+	{
+		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		{
+			auto same = [](point::Operation a, point::Operation b) { return a.type == b.type && a.parameter == b.parameter; };
+			if (!this->built || chain.size() != this->baked.size() || !std::equal(chain.begin(), chain.end(), this->baked.begin(), same))
+				this->build(chain);
+			
+			auto &kernel = std::get<ColorTypeID<PixelType>::value>(lutkernels);
+			kernel.setBackend(backendSpec());
+			kernel(*img, *img, this->table, (int)this->size);
+		});
+		
+		// Gray stays gray, the nodes on the gray diagonal are the only ones it interpolates
+		// between, but interpolated values are no longer on the chain's palette or levels.
+		if (properties)
+		{
+			for (point::Operation operation : chain)
+				update_properties(properties, operation);
+			properties->mixed();
+		}
+		return time.count() / 1E6; // us -> s
+	}
+	
+	
+	template float invert(skepu2::Matrix<GrayscalePixel> *img, ImageProperties *properties);
+	template float invert(skepu2::Matrix<RGBPixel> *img, ImageProperties *properties);
+	template float invert(skepu2::Matrix<RGBXPixel> *img, ImageProperties *properties);
+	
+	template float hue(skepu2::Matrix<RGBPixel> *img, float hue, ImageProperties *properties);
+	template float hue(skepu2::Matrix<RGBXPixel> *img, float hue, ImageProperties *properties);
+	template float desaturate(skepu2::Matrix<RGBPixel> *img, float saturation, ImageProperties *properties);
+	template float desaturate(skepu2::Matrix<RGBXPixel> *img, float saturation, ImageProperties *properties);
+	template float blackwhite(skepu2::Matrix<RGBPixel> *img, ImageProperties *properties);
+	template float blackwhite(skepu2::Matrix<RGBXPixel> *img, ImageProperties *properties);
+	template float tone(skepu2::Matrix<RGBPixel> *img, const ToneCurve &curve, ToneInput input, ImageProperties *properties);
+	template float tone(skepu2::Matrix<RGBXPixel> *img, const ToneCurve &curve, ToneInput input, ImageProperties *properties);
+	template float apply(skepu2::Matrix<RGBPixel> *img, const PointChain &chain, ImageProperties *properties);
+	template float apply(skepu2::Matrix<RGBXPixel> *img, const PointChain &chain, ImageProperties *properties);
+	template float ColorLUT::apply(skepu2::Matrix<RGBPixel> *img, const PointChain &chain, ImageProperties *properties);
+	template float ColorLUT::apply(skepu2::Matrix<RGBXPixel> *img, const PointChain &chain, ImageProperties *properties);
+}
@@ -0,0 +1,105 @@
+#include <iostream>
+#include <algorithm>
+#include <skepu2.hpp>
+
+#include "../include/skepuimg.h"
+
+namespace SkePUImageProcessing
+{
+	// The transpose goes through square blocks this many pixels wide, so that the rows of a block
+	// being read and the rows of its transposed copy being written all stay in the L1 cache.
+	const size_t TRANSPOSE_BLOCK = 32;
+	
+	// out (cols x rows) = in (rows x cols) transposed, with the rows and/or the columns of the result
+	// reversed for rotations. Threads take bands of source rows, which are bands of result columns.
+	template<typename PixelType>
+	void transpose_blocked(const PixelType *in, PixelType *out, size_t rows, size_t cols, bool reverseRows, bool reverseColumns)
+	{
+		const long bands = (rows + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+		const long step = reverseColumns ? -1 : 1;
+		
+		#pragma omp parallel for num_threads(getCPUThreads())
+		for (long band = 0; band < bands; band++)
+		{
+			const size_t y0 = band * TRANSPOSE_BLOCK, y1 = std::min(y0 + TRANSPOSE_BLOCK, rows);
+			for (size_t x0 = 0; x0 < cols; x0 += TRANSPOSE_BLOCK)
+			{
+				const size_t x1 = std::min(x0 + TRANSPOSE_BLOCK, cols);
+				for (size_t x = x0; x < x1; x++)
+				{
+					PixelType *target = &out[(reverseRows ? cols - 1 - x : x) * rows + (reverseColumns ? rows - 1 - y0 : y0)];
+					const PixelType *source = &in[y0 * cols + x];
+					for (size_t y = y0; y < y1; y++, target += step, source += cols)
+						*target = *source;
+				}
+			}
+		}
+	}
+	
+	template<typename PixelType>
+	void transpose_image(skepu2::Matrix<PixelType> *img, bool reverseRows, bool reverseColumns)
+	{
+		const size_t rows = img->total_rows(), cols = img->total_cols();
+		skepu2::Matrix<PixelType> result(cols, rows);
+		img->updateHost();
+		transpose_blocked(&(*img)[0], &result[0], rows, cols, reverseRows, reverseColumns);
+		*img = std::move(result);
+	}
+	
+	template<typename PixelType>
+	float transpose(skepu2::Matrix<PixelType> *img)
+	{
+		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		{
+			transpose_image(img, false, false);
+		});
+		return time.count() / 1E6; // us -> s
+	}
+	
+	template<typename PixelType>
+	float rotate90(skepu2::Matrix<PixelType> *img, bool clockwise)
+	{
+		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		{
+			// Clockwise the first row becomes the last column, counterclockwise the first column becomes the last row.
+			transpose_image(img, !clockwise, clockwise);
+		});
+		return time.count() / 1E6; // us -> s
+	}
+	
+	template<typename PixelType>
+	float flip(skepu2::Matrix<PixelType> *img, bool horizontal)
+	{
+		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		{
+			const long rows = img->total_rows(), cols = img->total_cols();
+			img->updateHost();
+			PixelType *data = &(*img)[0];
+			
+			if (horizontal)
+			{
+				#pragma omp parallel for num_threads(getCPUThreads())
+				for (long y = 0; y < rows; y++)
+					std::reverse(&data[y * cols], &data[(y + 1) * cols]);
+			}
+			else
+			{
+				#pragma omp parallel for num_threads(getCPUThreads())
+				for (long y = 0; y < rows / 2; y++)
+					std::swap_ranges(&data[y * cols], &data[(y + 1) * cols], &data[(rows - 1 - y) * cols]);
+			}
+		});
+		return time.count() / 1E6; // us -> s
+	}
+	
+	
+	template float transpose(skepu2::Matrix<GrayscalePixel> *img);
+	template float transpose(skepu2::Matrix<RGBPixel> *img);
+	template float transpose(skepu2::Matrix<RGBXPixel> *img);
+	template float rotate90(skepu2::Matrix<GrayscalePixel> *img, bool clockwise);
+	template float rotate90(skepu2::Matrix<RGBPixel> *img, bool clockwise);
+	template float rotate90(skepu2::Matrix<RGBXPixel> *img, bool clockwise);
+	template float flip(skepu2::Matrix<GrayscalePixel> *img, bool horizontal);
+	template float flip(skepu2::Matrix<RGBPixel> *img, bool horizontal);
+	template float flip(skepu2::Matrix<RGBXPixel> *img, bool horizontal);
+}
@@ -32,6 +32,7 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 
 #ifdef LODEPNG_COMPILE_CPP
 #include <fstream>
@@ -192,15 +193,6 @@ static unsigned uivector_push_back(uivector* p, unsigned c)
   p->data[p->size - 1] = c;
   return 1;
 }
-
-/*copy q to p, returns 1 if success, 0 if failure ==> nothing done*/
-static unsigned uivector_copy(uivector* p, const uivector* q)
-{
-  size_t i;
-  if(!uivector_resize(p, q->size)) return 0;
-  for(i = 0; i < q->size; i++) p->data[i] = q->data[i];
-  return 1;
-}
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
@@ -401,6 +393,13 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
   return 0;
 }
 
+#ifdef LODEPNG_COMPILE_ENCODER
+unsigned lodepng_stream_write_file(const unsigned char* data, size_t size, void* file)
+{
+  return fwrite(data, 1, size, (FILE*)file) == size ? 0 : 96;
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 #endif /*LODEPNG_COMPILE_DISK*/
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -411,26 +410,64 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
 
 #ifdef LODEPNG_COMPILE_ZLIB
 #ifdef LODEPNG_COMPILE_ENCODER
-/*TODO: this ignores potential out of memory errors*/
-#define addBitToStream(/*size_t**/ bitpointer, /*ucvector**/ bitstream, /*unsigned char*/ bit)\
-{\
-  /*add a new byte at the end*/\
-  if(((*bitpointer) & 7) == 0) ucvector_push_back(bitstream, (unsigned char)0);\
-  /*earlier bit of huffman code is in a lesser significant bit of an earlier byte*/\
-  (bitstream->data[bitstream->size - 1]) |= (bit << ((*bitpointer) & 0x7));\
-  (*bitpointer)++;\
+/*
+Bit writer for the deflate output. Bits are gathered lsb first in a word-sized
+accumulator and written out half a word at a time (32 bits on 64-bit platforms),
+instead of one by one with a byte boundary check per bit.
+*/
+typedef struct BitWriter
+{
+  ucvector* data; /*output, only contains the bits that were already flushed*/
+  size_t buffer; /*pending bits, the first one in the lsb*/
+  unsigned numbits; /*amount of pending bits in buffer, always smaller than BITWRITER_FLUSH_BITS*/
+  unsigned error; /*set to 83 if growing the output failed, the bits written since are lost*/
+} BitWriter;
+
+/*amount of bits flushed at once, the largest value written at once may be this many bits*/
+#define BITWRITER_FLUSH_BITS (sizeof(size_t) * 4)
+
+static void BitWriter_init(BitWriter* writer, ucvector* data)
+{
+  writer->data = data;
+  writer->buffer = 0;
+  writer->numbits = 0;
+  writer->error = 0;
 }
 
-static void addBitsToStream(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
+static void BitWriter_flush(BitWriter* writer)
 {
   size_t i;
-  for(i = 0; i < nbits; i++) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> i) & 1));
+  ucvector* data = writer->data;
+  if(data->size + BITWRITER_FLUSH_BITS / 8 <= data->allocsize
+     || ucvector_reserve(data, data->size + BITWRITER_FLUSH_BITS / 8))
+  {
+    unsigned char* out = &data->data[data->size];
+    for(i = 0; i < BITWRITER_FLUSH_BITS / 8; i++) out[i] = (unsigned char)(writer->buffer >> (8 * i));
+    data->size += BITWRITER_FLUSH_BITS / 8;
+  }
+  else writer->error = 83; /*alloc fail*/
+  writer->buffer >>= BITWRITER_FLUSH_BITS;
+  writer->numbits -= (unsigned)BITWRITER_FLUSH_BITS;
 }
 
-static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
+/*write the nbits lowest bits of value, lsb first. value may not have other bits set*/
+static void writeBits(BitWriter* writer, unsigned value, unsigned nbits)
 {
-  size_t i;
-  for(i = 0; i < nbits; i++) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> (nbits - 1 - i)) & 1));
+  writer->buffer |= (size_t)value << writer->numbits;
+  writer->numbits += nbits;
+  if(writer->numbits >= BITWRITER_FLUSH_BITS) BitWriter_flush(writer);
+}
+
+/*write the remaining bits, padded with zeroes up to a byte boundary. Returns error*/
+static unsigned BitWriter_finish(BitWriter* writer)
+{
+  while(writer->numbits > 0 && !writer->error)
+  {
+    if(!ucvector_push_back(writer->data, (unsigned char)(writer->buffer & 255))) writer->error = 83; /*alloc fail*/
+    writer->buffer >>= 8;
+    writer->numbits = writer->numbits > 8 ? writer->numbits - 8 : 0;
+  }
+  return writer->error;
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
@@ -660,102 +697,116 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
 #ifdef LODEPNG_COMPILE_ENCODER
 
 /*
-A coin, this is the terminology used for the package-merge algorithm and the
-coin collector's problem. This is used to generate the huffman tree.
-A coin can be multiple coins (when they're merged)
+Sort the symbols by ascending frequency, with shell sort so that no memory has to
+be allocated. symbols and weights are parallel arrays of size num.
 */
-typedef struct Coin
-{
-  uivector symbols;
-  float weight; /*the sum of all weights in this coin*/
-} Coin;
-
-static void coin_init(Coin* c)
-{
-  uivector_init(&c->symbols);
-}
-
-/*argument c is void* so that this dtor can be given as function pointer to the vector resize function*/
-static void coin_cleanup(void* c)
-{
-  uivector_cleanup(&((Coin*)c)->symbols);
-}
-
-static void coin_copy(Coin* c1, const Coin* c2)
-{
-  c1->weight = c2->weight;
-  uivector_copy(&c1->symbols, &c2->symbols);
-}
-
-static void add_coins(Coin* c1, const Coin* c2)
+static void sort_symbols_by_weight(unsigned* symbols, unsigned* weights, size_t num)
 {
-  size_t i;
-  for(i = 0; i < c2->symbols.size; i++) uivector_push_back(&c1->symbols, c2->symbols.data[i]);
-  c1->weight += c2->weight;
+  static const size_t gaps[] = {57, 23, 10, 4, 1};
+  size_t g, i, j;
+  for(g = 0; g < sizeof(gaps) / sizeof(*gaps); g++)
+  {
+    size_t gap = gaps[g];
+    for(i = gap; i < num; i++)
+    {
+      unsigned symbol = symbols[i], weight = weights[i];
+      for(j = i; j >= gap && weights[j - gap] > weight; j -= gap)
+      {
+        symbols[j] = symbols[j - gap];
+        weights[j] = weights[j - gap];
+      }
+      symbols[j] = symbol;
+      weights[j] = weight;
+    }
+  }
 }
 
-static void init_coins(Coin* coins, size_t num)
+/*
+In-place calculation of minimum-redundancy codes (Moffat and Katajainen, 1995).
+A contains the num weights sorted ascending and is overwritten with the code
+lengths of those same entries, without length limit. Needs num >= 2.
+*/
+static void moffat_code_lengths(unsigned* A, size_t num)
 {
-  size_t i;
-  for(i = 0; i < num; i++) coin_init(&coins[i]);
-}
+  size_t root, leaf, next, avbl, used, depth;
 
-static void cleanup_coins(Coin* coins, size_t num)
-{
-  size_t i;
-  for(i = 0; i < num; i++) coin_cleanup(&coins[i]);
-}
+  /*first pass: left to right, set parent pointers of the internal nodes*/
+  A[0] += A[1];
+  root = 0;
+  leaf = 2;
+  for(next = 1; next < num - 1; next++)
+  {
+    /*select first item for a pairing*/
+    if(leaf >= num || A[root] < A[leaf])
+    {
+      A[next] = A[root];
+      A[root++] = (unsigned)next;
+    }
+    else A[next] = A[leaf++];
+    /*add on the second item*/
+    if(leaf >= num || (root < next && A[root] < A[leaf]))
+    {
+      A[next] += A[root];
+      A[root++] = (unsigned)next;
+    }
+    else A[next] += A[leaf++];
+  }
 
-static int coin_compare(const void* a, const void* b) {
-  float wa = ((const Coin*)a)->weight;
-  float wb = ((const Coin*)b)->weight;
-  return wa > wb ? 1 : wa < wb ? -1 : 0;
-}
+  /*second pass: right to left, set internal depths*/
+  A[num - 2] = 0;
+  for(next = num - 2; next-- > 0;) A[next] = A[A[next]] + 1;
 
-static unsigned append_symbol_coins(Coin* coins, const unsigned* frequencies, unsigned numcodes, size_t sum)
-{
-  unsigned i;
-  unsigned j = 0; /*index of present symbols*/
-  for(i = 0; i < numcodes; i++)
+  /*third pass: right to left, set leaf depths*/
+  avbl = 1;
+  used = depth = 0;
+  root = num - 1; /*one past the internal node being looked at, to stay unsigned*/
+  next = num; /*one past the leaf being assigned*/
+  while(avbl > 0)
   {
-    if(frequencies[i] != 0) /*only include symbols that are present*/
+    while(root > 0 && A[root - 1] == depth)
     {
-      coins[j].weight = frequencies[i] / (float)sum;
-      uivector_push_back(&coins[j].symbols, i);
-      j++;
+      used++;
+      root--;
     }
+    while(avbl > used)
+    {
+      A[--next] = (unsigned)depth;
+      avbl--;
+    }
+    avbl = 2 * used;
+    depth++;
+    used = 0;
   }
-  return 0;
 }
 
 unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequencies,
                                       size_t numcodes, unsigned maxbitlen)
 {
-  unsigned i, j;
-  size_t sum = 0, numpresent = 0;
-  unsigned error = 0;
-  Coin* coins; /*the coins of the currently calculated row*/
-  Coin* prev_row; /*the previous row of coins*/
-  size_t numcoins;
-  size_t coinmem;
+  /*all work is done in these fixed size arrays, lodepng never needs more than
+  NUM_DEFLATE_CODE_SYMBOLS symbols and 15 bits*/
+  unsigned symbols[NUM_DEFLATE_CODE_SYMBOLS]; /*present symbols, sorted by frequency*/
+  unsigned weights[NUM_DEFLATE_CODE_SYMBOLS]; /*their frequencies, then their unlimited code lengths*/
+  unsigned numlengths[16]; /*amount of symbols per code length, after limiting to maxbitlen*/
+  size_t i, numpresent = 0;
 
   if(numcodes == 0) return 80; /*error: a tree of 0 symbols is not supposed to be made*/
+  if(numcodes > NUM_DEFLATE_CODE_SYMBOLS || maxbitlen > 15) return 92; /*error: tree too large*/
 
   for(i = 0; i < numcodes; i++)
   {
+    lengths[i] = 0;
     if(frequencies[i] > 0)
     {
+      symbols[numpresent] = (unsigned)i;
+      weights[numpresent] = frequencies[i];
       numpresent++;
-      sum += frequencies[i];
     }
   }
 
-  for(i = 0; i < numcodes; i++) lengths[i] = 0;
-
   /*ensure at least two present symbols. There should be at least one symbol
   according to RFC 1951 section 3.2.7. To decoders incorrectly require two. To
   make these work as well ensure there are at least two symbols. The
-  Package-Merge code below also doesn't work correctly if there's only one
+  code length calculation below also doesn't work correctly if there's only one
   symbol, it'd give it the theoritical 0 bits but in practice zlib wants 1 bit*/
   if(numpresent == 0)
   {
@@ -763,88 +814,52 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
   }
   else if(numpresent == 1)
   {
-    for(i = 0; i < numcodes; i++)
-    {
-      if(frequencies[i])
-      {
-        lengths[i] = 1;
-        lengths[i == 0 ? 1 : 0] = 1;
-        break;
-      }
-    }
+    lengths[symbols[0]] = 1;
+    lengths[symbols[0] == 0 ? 1 : 0] = 1;
   }
   else
   {
-    /*Package-Merge algorithm represented by coin collector's problem
-    For every symbol, maxbitlen coins will be created*/
-
-    coinmem = numpresent * 2; /*max amount of coins needed with the current algo*/
-    coins = (Coin*)lodepng_malloc(sizeof(Coin) * coinmem);
-    prev_row = (Coin*)lodepng_malloc(sizeof(Coin) * coinmem);
-    if(!coins || !prev_row)
-    {
-      lodepng_free(coins);
-      lodepng_free(prev_row);
-      return 83; /*alloc fail*/
-    }
-    init_coins(coins, coinmem);
-    init_coins(prev_row, coinmem);
+    unsigned bits;
+    unsigned long kraft; /*sum of 2^(maxbitlen - length) over all symbols*/
 
-    /*first row, lowest denominator*/
-    error = append_symbol_coins(coins, frequencies, numcodes, sum);
-    numcoins = numpresent;
-    qsort(coins, numcoins, sizeof(Coin), coin_compare);
-    if(!error)
-    {
-      unsigned numprev = 0;
-      for(j = 1; j <= maxbitlen && !error; j++) /*each of the remaining rows*/
-      {
-        unsigned tempnum;
-        Coin* tempcoins;
-        /*swap prev_row and coins, and their amounts*/
-        tempcoins = prev_row; prev_row = coins; coins = tempcoins;
-        tempnum = numprev; numprev = numcoins; numcoins = tempnum;
+    if(numpresent > (1u << maxbitlen)) return 92; /*error: impossible to fit in maxbitlen bits*/
 
-        cleanup_coins(coins, numcoins);
-        init_coins(coins, numcoins);
+    sort_symbols_by_weight(symbols, weights, numpresent);
+    moffat_code_lengths(weights, numpresent);
 
-        numcoins = 0;
+    /*Limit the lengths to maxbitlen: clamp the too long codes, which makes the
+    code oversubscribed, then lengthen the longest codes shorter than maxbitlen
+    until the Kraft sum is exact again (the same approach as zlib).*/
+    for(bits = 0; bits <= maxbitlen; bits++) numlengths[bits] = 0;
+    for(i = 0; i < numpresent; i++) numlengths[weights[i] > maxbitlen ? maxbitlen : weights[i]]++;
 
-        /*fill in the merged coins of the previous row*/
-        for(i = 0; i + 1 < numprev; i += 2)
-        {
-          /*merge prev_row[i] and prev_row[i + 1] into new coin*/
-          Coin* coin = &coins[numcoins++];
-          coin_copy(coin, &prev_row[i]);
-          add_coins(coin, &prev_row[i + 1]);
-        }
-        /*fill in all the original symbols again*/
-        if(j < maxbitlen)
+    kraft = 0;
+    for(bits = 1; bits <= maxbitlen; bits++) kraft += (unsigned long)numlengths[bits] << (maxbitlen - bits);
+    while(kraft > (1ul << maxbitlen))
+    {
+      numlengths[maxbitlen]--;
+      for(bits = maxbitlen - 1; bits > 0; bits--)
+      {
+        if(numlengths[bits])
         {
-          error = append_symbol_coins(coins + numcoins, frequencies, numcodes, sum);
-          numcoins += numpresent;
+          numlengths[bits]--;
+          numlengths[bits + 1] += 2;
+          break;
         }
-        qsort(coins, numcoins, sizeof(Coin), coin_compare);
       }
+      kraft--;
     }
 
-    if(!error)
+    /*the most frequent symbols, at the end of the sorted array, get the shortest codes*/
+    i = numpresent;
+    for(bits = 1; bits <= maxbitlen; bits++)
     {
-      /*calculate the lenghts of each symbol, as the amount of times a coin of each symbol is used*/
-      for(i = 0; i < numpresent - 1; i++)
-      {
-        Coin* coin = &coins[i];
-        for(j = 0; j < coin->symbols.size; j++) lengths[coin->symbols.data[j]]++;
-      }
+      unsigned n;
+      for(n = numlengths[bits]; n > 0; n--) lengths[symbols[--i]] = bits;
     }
-
-    cleanup_coins(coins, coinmem);
-    lodepng_free(coins);
-    cleanup_coins(prev_row, coinmem);
-    lodepng_free(prev_row);
   }
 
-  return error;
+  return 0;
 }
 
 /*Create the Huffman tree given the symbol frequencies*/
@@ -1287,10 +1302,20 @@ static unsigned inflate(unsigned char** out, size_t* outsize,
 
 static const size_t MAX_SUPPORTED_DEFLATE_LENGTH = 258;
 
-/*bitlen is the size in bits of the code*/
-static void addHuffmanSymbol(size_t* bp, ucvector* compressed, unsigned code, unsigned bitlen)
+/*reverse the order of the lowest num bits of bits, num must be <= 16*/
+static unsigned reverseBits(unsigned bits, unsigned num)
+{
+  bits = ((bits & 0x5555u) << 1u) | ((bits >> 1u) & 0x5555u);
+  bits = ((bits & 0x3333u) << 2u) | ((bits >> 2u) & 0x3333u);
+  bits = ((bits & 0x0f0fu) << 4u) | ((bits >> 4u) & 0x0f0fu);
+  bits = ((bits & 0x00ffu) << 8u) | ((bits >> 8u) & 0x00ffu);
+  return bits >> (16u - num);
+}
+
+/*bitlen is the size in bits of the code. Huffman codes are stored msb first in the stream*/
+static void addHuffmanSymbol(BitWriter* writer, unsigned code, unsigned bitlen)
 {
-  addBitsToStreamReversed(bp, compressed, code, bitlen);
+  writeBits(writer, reverseBits(code, bitlen), bitlen);
 }
 
 /*search the index in the array, that has the largest value smaller than or equal to the given value,
@@ -1619,40 +1644,96 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   return error;
 }
 
+/*
+LZ77-encode the data for LCL_RLE. Instead of searching a hash chain, only two
+candidates are tried per position: the previous byte (distance 1, runs of the
+same value) and the byte stride positions back (for PNG: the row above). This
+needs no hash tables and is much faster, at the cost of compression ratio.
+*/
+static unsigned encodeLZ77RLE(uivector* out, const unsigned char* in, size_t inpos, size_t insize,
+                              unsigned stride)
+{
+  size_t pos = inpos;
+
+  if(stride > 32768) stride = 0; /*too far back for deflate, only use distance 1*/
+
+  while(pos < insize)
+  {
+    size_t maxlength = insize - pos;
+    size_t length = 0, distance = 0;
+    if(maxlength > MAX_SUPPORTED_DEFLATE_LENGTH) maxlength = MAX_SUPPORTED_DEFLATE_LENGTH;
+
+    if(pos >= 1)
+    {
+      unsigned char value = in[pos - 1];
+      while(length < maxlength && in[pos + length] == value) length++;
+      distance = 1;
+    }
+    if(stride > 1 && pos >= stride && length < maxlength)
+    {
+      const unsigned char* backptr = &in[pos - stride];
+      size_t upLength = 0;
+      while(upLength < maxlength && backptr[upLength] == in[pos + upLength]) upLength++;
+      if(upLength > length)
+      {
+        length = upLength;
+        distance = stride;
+      }
+    }
+
+    if(length >= 3)
+    {
+      addLengthDistance(out, length, distance);
+      pos += length;
+    }
+    else
+    {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      pos++;
+    }
+  }
+
+  return 0;
+}
+
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, unsigned final)
 {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
 
-  size_t i, j, numdeflateblocks = (datasize + 65534) / 65535;
-  unsigned datapos = 0;
+  size_t i, numdeflateblocks = (datasize + 65534) / 65535;
+  size_t datapos = 0;
+  unsigned char* pos;
+
+  if(numdeflateblocks == 0) numdeflateblocks = 1; /*empty input still needs one (final) block*/
+
+  /*the output size is known in advance: resize once and copy the data per block instead of per byte*/
+  if(!ucvector_resize(out, out->size + numdeflateblocks * 5 + datasize)) return 83; /*alloc fail*/
+  pos = &out->data[out->size - numdeflateblocks * 5 - datasize];
+
   for(i = 0; i < numdeflateblocks; i++)
   {
     unsigned BFINAL, BTYPE, LEN, NLEN;
-    unsigned char firstbyte;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
-    firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1) << 1) + ((BTYPE & 2) << 1));
-    ucvector_push_back(out, firstbyte);
-
     LEN = 65535;
-    if(datasize - datapos < 65535) LEN = (unsigned)datasize - datapos;
+    if(datasize - datapos < 65535) LEN = (unsigned)(datasize - datapos);
     NLEN = 65535 - LEN;
 
-    ucvector_push_back(out, (unsigned char)(LEN % 256));
-    ucvector_push_back(out, (unsigned char)(LEN / 256));
-    ucvector_push_back(out, (unsigned char)(NLEN % 256));
-    ucvector_push_back(out, (unsigned char)(NLEN / 256));
+    pos[0] = (unsigned char)(BFINAL + ((BTYPE & 1) << 1) + ((BTYPE & 2) << 1));
+    pos[1] = (unsigned char)(LEN % 256);
+    pos[2] = (unsigned char)(LEN / 256);
+    pos[3] = (unsigned char)(NLEN % 256);
+    pos[4] = (unsigned char)(NLEN / 256);
 
     /*Decompressed data*/
-    for(j = 0; j < 65535 && datapos < datasize; j++)
-    {
-      ucvector_push_back(out, data[datapos++]);
-    }
+    if(LEN) memcpy(pos + 5, &data[datapos], LEN);
+    pos += 5 + LEN;
+    datapos += LEN;
   }
 
   return 0;
@@ -1663,14 +1744,14 @@ write the lz77-encoded data, which has lit, len and dist codes, to compressed st
 tree_ll: the tree for lit and len codes.
 tree_d: the tree for distance codes.
 */
-static void writeLZ77data(size_t* bp, ucvector* out, const uivector* lz77_encoded,
+static void writeLZ77data(BitWriter* writer, const uivector* lz77_encoded,
                           const HuffmanTree* tree_ll, const HuffmanTree* tree_d)
 {
   size_t i = 0;
   for(i = 0; i < lz77_encoded->size; i++)
   {
     unsigned val = lz77_encoded->data[i];
-    addHuffmanSymbol(bp, out, HuffmanTree_getCode(tree_ll, val), HuffmanTree_getLength(tree_ll, val));
+    addHuffmanSymbol(writer, HuffmanTree_getCode(tree_ll, val), HuffmanTree_getLength(tree_ll, val));
     if(val > 256) /*for a length code, 3 more things have to be added*/
     {
       unsigned length_index = val - FIRST_LENGTH_CODE_INDEX;
@@ -1683,115 +1764,177 @@ static void writeLZ77data(size_t* bp, ucvector* out, const uivector* lz77_encode
       unsigned n_distance_extra_bits = DISTANCEEXTRA[distance_index];
       unsigned distance_extra_bits = lz77_encoded->data[++i];
 
-      addBitsToStream(bp, out, length_extra_bits, n_length_extra_bits);
-      addHuffmanSymbol(bp, out, HuffmanTree_getCode(tree_d, distance_code),
+      writeBits(writer, length_extra_bits, n_length_extra_bits);
+      addHuffmanSymbol(writer, HuffmanTree_getCode(tree_d, distance_code),
                        HuffmanTree_getLength(tree_d, distance_code));
-      addBitsToStream(bp, out, distance_extra_bits, n_distance_extra_bits);
+      writeBits(writer, distance_extra_bits, n_distance_extra_bits);
     }
   }
 }
 
-/*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees*/
-static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
-                               const unsigned char* data, size_t datapos, size_t dataend,
-                               const LodePNGCompressSettings* settings, unsigned final)
+/*write one length/distance pair directly, the same way writeLZ77data writes it from the lz77 buffer*/
+static void addLengthDistanceSymbols(BitWriter* writer, size_t length, size_t distance,
+                                     const HuffmanTree* tree_ll, const HuffmanTree* tree_d)
+{
+  unsigned length_index = (unsigned)searchCodeIndex(LENGTHBASE, 29, length);
+  unsigned distance_index = (unsigned)searchCodeIndex(DISTANCEBASE, 30, distance);
+  unsigned length_code = length_index + FIRST_LENGTH_CODE_INDEX;
+
+  addHuffmanSymbol(writer, HuffmanTree_getCode(tree_ll, length_code), HuffmanTree_getLength(tree_ll, length_code));
+  writeBits(writer, (unsigned)(length - LENGTHBASE[length_index]), LENGTHEXTRA[length_index]);
+  addHuffmanSymbol(writer, HuffmanTree_getCode(tree_d, distance_index),
+                   HuffmanTree_getLength(tree_d, distance_index));
+  writeBits(writer, (unsigned)(distance - DISTANCEBASE[distance_index]), DISTANCEEXTRA[distance_index]);
+}
+
+/*amount of bits of the hash used by LCL_FASTEST, the table has one position per hash value*/
+#define FASTEST_HASH_BITS 15
+
+/*multiplicative hash of the 3 bytes at data, unlike getHash this needs no bounds check*/
+static unsigned getFastestHash(const unsigned char* data)
 {
+  unsigned value = (unsigned)data[0] | ((unsigned)data[1] << 8u) | ((unsigned)data[2] << 16u);
+  return ((value * 2654435761u) & 0xffffffffu) >> (32u - FASTEST_HASH_BITS);
+}
+
+/*amount of entries of the LCL_FASTEST hash table*/
+#define FASTEST_HASH_SIZE ((size_t)1 << FASTEST_HASH_BITS)
+/*value in the LCL_FASTEST hash table for no position*/
+#define FASTEST_HASH_NONE ((size_t)(-1))
+
+/*
+Deflate for LCL_FASTEST: one block with the fixed huffman tree. Matches are found
+greedily with one probe per position into head, a table of FASTEST_HASH_SIZE entries
+holding the last position of each hash value, without hash chains or lazy matching.
+Symbols are written to the stream as they are found, so there is no intermediate
+lz77 buffer and no tree building. head must be filled with FASTEST_HASH_NONE before
+the first block of a stream, and is kept for the next blocks.
+*/
+static unsigned deflateFastest(BitWriter* writer, size_t* head,
+                               const unsigned char* data, size_t datapos, size_t dataend, unsigned final)
+{
+  HuffmanTree tree_ll; /*tree for literal values and length codes*/
+  HuffmanTree tree_d; /*tree for distance codes*/
+  size_t pos = datapos;
   unsigned error = 0;
 
-  /*
-  A block is compressed as follows: The PNG data is lz77 encoded, resulting in
-  literal bytes and length/distance pairs. This is then huffman compressed with
-  two huffman trees. One huffman tree is used for the lit and len values ("ll"),
-  another huffman tree is used for the dist values ("d"). These two trees are
-  stored using their code lengths, and to compress even more these code lengths
-  are also run-length encoded and huffman compressed. This gives a huffman tree
-  of code lengths "cl". The code lenghts used to describe this third tree are
-  the code length code lengths ("clcl").
-  */
+  HuffmanTree_init(&tree_ll);
+  HuffmanTree_init(&tree_d);
 
-  /*The lz77 encoded data, represented with integers since there will also be length and distance codes in it*/
-  uivector lz77_encoded;
+  error = generateFixedLitLenTree(&tree_ll);
+  if(!error) error = generateFixedDistanceTree(&tree_d);
+
+  if(!error)
+  {
+    writeBits(writer, final, 1); /*BFINAL*/
+    writeBits(writer, 1, 1); /*first bit of BTYPE "fixed"*/
+    writeBits(writer, 0, 1); /*second bit of BTYPE "fixed"*/
+
+    while(pos < dataend)
+    {
+      size_t length = 0, candidate = FASTEST_HASH_NONE;
+      if(pos + 3 <= dataend)
+      {
+        unsigned hashval = getFastestHash(&data[pos]);
+        candidate = head[hashval];
+        head[hashval] = pos;
+        if(candidate < pos && pos - candidate <= 32768)
+        {
+          size_t maxlength = dataend - pos;
+          if(maxlength > MAX_SUPPORTED_DEFLATE_LENGTH) maxlength = MAX_SUPPORTED_DEFLATE_LENGTH;
+          while(length < maxlength && data[candidate + length] == data[pos + length]) length++;
+        }
+      }
+
+      if(length >= 3)
+      {
+        addLengthDistanceSymbols(writer, length, pos - candidate, &tree_ll, &tree_d);
+        pos += length;
+      }
+      else
+      {
+        addHuffmanSymbol(writer, HuffmanTree_getCode(&tree_ll, data[pos]), HuffmanTree_getLength(&tree_ll, data[pos]));
+        pos++;
+      }
+    }
+
+    /*add END code*/
+    addHuffmanSymbol(writer, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256));
+  }
+
+  HuffmanTree_cleanup(&tree_ll);
+  HuffmanTree_cleanup(&tree_d);
+
+  return error;
+}
+
+/*the huffman trees of a dynamic block, and the run-length encoded code lengths that describe them*/
+typedef struct DynamicTrees
+{
   HuffmanTree tree_ll; /*tree for lit,len values*/
   HuffmanTree tree_d; /*tree for distance codes*/
   HuffmanTree tree_cl; /*tree for encoding the code lengths representing tree_ll and tree_d*/
-  uivector frequencies_ll; /*frequency of lit,len codes*/
-  uivector frequencies_d; /*frequency of dist codes*/
-  uivector frequencies_cl; /*frequency of code length codes*/
-  uivector bitlen_lld; /*lit,len,dist code lenghts (int bits), literally (without repeat codes).*/
-  uivector bitlen_lld_e; /*bitlen_lld encoded with repeat codes (this is a rudemtary run length compression)*/
+  uivector bitlen_lld_e; /*code lengths of tree_ll and tree_d, encoded with repeat codes*/
   /*bitlen_cl is the code length code lengths ("clcl"). The bit lengths of codes to represent tree_cl
   (these are written as is in the file, it would be crazy to compress these using yet another huffman
   tree that needs to be represented by yet another set of code lengths)*/
   uivector bitlen_cl;
-  size_t datasize = dataend - datapos;
+  unsigned HLIT, HDIST, HCLEN;
+} DynamicTrees;
 
-  /*
-  Due to the huffman compression of huffman tree representations ("two levels"), there are some anologies:
-  bitlen_lld is to tree_cl what data is to tree_ll and tree_d.
-  bitlen_lld_e is to bitlen_lld what lz77_encoded is to data.
-  bitlen_cl is to bitlen_lld_e what bitlen_lld is to lz77_encoded.
-  */
+static void dynamic_trees_init(DynamicTrees* trees)
+{
+  HuffmanTree_init(&trees->tree_ll);
+  HuffmanTree_init(&trees->tree_d);
+  HuffmanTree_init(&trees->tree_cl);
+  uivector_init(&trees->bitlen_lld_e);
+  uivector_init(&trees->bitlen_cl);
+}
 
-  unsigned BFINAL = final;
+static void dynamic_trees_cleanup(DynamicTrees* trees)
+{
+  HuffmanTree_cleanup(&trees->tree_ll);
+  HuffmanTree_cleanup(&trees->tree_d);
+  HuffmanTree_cleanup(&trees->tree_cl);
+  uivector_cleanup(&trees->bitlen_lld_e);
+  uivector_cleanup(&trees->bitlen_cl);
+}
+
+/*
+Makes the trees of a dynamic block from the frequencies of the 286 lit,len codes
+(including the one end code) and of the 30 dist codes. The trees are stored using
+their code lengths, and to compress even more these code lengths are also run-length
+encoded and huffman compressed. This gives a huffman tree of code lengths "cl". The
+code lenghts used to describe this third tree are the code length code lengths ("clcl").
+*/
+static unsigned dynamic_trees_make(DynamicTrees* trees, const unsigned* frequencies_ll, const unsigned* frequencies_d)
+{
+  unsigned error = 0;
+  uivector frequencies_cl; /*frequency of code length codes*/
+  uivector bitlen_lld; /*lit,len,dist code lenghts (int bits), literally (without repeat codes).*/
+  uivector* bitlen_lld_e = &trees->bitlen_lld_e;
+  uivector* bitlen_cl = &trees->bitlen_cl;
   size_t numcodes_ll, numcodes_d, i;
-  unsigned HLIT, HDIST, HCLEN;
 
-  uivector_init(&lz77_encoded);
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
-  HuffmanTree_init(&tree_cl);
-  uivector_init(&frequencies_ll);
-  uivector_init(&frequencies_d);
   uivector_init(&frequencies_cl);
   uivector_init(&bitlen_lld);
-  uivector_init(&bitlen_lld_e);
-  uivector_init(&bitlen_cl);
 
   /*This while loop never loops due to a break at the end, it is here to
   allow breaking out of it to the cleanup phase on error conditions.*/
   while(!error)
   {
-    if(settings->use_lz77)
-    {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
-      if(error) break;
-    }
-    else
-    {
-      if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
-      for(i = datapos; i < dataend; i++) lz77_encoded.data[i] = data[i]; /*no LZ77, but still will be Huffman compressed*/
-    }
-
-    if(!uivector_resizev(&frequencies_ll, 286, 0)) ERROR_BREAK(83 /*alloc fail*/);
-    if(!uivector_resizev(&frequencies_d, 30, 0)) ERROR_BREAK(83 /*alloc fail*/);
-
-    /*Count the frequencies of lit, len and dist codes*/
-    for(i = 0; i < lz77_encoded.size; i++)
-    {
-      unsigned symbol = lz77_encoded.data[i];
-      frequencies_ll.data[symbol]++;
-      if(symbol > 256)
-      {
-        unsigned dist = lz77_encoded.data[i + 2];
-        frequencies_d.data[dist]++;
-        i += 3;
-      }
-    }
-    frequencies_ll.data[256] = 1; /*there will be exactly 1 end code, at the end of the block*/
-
     /*Make both huffman trees, one for the lit and len codes, one for the dist codes*/
-    error = HuffmanTree_makeFromFrequencies(&tree_ll, frequencies_ll.data, 257, frequencies_ll.size, 15);
+    error = HuffmanTree_makeFromFrequencies(&trees->tree_ll, frequencies_ll, 257, 286, 15);
     if(error) break;
     /*2, not 1, is chosen for mincodes: some buggy PNG decoders require at least 2 symbols in the dist tree*/
-    error = HuffmanTree_makeFromFrequencies(&tree_d, frequencies_d.data, 2, frequencies_d.size, 15);
+    error = HuffmanTree_makeFromFrequencies(&trees->tree_d, frequencies_d, 2, 30, 15);
     if(error) break;
 
-    numcodes_ll = tree_ll.numcodes; if(numcodes_ll > 286) numcodes_ll = 286;
-    numcodes_d = tree_d.numcodes; if(numcodes_d > 30) numcodes_d = 30;
+    numcodes_ll = trees->tree_ll.numcodes; if(numcodes_ll > 286) numcodes_ll = 286;
+    numcodes_d = trees->tree_d.numcodes; if(numcodes_d > 30) numcodes_d = 30;
     /*store the code lengths of both generated trees in bitlen_lld*/
-    for(i = 0; i < numcodes_ll; i++) uivector_push_back(&bitlen_lld, HuffmanTree_getLength(&tree_ll, (unsigned)i));
-    for(i = 0; i < numcodes_d; i++) uivector_push_back(&bitlen_lld, HuffmanTree_getLength(&tree_d, (unsigned)i));
+    for(i = 0; i < numcodes_ll; i++) uivector_push_back(&bitlen_lld, HuffmanTree_getLength(&trees->tree_ll, (unsigned)i));
+    for(i = 0; i < numcodes_d; i++) uivector_push_back(&bitlen_lld, HuffmanTree_getLength(&trees->tree_d, (unsigned)i));
 
     /*run-length compress bitlen_ldd into bitlen_lld_e by using repeat codes 16 (copy length 3-6 times),
     17 (3-10 zeroes), 18 (11-138 zeroes)*/
@@ -1805,14 +1948,14 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
         j++; /*include the first zero*/
         if(j <= 10) /*repeat code 17 supports max 10 zeroes*/
         {
-          uivector_push_back(&bitlen_lld_e, 17);
-          uivector_push_back(&bitlen_lld_e, j - 3);
+          uivector_push_back(bitlen_lld_e, 17);
+          uivector_push_back(bitlen_lld_e, j - 3);
         }
         else /*repeat code 18 supports max 138 zeroes*/
         {
           if(j > 138) j = 138;
-          uivector_push_back(&bitlen_lld_e, 18);
-          uivector_push_back(&bitlen_lld_e, j - 11);
+          uivector_push_back(bitlen_lld_e, 18);
+          uivector_push_back(bitlen_lld_e, j - 11);
         }
         i += (j - 1);
       }
@@ -1820,182 +1963,980 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
       {
         size_t k;
         unsigned num = j / 6, rest = j % 6;
-        uivector_push_back(&bitlen_lld_e, bitlen_lld.data[i]);
+        uivector_push_back(bitlen_lld_e, bitlen_lld.data[i]);
         for(k = 0; k < num; k++)
         {
-          uivector_push_back(&bitlen_lld_e, 16);
-          uivector_push_back(&bitlen_lld_e, 6 - 3);
+          uivector_push_back(bitlen_lld_e, 16);
+          uivector_push_back(bitlen_lld_e, 6 - 3);
         }
         if(rest >= 3)
         {
-          uivector_push_back(&bitlen_lld_e, 16);
-          uivector_push_back(&bitlen_lld_e, rest - 3);
+          uivector_push_back(bitlen_lld_e, 16);
+          uivector_push_back(bitlen_lld_e, rest - 3);
         }
         else j -= rest;
         i += j;
       }
       else /*too short to benefit from repeat code*/
       {
-        uivector_push_back(&bitlen_lld_e, bitlen_lld.data[i]);
+        uivector_push_back(bitlen_lld_e, bitlen_lld.data[i]);
       }
     }
 
     /*generate tree_cl, the huffmantree of huffmantrees*/
 
     if(!uivector_resizev(&frequencies_cl, NUM_CODE_LENGTH_CODES, 0)) ERROR_BREAK(83 /*alloc fail*/);
-    for(i = 0; i < bitlen_lld_e.size; i++)
+    for(i = 0; i < bitlen_lld_e->size; i++)
     {
-      frequencies_cl.data[bitlen_lld_e.data[i]]++;
+      frequencies_cl.data[bitlen_lld_e->data[i]]++;
       /*after a repeat code come the bits that specify the number of repetitions,
       those don't need to be in the frequencies_cl calculation*/
-      if(bitlen_lld_e.data[i] >= 16) i++;
+      if(bitlen_lld_e->data[i] >= 16) i++;
     }
 
-    error = HuffmanTree_makeFromFrequencies(&tree_cl, frequencies_cl.data,
+    error = HuffmanTree_makeFromFrequencies(&trees->tree_cl, frequencies_cl.data,
                                             frequencies_cl.size, frequencies_cl.size, 7);
     if(error) break;
 
-    if(!uivector_resize(&bitlen_cl, tree_cl.numcodes)) ERROR_BREAK(83 /*alloc fail*/);
-    for(i = 0; i < tree_cl.numcodes; i++)
+    if(!uivector_resize(bitlen_cl, trees->tree_cl.numcodes)) ERROR_BREAK(83 /*alloc fail*/);
+    for(i = 0; i < trees->tree_cl.numcodes; i++)
     {
       /*lenghts of code length tree is in the order as specified by deflate*/
-      bitlen_cl.data[i] = HuffmanTree_getLength(&tree_cl, CLCL_ORDER[i]);
+      bitlen_cl->data[i] = HuffmanTree_getLength(&trees->tree_cl, CLCL_ORDER[i]);
     }
-    while(bitlen_cl.data[bitlen_cl.size - 1] == 0 && bitlen_cl.size > 4)
+    while(bitlen_cl->data[bitlen_cl->size - 1] == 0 && bitlen_cl->size > 4)
     {
       /*remove zeros at the end, but minimum size must be 4*/
-      if(!uivector_resize(&bitlen_cl, bitlen_cl.size - 1)) ERROR_BREAK(83 /*alloc fail*/);
+      if(!uivector_resize(bitlen_cl, bitlen_cl->size - 1)) ERROR_BREAK(83 /*alloc fail*/);
     }
     if(error) break;
 
-    /*
-    Write everything into the output
-
-    After the BFINAL and BTYPE, the dynamic block consists out of the following:
-    - 5 bits HLIT, 5 bits HDIST, 4 bits HCLEN
-    - (HCLEN+4)*3 bits code lengths of code length alphabet
-    - HLIT + 257 code lenghts of lit/length alphabet (encoded using the code length
-      alphabet, + possible repetition codes 16, 17, 18)
-    - HDIST + 1 code lengths of distance alphabet (encoded using the code length
-      alphabet, + possible repetition codes 16, 17, 18)
-    - compressed data
-    - 256 (end code)
-    */
-
-    /*Write block type*/
-    addBitToStream(bp, out, BFINAL);
-    addBitToStream(bp, out, 0); /*first bit of BTYPE "dynamic"*/
-    addBitToStream(bp, out, 1); /*second bit of BTYPE "dynamic"*/
-
-    /*write the HLIT, HDIST and HCLEN values*/
-    HLIT = (unsigned)(numcodes_ll - 257);
-    HDIST = (unsigned)(numcodes_d - 1);
-    HCLEN = (unsigned)bitlen_cl.size - 4;
+    trees->HLIT = (unsigned)(numcodes_ll - 257);
+    trees->HDIST = (unsigned)(numcodes_d - 1);
+    trees->HCLEN = (unsigned)bitlen_cl->size - 4;
     /*trim zeroes for HCLEN. HLIT and HDIST were already trimmed at tree creation*/
-    while(!bitlen_cl.data[HCLEN + 4 - 1] && HCLEN > 0) HCLEN--;
-    addBitsToStream(bp, out, HLIT, 5);
-    addBitsToStream(bp, out, HDIST, 5);
-    addBitsToStream(bp, out, HCLEN, 4);
-
-    /*write the code lenghts of the code length alphabet*/
-    for(i = 0; i < HCLEN + 4; i++) addBitsToStream(bp, out, bitlen_cl.data[i], 3);
-
-    /*write the lenghts of the lit/len AND the dist alphabet*/
-    for(i = 0; i < bitlen_lld_e.size; i++)
-    {
-      addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_cl, bitlen_lld_e.data[i]),
-                       HuffmanTree_getLength(&tree_cl, bitlen_lld_e.data[i]));
-      /*extra bits of repeat codes*/
-      if(bitlen_lld_e.data[i] == 16) addBitsToStream(bp, out, bitlen_lld_e.data[++i], 2);
-      else if(bitlen_lld_e.data[i] == 17) addBitsToStream(bp, out, bitlen_lld_e.data[++i], 3);
-      else if(bitlen_lld_e.data[i] == 18) addBitsToStream(bp, out, bitlen_lld_e.data[++i], 7);
-    }
+    while(!bitlen_cl->data[trees->HCLEN + 4 - 1] && trees->HCLEN > 0) trees->HCLEN--;
 
-    /*write the compressed data symbols*/
-    writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
     /*error: the length of the end code 256 must be larger than 0*/
-    if(HuffmanTree_getLength(&tree_ll, 256) == 0) ERROR_BREAK(64);
-
-    /*write the end code*/
-    addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256));
+    if(HuffmanTree_getLength(&trees->tree_ll, 256) == 0) ERROR_BREAK(64);
 
     break; /*end of error-while*/
   }
 
-  /*cleanup*/
-  uivector_cleanup(&lz77_encoded);
-  HuffmanTree_cleanup(&tree_ll);
-  HuffmanTree_cleanup(&tree_d);
-  HuffmanTree_cleanup(&tree_cl);
-  uivector_cleanup(&frequencies_ll);
-  uivector_cleanup(&frequencies_d);
   uivector_cleanup(&frequencies_cl);
-  uivector_cleanup(&bitlen_lld_e);
   uivector_cleanup(&bitlen_lld);
-  uivector_cleanup(&bitlen_cl);
 
   return error;
 }
 
-static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
-                             const unsigned char* data,
-                             size_t datapos, size_t dataend,
-                             const LodePNGCompressSettings* settings, unsigned final)
+/*
+Writes the header of a dynamic block. After the BFINAL and BTYPE, it consists out of the following:
+- 5 bits HLIT, 5 bits HDIST, 4 bits HCLEN
+- (HCLEN+4)*3 bits code lengths of code length alphabet
+- HLIT + 257 code lenghts of lit/length alphabet (encoded using the code length
+  alphabet, + possible repetition codes 16, 17, 18)
+- HDIST + 1 code lengths of distance alphabet (encoded using the code length
+  alphabet, + possible repetition codes 16, 17, 18)
+The compressed data and the end code follow it.
+*/
+static void dynamic_trees_write(BitWriter* writer, const DynamicTrees* trees, unsigned final)
 {
-  HuffmanTree tree_ll; /*tree for literal values and length codes*/
-  HuffmanTree tree_d; /*tree for distance codes*/
-
-  unsigned BFINAL = final;
-  unsigned error = 0;
   size_t i;
+  const uivector* bitlen_lld_e = &trees->bitlen_lld_e;
 
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
+  /*Write block type*/
+  writeBits(writer, final, 1);
+  writeBits(writer, 0, 1); /*first bit of BTYPE "dynamic"*/
+  writeBits(writer, 1, 1); /*second bit of BTYPE "dynamic"*/
 
-  generateFixedLitLenTree(&tree_ll);
-  generateFixedDistanceTree(&tree_d);
+  /*write the HLIT, HDIST and HCLEN values*/
+  writeBits(writer, trees->HLIT, 5);
+  writeBits(writer, trees->HDIST, 5);
+  writeBits(writer, trees->HCLEN, 4);
 
-  addBitToStream(bp, out, BFINAL);
-  addBitToStream(bp, out, 1); /*first bit of BTYPE*/
-  addBitToStream(bp, out, 0); /*second bit of BTYPE*/
+  /*write the code lenghts of the code length alphabet*/
+  for(i = 0; i < trees->HCLEN + 4; i++) writeBits(writer, trees->bitlen_cl.data[i], 3);
 
-  if(settings->use_lz77) /*LZ77 encoded*/
-  {
-    uivector lz77_encoded;
-    uivector_init(&lz77_encoded);
-    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
-    if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
-    uivector_cleanup(&lz77_encoded);
-  }
-  else /*no LZ77, but still will be Huffman compressed*/
+  /*write the lenghts of the lit/len AND the dist alphabet*/
+  for(i = 0; i < bitlen_lld_e->size; i++)
   {
-    for(i = datapos; i < dataend; i++)
-    {
-      addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_ll, data[i]), HuffmanTree_getLength(&tree_ll, data[i]));
-    }
+    addHuffmanSymbol(writer, HuffmanTree_getCode(&trees->tree_cl, bitlen_lld_e->data[i]),
+                     HuffmanTree_getLength(&trees->tree_cl, bitlen_lld_e->data[i]));
+    /*extra bits of repeat codes*/
+    if(bitlen_lld_e->data[i] == 16) writeBits(writer, bitlen_lld_e->data[++i], 2);
+    else if(bitlen_lld_e->data[i] == 17) writeBits(writer, bitlen_lld_e->data[++i], 3);
+    else if(bitlen_lld_e->data[i] == 18) writeBits(writer, bitlen_lld_e->data[++i], 7);
   }
-  /*add END code*/
-  if(!error) addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256));
+}
 
-  /*cleanup*/
-  HuffmanTree_cleanup(&tree_ll);
-  HuffmanTree_cleanup(&tree_d);
+/*size in bits of a dynamic block with these trees, made from these frequencies, including header and end code*/
+static size_t dynamic_trees_bits(const DynamicTrees* trees, const unsigned* frequencies_ll, const unsigned* frequencies_d)
+{
+  size_t i, bits = 3 + 5 + 5 + 4 + 3 * (trees->HCLEN + 4);
+  const uivector* bitlen_lld_e = &trees->bitlen_lld_e;
+
+  for(i = 0; i < bitlen_lld_e->size; i++)
+  {
+    bits += HuffmanTree_getLength(&trees->tree_cl, bitlen_lld_e->data[i]);
+    if(bitlen_lld_e->data[i] == 16) { bits += 2; i++; }
+    else if(bitlen_lld_e->data[i] == 17) { bits += 3; i++; }
+    else if(bitlen_lld_e->data[i] == 18) { bits += 7; i++; }
+  }
+  for(i = 0; i < trees->tree_ll.numcodes && i < 286; i++)
+  {
+    bits += (size_t)frequencies_ll[i] * HuffmanTree_getLength(&trees->tree_ll, (unsigned)i);
+    if(i >= FIRST_LENGTH_CODE_INDEX) bits += (size_t)frequencies_ll[i] * LENGTHEXTRA[i - FIRST_LENGTH_CODE_INDEX];
+  }
+  for(i = 0; i < trees->tree_d.numcodes && i < 30; i++)
+  {
+    bits += (size_t)frequencies_d[i] * (HuffmanTree_getLength(&trees->tree_d, (unsigned)i) + DISTANCEEXTRA[i]);
+  }
+  return bits;
+}
+
+/*writes lz77 encoded data as a block of type "dynamic", with huffman trees made for it*/
+static unsigned writeDynamicBlock(BitWriter* writer, const uivector* lz77_encoded, unsigned final)
+{
+  unsigned error = 0;
+  DynamicTrees trees;
+  unsigned frequencies_ll[286]; /*frequency of lit,len codes*/
+  unsigned frequencies_d[30]; /*frequency of dist codes*/
+  size_t i;
+
+  /*Count the frequencies of lit, len and dist codes*/
+  for(i = 0; i < 286; i++) frequencies_ll[i] = 0;
+  for(i = 0; i < 30; i++) frequencies_d[i] = 0;
+  for(i = 0; i < lz77_encoded->size; i++)
+  {
+    unsigned symbol = lz77_encoded->data[i];
+    frequencies_ll[symbol]++;
+    if(symbol > 256)
+    {
+      unsigned dist = lz77_encoded->data[i + 2];
+      frequencies_d[dist]++;
+      i += 3;
+    }
+  }
+  frequencies_ll[256] = 1; /*there will be exactly 1 end code, at the end of the block*/
+
+  dynamic_trees_init(&trees);
+  error = dynamic_trees_make(&trees, frequencies_ll, frequencies_d);
+  if(!error)
+  {
+    dynamic_trees_write(writer, &trees, final);
+    /*write the compressed data symbols*/
+    writeLZ77data(writer, lz77_encoded, &trees.tree_ll, &trees.tree_d);
+    /*write the end code*/
+    addHuffmanSymbol(writer, HuffmanTree_getCode(&trees.tree_ll, 256), HuffmanTree_getLength(&trees.tree_ll, 256));
+  }
+  dynamic_trees_cleanup(&trees);
+
+  return error;
+}
+
+/*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees*/
+static unsigned deflateDynamic(BitWriter* writer, Hash* hash,
+                               const unsigned char* data, size_t datapos, size_t dataend,
+                               const LodePNGCompressSettings* settings, unsigned final)
+{
+  unsigned error = 0;
+
+  /*
+  A block is compressed as follows: The PNG data is lz77 encoded, resulting in
+  literal bytes and length/distance pairs. This is then huffman compressed with
+  two huffman trees. One huffman tree is used for the lit and len values ("ll"),
+  another huffman tree is used for the dist values ("d"), see dynamic_trees_make.
+  */
+
+  /*The lz77 encoded data, represented with integers since there will also be length and distance codes in it*/
+  uivector lz77_encoded;
+  size_t datasize = dataend - datapos;
+  size_t i;
+
+  uivector_init(&lz77_encoded);
+
+  if(settings->level == LCL_RLE)
+  {
+    error = encodeLZ77RLE(&lz77_encoded, data, datapos, dataend, settings->stride);
+  }
+  else if(settings->use_lz77)
+  {
+    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                       settings->minmatch, settings->nicematch, settings->lazymatching);
+  }
+  else if(!uivector_resize(&lz77_encoded, datasize)) error = 83; /*alloc fail*/
+  else
+  {
+    /*no LZ77, but still will be Huffman compressed*/
+    for(i = datapos; i < dataend; i++) lz77_encoded.data[i - datapos] = data[i];
+  }
+
+  if(!error) error = writeDynamicBlock(writer, &lz77_encoded, final);
+
+  uivector_cleanup(&lz77_encoded);
+
+  return error;
+}
+
+static unsigned deflateFixed(BitWriter* writer, Hash* hash,
+                             const unsigned char* data,
+                             size_t datapos, size_t dataend,
+                             const LodePNGCompressSettings* settings, unsigned final)
+{
+  HuffmanTree tree_ll; /*tree for literal values and length codes*/
+  HuffmanTree tree_d; /*tree for distance codes*/
+
+  unsigned BFINAL = final;
+  unsigned error = 0;
+  size_t i;
+
+  HuffmanTree_init(&tree_ll);
+  HuffmanTree_init(&tree_d);
+
+  generateFixedLitLenTree(&tree_ll);
+  generateFixedDistanceTree(&tree_d);
+
+  writeBits(writer, BFINAL, 1);
+  writeBits(writer, 1, 1); /*first bit of BTYPE*/
+  writeBits(writer, 0, 1); /*second bit of BTYPE*/
+
+  if(settings->use_lz77) /*LZ77 encoded*/
+  {
+    uivector lz77_encoded;
+    uivector_init(&lz77_encoded);
+    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                       settings->minmatch, settings->nicematch, settings->lazymatching);
+    if(!error) writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
+    uivector_cleanup(&lz77_encoded);
+  }
+  else /*no LZ77, but still will be Huffman compressed*/
+  {
+    for(i = datapos; i < dataend; i++)
+    {
+      addHuffmanSymbol(writer, HuffmanTree_getCode(&tree_ll, data[i]), HuffmanTree_getLength(&tree_ll, data[i]));
+    }
+  }
+  /*add END code*/
+  if(!error) addHuffmanSymbol(writer, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256));
+
+  /*cleanup*/
+  HuffmanTree_cleanup(&tree_ll);
+  HuffmanTree_cleanup(&tree_d);
+
+  return error;
+}
+
+/*
+Deflate for LCL_ARCHIVE. The input is cut in master blocks that are handled independently.
+Every master block is first lz77 encoded the usual way, and split into deflate blocks
+where that lowers the estimated size, so that every block gets huffman trees that match
+its own statistics. Then every deflate block is parsed optimally: the cheapest sequence
+of literals and matches under a cost model in bits per symbol is found with dynamic
+programming over the matches of the full 32768 window. The cost model comes from the
+statistics of the previous parse, starting with those of the first lz77 encoding, and
+this is iterated. With OpenMP, master blocks and deflate blocks are handled in parallel.
+*/
+
+/*amount of input per master block*/
+#define ARCHIVE_MASTER_SIZE 1048576
+/*maximum amount of deflate blocks per master block*/
+#define ARCHIVE_MAX_BLOCKS 16
+/*blocks of fewer lz77 symbols are not split further*/
+#define ARCHIVE_MIN_SPLIT_SYMBOLS 10
+/*positions tried per round of the search for the best split point*/
+#define ARCHIVE_SPLIT_SAMPLES 9
+/*window of the first lz77 encoding, which is only used for estimates*/
+#define ARCHIVE_ESTIMATE_WINDOWSIZE 2048
+/*maximum hash chain positions visited per position when collecting matches*/
+#define ARCHIVE_MAX_CHAIN_HITS 8192
+/*maximum amount of matches stored per position*/
+#define ARCHIVE_MAX_MATCHES 16
+#define ARCHIVE_INFINITE_COST 1e30f
+
+/*
+A match as stored by archive_find_matches: (length << 21) | (distance code << 16) | distance.
+The matches of a position have increasing length and distance: lengths between the
+previous match (or 2) and this one are available at this distance, but not closer.
+*/
+#define ARCHIVE_MATCH_LENGTH(match) ((match) >> 21)
+#define ARCHIVE_MATCH_CODE(match) (((match) >> 16) & 31u)
+#define ARCHIVE_MATCH_DISTANCE(match) ((match) & 65535u)
+
+/*the lz77 symbols of the first encoding of a master block, used to find the split points*/
+typedef struct ArchiveSymbols
+{
+  uivector ll; /*lit,len code*/
+  uivector d; /*dist code, NUM_DISTANCE_SYMBOLS for literals*/
+  uivector pos; /*input position, relative to the start of the master block*/
+} ArchiveSymbols;
+
+typedef struct ArchiveBlock
+{
+  size_t start, end; /*input range of the deflate block*/
+  unsigned frequencies_ll[286]; /*statistics of the first lz77 encoding, the first cost model*/
+  unsigned frequencies_d[30];
+  uivector lz77_encoded; /*result of the optimal parse*/
+  unsigned error;
+} ArchiveBlock;
+
+/*hash of the byte value and length of a run of the same byte, to find other runs of that length*/
+static unsigned getArchiveRunHash(unsigned char value, unsigned run)
+{
+  unsigned key = (unsigned)value | (run << 8u);
+  return ((key * 2654435761u) & 0xffffffffu) >> (32u - FASTEST_HASH_BITS);
+}
+
+static void archive_symbols_init(ArchiveSymbols* symbols)
+{
+  uivector_init(&symbols->ll);
+  uivector_init(&symbols->d);
+  uivector_init(&symbols->pos);
+}
+
+static void archive_symbols_cleanup(ArchiveSymbols* symbols)
+{
+  uivector_cleanup(&symbols->ll);
+  uivector_cleanup(&symbols->d);
+  uivector_cleanup(&symbols->pos);
+}
+
+static unsigned archive_symbols_from_lz77(ArchiveSymbols* symbols, const uivector* lz77_encoded)
+{
+  size_t i;
+  unsigned pos = 0;
+  for(i = 0; i < lz77_encoded->size; i++)
+  {
+    unsigned symbol = lz77_encoded->data[i];
+    unsigned d = NUM_DISTANCE_SYMBOLS, length = 1;
+    if(symbol > 256)
+    {
+      length = LENGTHBASE[symbol - FIRST_LENGTH_CODE_INDEX] + lz77_encoded->data[i + 1];
+      d = lz77_encoded->data[i + 2];
+      i += 3;
+    }
+    if(!uivector_push_back(&symbols->ll, symbol)) return 83; /*alloc fail*/
+    if(!uivector_push_back(&symbols->d, d)) return 83; /*alloc fail*/
+    if(!uivector_push_back(&symbols->pos, pos)) return 83; /*alloc fail*/
+    pos += length;
+  }
+  return 0;
+}
+
+/*frequencies of the symbols [begin, end), with one end code*/
+static void archive_count(unsigned* frequencies_ll, unsigned* frequencies_d,
+                          const ArchiveSymbols* symbols, size_t begin, size_t end)
+{
+  size_t i;
+  for(i = 0; i < 286; i++) frequencies_ll[i] = 0;
+  for(i = 0; i < 30; i++) frequencies_d[i] = 0;
+  for(i = begin; i < end; i++)
+  {
+    frequencies_ll[symbols->ll.data[i]]++;
+    if(symbols->d.data[i] != NUM_DISTANCE_SYMBOLS) frequencies_d[symbols->d.data[i]]++;
+  }
+  frequencies_ll[256] = 1;
+}
+
+/*size in bits of a dynamic block with these frequencies, the maximum size_t if the trees can't be made*/
+static size_t archive_bits(const unsigned* frequencies_ll, const unsigned* frequencies_d)
+{
+  size_t bits = (size_t)(-1);
+  DynamicTrees trees;
+  dynamic_trees_init(&trees);
+  if(!dynamic_trees_make(&trees, frequencies_ll, frequencies_d))
+  {
+    bits = dynamic_trees_bits(&trees, frequencies_ll, frequencies_d);
+  }
+  dynamic_trees_cleanup(&trees);
+  return bits;
+}
+
+/*estimated size in bits of the symbols [begin, end) as one dynamic block*/
+static size_t archive_range_bits(const ArchiveSymbols* symbols, size_t begin, size_t end)
+{
+  unsigned frequencies_ll[286];
+  unsigned frequencies_d[30];
+  archive_count(frequencies_ll, frequencies_d, symbols, begin, end);
+  return archive_bits(frequencies_ll, frequencies_d);
+}
+
+/*
+The split point in (begin, end) with the smallest total size of the two blocks.
+Every round tries a few evenly spread points, and narrows the range down to the
+neighbours of the best one, until the range is small enough to try every point.
+*/
+static size_t archive_find_split(const ArchiveSymbols* symbols, size_t begin, size_t end, size_t* bits)
+{
+  size_t lo = begin + 1, hi = end; /*range of split points [lo, hi)*/
+  size_t best = lo, bestbits = (size_t)(-1);
+  size_t i;
+
+  while(hi - lo > ARCHIVE_SPLIT_SAMPLES)
+  {
+    size_t samples[ARCHIVE_SPLIT_SAMPLES];
+    size_t besti = 0, roundbits = (size_t)(-1);
+    for(i = 0; i < ARCHIVE_SPLIT_SAMPLES; i++)
+    {
+      size_t samplebits;
+      samples[i] = lo + (i + 1) * ((hi - lo) / (ARCHIVE_SPLIT_SAMPLES + 1));
+      samplebits = archive_range_bits(symbols, begin, samples[i]) + archive_range_bits(symbols, samples[i], end);
+      if(samplebits < roundbits)
+      {
+        roundbits = samplebits;
+        besti = i;
+      }
+    }
+    if(roundbits > bestbits) break; /*no better point found, stay with the previous best*/
+    best = samples[besti];
+    bestbits = roundbits;
+    if(besti > 0) lo = samples[besti - 1];
+    if(besti + 1 < ARCHIVE_SPLIT_SAMPLES) hi = samples[besti + 1];
+  }
+
+  if(hi - lo <= ARCHIVE_SPLIT_SAMPLES)
+  {
+    for(i = lo; i < hi; i++)
+    {
+      size_t pointbits = archive_range_bits(symbols, begin, i) + archive_range_bits(symbols, i, end);
+      if(pointbits < bestbits)
+      {
+        bestbits = pointbits;
+        best = i;
+      }
+    }
+  }
+
+  *bits = bestbits;
+  return best;
+}
+
+/*
+Cuts the master block [start, end) into deflate blocks, and adds them to blocks.
+The largest block that may still be split is split at its best point, as long as
+that makes the total size smaller.
+*/
+static unsigned archive_split(ArchiveBlock* blocks, size_t* numblocks,
+                              const unsigned char* in, size_t start, size_t end)
+{
+  unsigned error = 0;
+  Hash hash;
+  uivector lz77_encoded;
+  ArchiveSymbols symbols;
+  uivector splits; /*index of the first symbol of every block*/
+  uivector done; /*per block, whether it can't be split any further*/
+  size_t i;
+
+  uivector_init(&lz77_encoded);
+  archive_symbols_init(&symbols);
+  uivector_init(&splits);
+  uivector_init(&done);
+  *numblocks = 0;
+
+  error = hash_init(&hash, ARCHIVE_ESTIMATE_WINDOWSIZE);
+  if(!error) error = encodeLZ77(&lz77_encoded, &hash, in, start, end, ARCHIVE_ESTIMATE_WINDOWSIZE,
+                                3, MAX_SUPPORTED_DEFLATE_LENGTH, 1);
+  hash_cleanup(&hash);
+  if(!error) error = archive_symbols_from_lz77(&symbols, &lz77_encoded);
+  uivector_cleanup(&lz77_encoded);
+  if(!error && (!uivector_push_back(&splits, 0) || !uivector_push_back(&done, 0))) error = 83; /*alloc fail*/
+
+  while(!error && splits.size < ARCHIVE_MAX_BLOCKS)
+  {
+    size_t largest = splits.size, largestsize = 0;
+    size_t begin, blockend, split, splitbits;
+
+    for(i = 0; i < splits.size; i++)
+    {
+      size_t size = (i + 1 < splits.size ? splits.data[i + 1] : symbols.ll.size) - splits.data[i];
+      if(!done.data[i] && size >= ARCHIVE_MIN_SPLIT_SYMBOLS && size > largestsize)
+      {
+        largest = i;
+        largestsize = size;
+      }
+    }
+    if(largest == splits.size) break; /*nothing left to split*/
+
+    begin = splits.data[largest];
+    blockend = begin + largestsize;
+    split = archive_find_split(&symbols, begin, blockend, &splitbits);
+    if(splitbits >= archive_range_bits(&symbols, begin, blockend))
+    {
+      done.data[largest] = 1;
+      continue;
+    }
+
+    if(!uivector_resize(&splits, splits.size + 1) || !uivector_resize(&done, done.size + 1)) ERROR_BREAK(83);
+    for(i = splits.size - 1; i > largest + 1; i--)
+    {
+      splits.data[i] = splits.data[i - 1];
+      done.data[i] = done.data[i - 1];
+    }
+    splits.data[largest + 1] = (unsigned)split;
+    done.data[largest + 1] = 0;
+  }
+
+  for(i = 0; !error && i < splits.size; i++)
+  {
+    ArchiveBlock* block = &blocks[i];
+    size_t first = splits.data[i];
+    size_t last = i + 1 < splits.size ? splits.data[i + 1] : symbols.ll.size;
+    block->start = first < symbols.pos.size ? start + symbols.pos.data[first] : end;
+    block->end = last < symbols.pos.size ? start + symbols.pos.data[last] : end;
+    archive_count(block->frequencies_ll, block->frequencies_d, &symbols, first, last);
+    *numblocks = i + 1;
+  }
+
+  archive_symbols_cleanup(&symbols);
+  uivector_cleanup(&splits);
+  uivector_cleanup(&done);
 
   return error;
 }
 
+/*
+Collects the matches of every position in [start, end) into matches, with first[i]
+the index of the first match of position start + i and first[end - start] the total.
+Matches may begin up to 32768 bytes before start, and never go beyond end. same[i]
+is the amount of bytes equal to in[windowstart + i] from there on. Next to the hash
+chain of 3 bytes there's a second chain per byte value and run length: once a match
+covers the whole run of the same byte at a position, only positions with a run of
+exactly the same length can give a longer match, so the search continues on that chain.
+*/
+static unsigned archive_find_matches(uivector* matches, size_t* first, const unsigned char* in,
+                                     size_t windowstart, size_t start, size_t end, const unsigned short* same)
+{
+  size_t* head = (size_t*)lodepng_malloc(sizeof(size_t) * FASTEST_HASH_SIZE);
+  size_t* prev = (size_t*)lodepng_malloc(sizeof(size_t) * 32768);
+  size_t* head2 = (size_t*)lodepng_malloc(sizeof(size_t) * FASTEST_HASH_SIZE);
+  size_t* prev2 = (size_t*)lodepng_malloc(sizeof(size_t) * 32768);
+  size_t pos, i;
+  unsigned error = 0;
+
+  if(!head || !prev || !head2 || !prev2) error = 83; /*alloc fail*/
+  for(i = 0; !error && i < FASTEST_HASH_SIZE; i++) head[i] = head2[i] = FASTEST_HASH_NONE;
+
+  for(pos = windowstart; !error && pos < end; pos++)
+  {
+    unsigned run = same[pos - windowstart];
+    unsigned hashable = pos + 3 <= end;
+    unsigned hashval = hashable ? getFastestHash(&in[pos]) : 0;
+
+    if(pos >= start)
+    {
+      first[pos - start] = matches->size;
+      if(hashable)
+      {
+        size_t maxlength = end - pos > MAX_SUPPORTED_DEFLATE_LENGTH ? MAX_SUPPORTED_DEFLATE_LENGTH : end - pos;
+        size_t length = 0, numfound = 0;
+        size_t candidate = head[hashval];
+        const size_t* chain = prev;
+        unsigned hits = 0;
+
+        while(candidate != FASTEST_HASH_NONE && pos - candidate <= 32768 && hits++ < ARCHIVE_MAX_CHAIN_HITS)
+        {
+          size_t current = 0;
+          unsigned candidaterun = same[candidate - windowstart];
+          /*only a candidate that also matches the byte after the longest match so far can be longer*/
+          if(in[candidate] == in[pos] && in[candidate + length] == in[pos + length])
+          {
+            /*the runs of the same byte at both positions are known to be equal*/
+            if(run >= 3) current = run < candidaterun ? run : candidaterun;
+            if(current > maxlength) current = maxlength;
+            while(current < maxlength && in[candidate + current] == in[pos + current]) current++;
+          }
+
+          if(current >= 3 && current > length)
+          {
+            unsigned distance = (unsigned)(pos - candidate);
+            unsigned match = ((unsigned)current << 21u)
+                           | ((unsigned)searchCodeIndex(DISTANCEBASE, 30, distance) << 16u) | distance;
+            /*when full, the last match is replaced: its shorter lengths are still available at the new distance*/
+            if(numfound == ARCHIVE_MAX_MATCHES) matches->data[matches->size - 1] = match;
+            else
+            {
+              if(!uivector_push_back(matches, match)) ERROR_BREAK(83 /*alloc fail*/);
+              numfound++;
+            }
+            length = current;
+            if(length >= maxlength) break;
+          }
+
+          if(chain == prev && run >= 3 && length >= run && candidaterun == run && in[candidate] == in[pos])
+          {
+            chain = prev2;
+          }
+          candidate = chain[candidate & 32767];
+        }
+      }
+    }
+
+    if(hashable)
+    {
+      prev[pos & 32767] = head[hashval];
+      head[hashval] = pos;
+      if(run >= 3)
+      {
+        unsigned hashval2 = getArchiveRunHash(in[pos], run);
+        prev2[pos & 32767] = head2[hashval2];
+        head2[hashval2] = pos;
+      }
+    }
+  }
+  if(!error) first[end - start] = matches->size;
+
+  lodepng_free(head);
+  lodepng_free(prev);
+  lodepng_free(head2);
+  lodepng_free(prev2);
+
+  return error;
+}
+
+/*the cost model: bits per lit,len and dist code, from their entropy in the frequencies, plus extra bits*/
+static void archive_costs(float* costs_ll, float* costs_d, const unsigned* frequencies_ll, const unsigned* frequencies_d)
+{
+  size_t i;
+  double sum_ll = 0, sum_d = 0, log_ll, log_d;
+  for(i = 0; i < 286; i++) sum_ll += frequencies_ll[i];
+  for(i = 0; i < 30; i++) sum_d += frequencies_d[i];
+  /*an absent symbol costs as much as one that occurs once*/
+  log_ll = log(sum_ll) / log(2.0);
+  log_d = sum_d > 0 ? log(sum_d) / log(2.0) : log(30.0) / log(2.0);
+  for(i = 0; i < 286; i++)
+  {
+    costs_ll[i] = (float)(frequencies_ll[i] ? log_ll - log((double)frequencies_ll[i]) / log(2.0) : log_ll);
+    if(i >= FIRST_LENGTH_CODE_INDEX) costs_ll[i] += LENGTHEXTRA[i - FIRST_LENGTH_CODE_INDEX];
+  }
+  for(i = 0; i < 30; i++)
+  {
+    costs_d[i] = (float)(frequencies_d[i] ? log_d - log((double)frequencies_d[i]) / log(2.0) : log_d);
+    costs_d[i] += DISTANCEEXTRA[i];
+  }
+}
+
+/*
+The cheapest parse of [start, end) under the cost model, as the lengths of its symbols
+in path (1 for a literal). costs and lengths are scratch arrays of end - start + 1 values:
+the cheapest cost to reach every position, and the length of the last symbol to get there.
+*/
+static unsigned archive_parse(uivector* path, const unsigned char* in, size_t start, size_t end,
+                              const uivector* matches, const size_t* first, const unsigned short* same,
+                              const float* costs_ll, const float* costs_d, float* costs, unsigned short* lengths)
+{
+  size_t size = end - start, i, j;
+  float costs_length[MAX_SUPPORTED_DEFLATE_LENGTH + 1];
+
+  for(i = 3; i <= MAX_SUPPORTED_DEFLATE_LENGTH; i++)
+  {
+    costs_length[i] = costs_ll[FIRST_LENGTH_CODE_INDEX + searchCodeIndex(LENGTHBASE, 29, i)];
+  }
+  costs[0] = 0;
+  for(i = 1; i <= size; i++) costs[i] = ARCHIVE_INFINITE_COST;
+
+  for(i = 0; i < size; i++)
+  {
+    float cost;
+
+    /*deep inside a long run of the same byte, take maximum length matches at distance 1 without searching*/
+    if(same[i] > MAX_SUPPORTED_DEFLATE_LENGTH * 2 && i > MAX_SUPPORTED_DEFLATE_LENGTH + 1
+       && i + MAX_SUPPORTED_DEFLATE_LENGTH * 2 + 1 < size && same[i - MAX_SUPPORTED_DEFLATE_LENGTH] > MAX_SUPPORTED_DEFLATE_LENGTH)
+    {
+      cost = costs_length[MAX_SUPPORTED_DEFLATE_LENGTH] + costs_d[0];
+      for(j = 0; j < MAX_SUPPORTED_DEFLATE_LENGTH; j++, i++)
+      {
+        costs[i + MAX_SUPPORTED_DEFLATE_LENGTH] = costs[i] + cost;
+        lengths[i + MAX_SUPPORTED_DEFLATE_LENGTH] = MAX_SUPPORTED_DEFLATE_LENGTH;
+      }
+    }
+
+    cost = costs[i] + costs_ll[in[start + i]];
+    if(cost < costs[i + 1])
+    {
+      costs[i + 1] = cost;
+      lengths[i + 1] = 1;
+    }
+
+    for(j = first[i]; j < first[i + 1]; j++)
+    {
+      unsigned match = matches->data[j];
+      unsigned length = j == first[i] ? 3 : ARCHIVE_MATCH_LENGTH(matches->data[j - 1]) + 1;
+      float base = costs[i] + costs_d[ARCHIVE_MATCH_CODE(match)];
+      for(; length <= ARCHIVE_MATCH_LENGTH(match); length++)
+      {
+        cost = base + costs_length[length];
+        if(cost < costs[i + length])
+        {
+          costs[i + length] = cost;
+          lengths[i + length] = (unsigned short)length;
+        }
+      }
+    }
+  }
+
+  /*trace back from the end, then put the symbols in input order*/
+  path->size = 0;
+  for(i = size; i > 0; i -= lengths[i])
+  {
+    if(!uivector_push_back(path, lengths[i])) return 83; /*alloc fail*/
+  }
+  for(i = 0; i < path->size / 2; i++)
+  {
+    unsigned temp = path->data[i];
+    path->data[i] = path->data[path->size - 1 - i];
+    path->data[path->size - 1 - i] = temp;
+  }
+  return 0;
+}
+
+/*the closest match of at least the given length of position i, see ARCHIVE_MATCH_LENGTH*/
+static unsigned archive_match(const uivector* matches, const size_t* first, size_t i, unsigned length)
+{
+  size_t j;
+  for(j = first[i]; j < first[i + 1]; j++)
+  {
+    if(ARCHIVE_MATCH_LENGTH(matches->data[j]) >= length) return matches->data[j];
+  }
+  return 0;
+}
+
+/*lz77 encodes the block with an optimal parse, iterating the cost model*/
+static unsigned archive_block(ArchiveBlock* block, const unsigned char* in, unsigned iterations)
+{
+  size_t start = block->start, end = block->end, size = end - start;
+  size_t windowstart = start > 32768 ? start - 32768 : 0;
+  unsigned short* same = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * (end - windowstart + 1));
+  size_t* first = (size_t*)lodepng_malloc(sizeof(size_t) * (size + 1));
+  float* costs = (float*)lodepng_malloc(sizeof(float) * (size + 1));
+  unsigned short* lengths = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * (size + 1));
+  unsigned frequencies_ll[286];
+  unsigned frequencies_d[30];
+  float costs_ll[286];
+  float costs_d[30];
+  uivector matches, path, bestpath;
+  size_t bestbits = (size_t)(-1), lastbits = (size_t)(-1);
+  size_t i, pos;
+  unsigned iteration, error = 0;
+
+  uivector_init(&matches);
+  uivector_init(&path);
+  uivector_init(&bestpath);
+  for(i = 0; i < 286; i++) frequencies_ll[i] = block->frequencies_ll[i];
+  for(i = 0; i < 30; i++) frequencies_d[i] = block->frequencies_d[i];
+  if(iterations == 0) iterations = 1;
+
+  while(!error)
+  {
+    if(!same || !first || !costs || !lengths) ERROR_BREAK(83 /*alloc fail*/);
+
+    for(pos = end; pos > windowstart; pos--)
+    {
+      unsigned short* current = &same[pos - 1 - windowstart];
+      *current = 1;
+      if(pos < end && in[pos - 1] == in[pos] && current[1] < 65535) *current = current[1] + 1;
+      else if(pos < end && in[pos - 1] == in[pos]) *current = 65535;
+    }
+
+    error = archive_find_matches(&matches, first, in, windowstart, start, end, same);
+    if(error) break;
+
+    for(iteration = 0; !error && iteration < iterations; iteration++)
+    {
+      size_t bits;
+      archive_costs(costs_ll, costs_d, frequencies_ll, frequencies_d);
+      error = archive_parse(&path, in, start, end, &matches, first, &same[start - windowstart],
+                            costs_ll, costs_d, costs, lengths);
+      if(error) break;
+
+      for(i = 0; i < 286; i++) frequencies_ll[i] = 0;
+      for(i = 0; i < 30; i++) frequencies_d[i] = 0;
+      for(i = 0, pos = 0; i < path.size; pos += path.data[i], i++)
+      {
+        unsigned match;
+        if(path.data[i] == 1)
+        {
+          frequencies_ll[in[start + pos]]++;
+          continue;
+        }
+        match = archive_match(&matches, first, pos, path.data[i]);
+        if(!match) ERROR_BREAK(97);
+        frequencies_ll[FIRST_LENGTH_CODE_INDEX + searchCodeIndex(LENGTHBASE, 29, path.data[i])]++;
+        frequencies_d[ARCHIVE_MATCH_CODE(match)]++;
+      }
+      if(error) break;
+      frequencies_ll[256] = 1;
+
+      bits = archive_bits(frequencies_ll, frequencies_d);
+      if(bits < bestbits)
+      {
+        bestbits = bits;
+        if(!uivector_resize(&bestpath, path.size)) ERROR_BREAK(83 /*alloc fail*/);
+        for(i = 0; i < path.size; i++) bestpath.data[i] = path.data[i];
+      }
+      else if(bits == lastbits) break; /*the cost model doesn't change anymore*/
+      lastbits = bits;
+    }
+    if(error) break;
+
+    for(i = 0, pos = 0; i < bestpath.size; pos += bestpath.data[i], i++)
+    {
+      if(bestpath.data[i] == 1)
+      {
+        if(!uivector_push_back(&block->lz77_encoded, in[start + pos])) ERROR_BREAK(83 /*alloc fail*/);
+      }
+      else
+      {
+        unsigned match = archive_match(&matches, first, pos, bestpath.data[i]);
+        addLengthDistance(&block->lz77_encoded, bestpath.data[i], ARCHIVE_MATCH_DISTANCE(match));
+      }
+    }
+
+    break; /*end of error-while*/
+  }
+
+  lodepng_free(same);
+  lodepng_free(first);
+  lodepng_free(costs);
+  lodepng_free(lengths);
+  uivector_cleanup(&matches);
+  uivector_cleanup(&path);
+  uivector_cleanup(&bestpath);
+
+  return error;
+}
+
+static unsigned deflateArchive(BitWriter* writer, const unsigned char* data, size_t datapos, size_t dataend,
+                               const LodePNGCompressSettings* settings, unsigned final)
+{
+  unsigned error = 0;
+  size_t nummasters = (dataend - datapos + ARCHIVE_MASTER_SIZE - 1) / ARCHIVE_MASTER_SIZE;
+  ArchiveBlock* blocks;
+  size_t* numblocks; /*per master block*/
+  size_t i, j;
+  long m, b; /*signed loop variables for OpenMP*/
+
+  if(nummasters == 0) nummasters = 1; /*empty input still needs one (final) block*/
+  blocks = (ArchiveBlock*)lodepng_malloc(sizeof(ArchiveBlock) * nummasters * ARCHIVE_MAX_BLOCKS);
+  numblocks = (size_t*)lodepng_malloc(sizeof(size_t) * nummasters);
+  if(!blocks || !numblocks)
+  {
+    lodepng_free(blocks);
+    lodepng_free(numblocks);
+    return 83; /*alloc fail*/
+  }
+  for(i = 0; i < nummasters * ARCHIVE_MAX_BLOCKS; i++)
+  {
+    uivector_init(&blocks[i].lz77_encoded);
+    blocks[i].error = 0;
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic)
+#endif
+  for(m = 0; m < (long)nummasters; m++)
+  {
+    size_t start = datapos + (size_t)m * ARCHIVE_MASTER_SIZE;
+    size_t end = dataend - start > ARCHIVE_MASTER_SIZE ? start + ARCHIVE_MASTER_SIZE : dataend;
+    ArchiveBlock* masterblocks = &blocks[m * ARCHIVE_MAX_BLOCKS];
+    masterblocks->error = archive_split(masterblocks, &numblocks[m], data, start, end);
+    if(masterblocks->error) numblocks[m] = 0;
+  }
+  for(i = 0; i < nummasters; i++)
+  {
+    if(blocks[i * ARCHIVE_MAX_BLOCKS].error) error = blocks[i * ARCHIVE_MAX_BLOCKS].error;
+  }
+
+  /*the deflate blocks of all master blocks are parsed in parallel, they only read the input*/
+  if(!error)
+  {
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+#endif
+    for(b = 0; b < (long)(nummasters * ARCHIVE_MAX_BLOCKS); b++)
+    {
+      if((size_t)b % ARCHIVE_MAX_BLOCKS < numblocks[b / ARCHIVE_MAX_BLOCKS])
+      {
+        blocks[b].error = archive_block(&blocks[b], data, settings->iterations);
+      }
+    }
+  }
+
+  for(i = 0; !error && i < nummasters; i++)
+  {
+    for(j = 0; !error && j < numblocks[i]; j++)
+    {
+      ArchiveBlock* block = &blocks[i * ARCHIVE_MAX_BLOCKS + j];
+      unsigned last = final && i == nummasters - 1 && j == numblocks[i] - 1;
+      error = block->error;
+      if(!error) error = writeDynamicBlock(writer, &block->lz77_encoded, last);
+    }
+  }
+
+  for(i = 0; i < nummasters * ARCHIVE_MAX_BLOCKS; i++) uivector_cleanup(&blocks[i].lz77_encoded);
+  lodepng_free(blocks);
+  lodepng_free(numblocks);
+
+  return error;
+}
+
+/*turns settings with level LCL_MAX into the custom settings it stands for*/
+static void setMaxLevelSettings(LodePNGCompressSettings* settings)
+{
+  /*full window, no hash chain length limit (see encodeLZ77) and only stop at the longest possible match*/
+  settings->btype = 2;
+  settings->use_lz77 = 1;
+  settings->windowsize = 32768;
+  settings->minmatch = 3;
+  settings->nicematch = MAX_SUPPORTED_DEFLATE_LENGTH;
+  settings->lazymatching = 1;
+}
+
 static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
                                  const LodePNGCompressSettings* settings)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
-  size_t bp = 0; /*the bit pointer*/
+  BitWriter writer;
+  unsigned usehash;
   Hash hash;
+  LodePNGCompressSettings maxsettings;
+
+  if(settings->level > LCL_ARCHIVE) return 91; /*error: unexisting compression level*/
+  else if(settings->level == LCL_STORED) return deflateNoCompression(out, in, insize, 1);
+  else if(settings->level == LCL_MAX)
+  {
+    maxsettings = *settings;
+    setMaxLevelSettings(&maxsettings);
+    settings = &maxsettings;
+  }
+
+  if(settings->level == LCL_CUSTOM || settings->level == LCL_MAX) /*the other levels ignore btype*/
+  {
+    if(settings->btype > 2) return 61;
+    else if(settings->btype == 0) return deflateNoCompression(out, in, insize, 1);
+  }
 
-  if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
+  /*reserve room for a typical compressed size, so the bit writer rarely has to grow the output*/
+  ucvector_reserve(out, out->size + insize / 2 + 64);
+  BitWriter_init(&writer, out);
+
+  if(settings->level == LCL_FASTEST)
+  {
+    size_t* head = (size_t*)lodepng_malloc(sizeof(size_t) * FASTEST_HASH_SIZE);
+    if(!head) return 83; /*alloc fail*/
+    for(i = 0; i < FASTEST_HASH_SIZE; i++) head[i] = FASTEST_HASH_NONE;
+    error = deflateFastest(&writer, head, in, 0, insize, 1);
+    lodepng_free(head);
+    if(!error) error = BitWriter_finish(&writer);
+    return error;
+  }
+  else if(settings->level == LCL_ARCHIVE)
+  {
+    error = deflateArchive(&writer, in, 0, insize, settings, 1);
+    if(!error) error = BitWriter_finish(&writer);
+    return error;
+  }
+
+  if(settings->level != LCL_RLE && settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/
   {
     blocksize = insize / 8 + 8;
@@ -2005,8 +2946,13 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   numdeflateblocks = (insize + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
-  if(error) return error;
+  /*the RLE matcher only looks back at fixed distances and needs no hash chains*/
+  usehash = settings->level != LCL_RLE;
+  if(usehash)
+  {
+    error = hash_init(&hash, settings->windowsize);
+    if(error) return error;
+  }
 
   for(i = 0; i < numdeflateblocks && !error; i++)
   {
@@ -2015,11 +2961,13 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
     size_t end = start + blocksize;
     if(end > insize) end = insize;
 
-    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+    if(settings->level == LCL_RLE) error = deflateDynamic(&writer, 0, in, start, end, settings, final);
+    else if(settings->btype == 1) error = deflateFixed(&writer, &hash, in, start, end, settings, final);
+    else if(settings->btype == 2) error = deflateDynamic(&writer, &hash, in, start, end, settings, final);
   }
 
-  hash_cleanup(&hash);
+  if(usehash) hash_cleanup(&hash);
+  if(!error) error = BitWriter_finish(&writer);
 
   return error;
 }
@@ -2154,6 +3102,20 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
+static void addZlibHeader(ucvector* out)
+{
+  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
+  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
+  unsigned FLEVEL = 0;
+  unsigned FDICT = 0;
+  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
+  unsigned FCHECK = 31 - CMFFLG % 31;
+  CMFFLG += FCHECK;
+
+  ucvector_push_back(out, (unsigned char)(CMFFLG / 256));
+  ucvector_push_back(out, (unsigned char)(CMFFLG % 256));
+}
+
 unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                size_t insize, const LodePNGCompressSettings* settings)
 {
@@ -2164,50 +3126,192 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   unsigned error;
   unsigned char* deflatedata = 0;
   size_t deflatesize = 0;
-
   unsigned ADLER32;
-  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
-  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
-  unsigned FLEVEL = 0;
-  unsigned FDICT = 0;
-  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
-  unsigned FCHECK = 31 - CMFFLG % 31;
-  CMFFLG += FCHECK;
 
   /*ucvector-controlled version of the output buffer, for dynamic array*/
   ucvector_init_buffer(&outv, *out, *outsize);
 
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG / 256));
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG % 256));
+  addZlibHeader(&outv);
+
+  error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+
+  if(!error)
+  {
+    ADLER32 = adler32(in, (unsigned)insize);
+    for(i = 0; i < deflatesize; i++) ucvector_push_back(&outv, deflatedata[i]);
+    lodepng_free(deflatedata);
+    lodepng_add32bitInt(&outv, ADLER32);
+  }
+
+  *out = outv.data;
+  *outsize = outv.size;
+
+  return error;
+}
+
+/* compress using the default or custom zlib function */
+static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                              size_t insize, const LodePNGCompressSettings* settings)
+{
+  if(settings->custom_zlib)
+  {
+    return settings->custom_zlib(out, outsize, in, insize, settings);
+  }
+  else
+  {
+    return lodepng_zlib_compress(out, outsize, in, insize, settings);
+  }
+}
+
+/*
+Incremental zlib compressor, used by the streaming PNG encoder. The input comes
+in piece by piece and is compressed a deflate block at a time, as soon as enough
+of it is there for a block. The user of the stream takes the compressed bytes
+from the front of out as they come; the last ZLIB_STREAM_HISTORY bytes of the
+input are kept for the lz77 window. Custom zlib and deflate functions can not be
+used this way, since they want all input at once.
+*/
+typedef struct ZlibStream
+{
+  LodePNGCompressSettings settings; /*with LCL_MAX already turned into its custom settings*/
+  ucvector out; /*compressed output not yet taken by the user of the stream*/
+  BitWriter writer; /*writes to out*/
+  /*input: the history for the lz77 window, followed from pos on by the input that isn't compressed yet*/
+  ucvector in;
+  size_t pos;
+  unsigned usehash;
+  Hash hash; /*hash chains of LCL_CUSTOM and LCL_MAX, kept over the blocks*/
+  size_t* head; /*hash table of LCL_FASTEST*/
+  unsigned adler;
+} ZlibStream;
+
+/*amount of input bytes kept for the lz77 window: the largest deflate distance. Also a
+multiple of every windowsize, sliding the input by multiples of this keeps the hash valid*/
+#define ZLIB_STREAM_HISTORY 32768
+/*amount of input bytes per deflate block*/
+#define ZLIB_STREAM_BLOCKSIZE 131072
+
+/*the block types of the stream, as chosen by level and btype*/
+static unsigned zlib_stream_stored(const LodePNGCompressSettings* settings)
+{
+  return settings->level == LCL_STORED || (settings->level == LCL_CUSTOM && settings->btype == 0);
+}
+
+/*writes the zlib header to out, the stream must be cleaned up even on error*/
+static unsigned zlib_stream_init(ZlibStream* stream, const LodePNGCompressSettings* settings)
+{
+  size_t i;
+
+  stream->settings = *settings;
+  ucvector_init(&stream->out);
+  BitWriter_init(&stream->writer, &stream->out);
+  ucvector_init(&stream->in);
+  stream->pos = 0;
+  stream->usehash = 0;
+  stream->head = 0;
+  stream->adler = 1L;
+
+  if(settings->custom_zlib || settings->custom_deflate) return 94;
+  if(settings->level > LCL_ARCHIVE) return 91; /*error: unexisting compression level*/
+  if(settings->level == LCL_MAX) setMaxLevelSettings(&stream->settings);
+  if(stream->settings.level == LCL_CUSTOM || stream->settings.level == LCL_MAX) /*the other levels ignore btype*/
+  {
+    if(stream->settings.btype > 2) return 61;
+  }
+
+  addZlibHeader(&stream->out);
+  if(!ucvector_reserve(&stream->in, ZLIB_STREAM_HISTORY + 2 * ZLIB_STREAM_BLOCKSIZE)) return 83; /*alloc fail*/
+
+  if(stream->settings.level == LCL_FASTEST)
+  {
+    stream->head = (size_t*)lodepng_malloc(sizeof(size_t) * FASTEST_HASH_SIZE);
+    if(!stream->head) return 83; /*alloc fail*/
+    for(i = 0; i < FASTEST_HASH_SIZE; i++) stream->head[i] = FASTEST_HASH_NONE;
+  }
+  else if(stream->settings.level != LCL_RLE && stream->settings.level != LCL_ARCHIVE
+          && !zlib_stream_stored(&stream->settings))
+  {
+    stream->usehash = 1;
+    return hash_init(&stream->hash, stream->settings.windowsize);
+  }
+  return 0;
+}
+
+static void zlib_stream_cleanup(ZlibStream* stream)
+{
+  ucvector_cleanup(&stream->out);
+  ucvector_cleanup(&stream->in);
+  if(stream->usehash) hash_cleanup(&stream->hash);
+  lodepng_free(stream->head);
+}
 
-  error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+/*
+Compresses the input from pos in blocks of ZLIB_STREAM_BLOCKSIZE. Without final,
+only while more than a block is waiting, so that there's always input left for the
+final block. With final, everything up to and including the final block.
+*/
+static unsigned zlib_stream_deflate(ZlibStream* stream, unsigned final)
+{
+  unsigned error = 0;
+  const LodePNGCompressSettings* settings = &stream->settings;
 
-  if(!error)
+  while(!error && (final || stream->in.size - stream->pos > ZLIB_STREAM_BLOCKSIZE))
   {
-    ADLER32 = adler32(in, (unsigned)insize);
-    for(i = 0; i < deflatesize; i++) ucvector_push_back(&outv, deflatedata[i]);
-    lodepng_free(deflatedata);
-    lodepng_add32bitInt(&outv, ADLER32);
+    size_t start = stream->pos;
+    size_t end = stream->in.size - start < ZLIB_STREAM_BLOCKSIZE ? stream->in.size : start + ZLIB_STREAM_BLOCKSIZE;
+    unsigned last = final && end == stream->in.size;
+    unsigned char* in = stream->in.data;
+
+    /*stored blocks are whole bytes, the bit writer never has pending bits then*/
+    if(zlib_stream_stored(settings)) error = deflateNoCompression(&stream->out, &in[start], end - start, last);
+    else if(settings->level == LCL_FASTEST) error = deflateFastest(&stream->writer, stream->head, in, start, end, last);
+    else if(settings->level == LCL_RLE) error = deflateDynamic(&stream->writer, 0, in, start, end, settings, last);
+    else if(settings->level == LCL_ARCHIVE) error = deflateArchive(&stream->writer, in, start, end, settings, last);
+    else if(settings->btype == 1) error = deflateFixed(&stream->writer, &stream->hash, in, start, end, settings, last);
+    else error = deflateDynamic(&stream->writer, &stream->hash, in, start, end, settings, last);
+    if(!error) error = stream->writer.error;
+
+    stream->pos = end;
+    if(last) break;
   }
+  if(!error && final) error = BitWriter_finish(&stream->writer);
 
-  *out = outv.data;
-  *outsize = outv.size;
+  /*drop input that is no longer in the window*/
+  if(!error && stream->pos >= 2 * ZLIB_STREAM_HISTORY)
+  {
+    size_t shift = (stream->pos / ZLIB_STREAM_HISTORY - 1) * ZLIB_STREAM_HISTORY;
+    memmove(stream->in.data, &stream->in.data[shift], stream->in.size - shift);
+    stream->in.size -= shift;
+    stream->pos -= shift;
+    if(stream->head)
+    {
+      size_t i;
+      for(i = 0; i < FASTEST_HASH_SIZE; i++)
+      {
+        stream->head[i] = stream->head[i] != FASTEST_HASH_NONE && stream->head[i] >= shift
+                        ? stream->head[i] - shift : FASTEST_HASH_NONE;
+      }
+    }
+  }
 
   return error;
 }
 
-/* compress using the default or custom zlib function */
-static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                              size_t insize, const LodePNGCompressSettings* settings)
+static unsigned zlib_stream_write(ZlibStream* stream, const unsigned char* in, size_t insize)
 {
-  if(settings->custom_zlib)
-  {
-    return settings->custom_zlib(out, outsize, in, insize, settings);
-  }
-  else
-  {
-    return lodepng_zlib_compress(out, outsize, in, insize, settings);
-  }
+  size_t oldsize = stream->in.size;
+  if(!ucvector_resize(&stream->in, oldsize + insize)) return 83; /*alloc fail*/
+  memcpy(&stream->in.data[oldsize], in, insize);
+  stream->adler = update_adler32(stream->adler, in, (unsigned)insize);
+  return zlib_stream_deflate(stream, 0);
+}
+
+/*compresses all remaining input and ends the zlib data with the ADLER32 checksum*/
+static unsigned zlib_stream_finish(ZlibStream* stream)
+{
+  unsigned error = zlib_stream_deflate(stream, 1);
+  if(!error) lodepng_add32bitInt(&stream->out, stream->adler);
+  return error;
 }
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2250,12 +3354,16 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->nicematch = 128;
   settings->lazymatching = 1;
 
+  settings->level = LCL_CUSTOM;
+  settings->stride = 0;
+  settings->iterations = 15;
+
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, LCL_CUSTOM, 0, 15, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -3502,27 +4610,198 @@ unsigned getValueRequiredBits(unsigned char value)
   return 8;
 }
 
-/*profile must already have been inited with mode.
-It's ok to set some parameters of profile to done already.*/
-unsigned get_color_profile(LodePNGColorProfile* profile,
-                           const unsigned char* in, unsigned w, unsigned h,
-                           const LodePNGColorMode* mode)
+/*what a color profile scan still has to find out, see get_color_profile*/
+typedef struct ColorProfileState
 {
-  unsigned error = 0;
-  size_t i;
-  ColorTree tree;
-  size_t numpixels = w * h;
+  ColorTree tree; /*the colors counted so far*/
+  unsigned colored_done;
+  unsigned alpha_done;
+  unsigned numcolors_done;
+  unsigned bits_done;
+  unsigned maxnumcolors; /*amount of colors after which counting stops*/
+} ColorProfileState;
 
-  unsigned colored_done = lodepng_is_greyscale_type(mode) ? 1 : 0;
-  unsigned alpha_done = lodepng_can_have_alpha(mode) ? 0 : 1;
-  unsigned numcolors_done = 0;
+/*opaque: the caller knows that all pixels are opaque, alpha needs no scan*/
+static void color_profile_state_init(ColorProfileState* state, const LodePNGColorMode* mode, unsigned opaque)
+{
   unsigned bpp = lodepng_get_bpp(mode);
-  unsigned bits_done = bpp == 1 ? 1 : 0;
-  unsigned maxnumcolors = 257;
+  color_tree_init(&state->tree);
+  state->colored_done = lodepng_is_greyscale_type(mode) ? 1 : 0;
+  state->alpha_done = (opaque || !lodepng_can_have_alpha(mode)) ? 1 : 0;
+  state->numcolors_done = 0;
+  state->bits_done = bpp == 1 ? 1 : 0;
+  state->maxnumcolors = 257;
+  if(bpp <= 8) state->maxnumcolors = bpp == 1 ? 2 : (bpp == 2 ? 4 : (bpp == 4 ? 16 : 256));
+}
+
+static unsigned color_profile_state_done(const ColorProfileState* state)
+{
+  return state->alpha_done && state->numcolors_done && state->colored_done && state->bits_done;
+}
+
+static void color_profile_set_colored(LodePNGColorProfile* profile, ColorProfileState* state)
+{
+  profile->colored = 1;
+  state->colored_done = 1;
+  if(profile->bits < 8) profile->bits = 8; /*PNG has no colored modes with less than 8-bit per channel*/
+}
+
+static void color_profile_add_bits(LodePNGColorProfile* profile, ColorProfileState* state,
+                                   unsigned char r, unsigned bitdepth)
+{
+  /*only r is checked, < 8 bits is only relevant for greyscale*/
+  unsigned bits = getValueRequiredBits(r);
+  if(bits > profile->bits) profile->bits = bits;
+  state->bits_done = (profile->bits >= bitdepth);
+}
+
+static void color_profile_add_alpha(LodePNGColorProfile* profile, ColorProfileState* state,
+                                    unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+{
+  unsigned matchkey = (r == profile->key_r && g == profile->key_g && b == profile->key_b);
+  if(a != 255 && (a != 0 || (profile->key && !matchkey)))
+  {
+    profile->alpha = 1;
+    state->alpha_done = 1;
+    if(profile->bits < 8) profile->bits = 8; /*PNG has no alphachannel modes with less than 8-bit per channel*/
+  }
+  else if(a == 0 && !profile->alpha && !profile->key)
+  {
+    profile->key = 1;
+    profile->key_r = r;
+    profile->key_g = g;
+    profile->key_b = b;
+  }
+  else if(a == 255 && profile->key && matchkey)
+  {
+    /* Color key cannot be used if an opaque pixel also has that RGB color. */
+    profile->alpha = 1;
+    state->alpha_done = 1;
+    if(profile->bits < 8) profile->bits = 8; /*PNG has no alphachannel modes with less than 8-bit per channel*/
+  }
+}
+
+static void color_profile_add_color(LodePNGColorProfile* profile, ColorProfileState* state,
+                                    unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+{
+  if(!color_tree_has(&state->tree, r, g, b, a))
+  {
+    color_tree_add(&state->tree, r, g, b, a, profile->numcolors);
+    if(profile->numcolors < 256)
+    {
+      unsigned char* p = profile->palette;
+      unsigned n = profile->numcolors;
+      p[n * 4 + 0] = r;
+      p[n * 4 + 1] = g;
+      p[n * 4 + 2] = b;
+      p[n * 4 + 3] = a;
+    }
+    profile->numcolors++;
+    state->numcolors_done = profile->numcolors >= state->maxnumcolors;
+  }
+}
+
+/*amount of pixels per step of the 8-bit RGB/RGBA profile scan*/
+#define PROFILE_CHUNK_SIZE 256
+
+/*
+Scan the pixels [begin, end) of an image with at most 8 bits per channel into
+the profile, stops once the state is done. 8-bit RGB and RGBA are read directly
+in chunks: each property is checked for the whole chunk in its own loop, the
+greyscale and opaque tests are branchless reductions that the compiler can
+vectorize, and a color equal to the previous pixel skips the color tree.
+*/
+static void color_profile_scan8(LodePNGColorProfile* profile, ColorProfileState* state,
+                                const unsigned char* in, size_t begin, size_t end,
+                                const LodePNGColorMode* mode)
+{
+  size_t i;
+  if(mode->bitdepth == 8 && (mode->colortype == LCT_RGBA || (mode->colortype == LCT_RGB && !mode->key_defined)))
+  {
+    size_t chunk;
+    size_t channels = mode->colortype == LCT_RGBA ? 4 : 3;
+    for(chunk = begin; chunk < end && !color_profile_state_done(state); chunk += PROFILE_CHUNK_SIZE)
+    {
+      size_t chunkend = end - chunk < PROFILE_CHUNK_SIZE ? end : chunk + PROFILE_CHUNK_SIZE;
+      const unsigned char* p = &in[chunk * channels];
+      const unsigned char* pend = &in[chunkend * channels];
+
+      if(!state->colored_done)
+      {
+        unsigned diff = 0;
+        for(; p != pend; p += channels) diff |= (unsigned)(p[0] ^ p[1]) | (unsigned)(p[0] ^ p[2]);
+        if(diff) color_profile_set_colored(profile, state);
+      }
+
+      if(!state->bits_done)
+      {
+        for(i = chunk; i < chunkend && !state->bits_done; i++)
+        {
+          color_profile_add_bits(profile, state, in[i * channels], 8);
+        }
+      }
+
+      if(!state->alpha_done) /*only possible for RGBA here*/
+      {
+        unsigned opaque = 255;
+        for(p = &in[chunk * 4]; p != pend; p += 4) opaque &= p[3];
+        /*a run of opaque pixels changes nothing, unless they may match the color key*/
+        if(opaque != 255 || profile->key)
+        {
+          for(i = chunk; i < chunkend && !state->alpha_done; i++)
+          {
+            p = &in[i * 4];
+            color_profile_add_alpha(profile, state, p[0], p[1], p[2], p[3]);
+          }
+        }
+      }
+
+      if(!state->numcolors_done)
+      {
+        for(i = chunk; i < chunkend && !state->numcolors_done; i++)
+        {
+          p = &in[i * channels];
+          if(i != chunk && p[0] == p[0 - channels] && p[1] == p[1 - channels] && p[2] == p[2 - channels]
+             && (channels == 3 || p[3] == p[3 - channels])) continue; /*same color as the previous pixel*/
+          color_profile_add_color(profile, state, p[0], p[1], p[2], channels == 4 ? p[3] : 255);
+        }
+      }
+    }
+  }
+  else
+  {
+    for(i = begin; i < end; i++)
+    {
+      unsigned char r = 0, g = 0, b = 0, a = 0;
+      getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode);
+
+      /*bits are compared with the bits per channel: bpp would never be reached for RGB*/
+      if(!state->bits_done && profile->bits < 8) color_profile_add_bits(profile, state, r, mode->bitdepth);
+      else state->bits_done = (profile->bits >= mode->bitdepth);
+
+      if(!state->colored_done && (r != g || r != b)) color_profile_set_colored(profile, state);
+
+      if(!state->alpha_done) color_profile_add_alpha(profile, state, r, g, b, a);
+
+      if(!state->numcolors_done) color_profile_add_color(profile, state, r, g, b, a);
+
+      if(color_profile_state_done(state)) break;
+    }
+  }
+}
+
+/*get_color_profile, skipping the alpha scan if opaque*/
+static unsigned color_profile(LodePNGColorProfile* profile,
+                              const unsigned char* in, unsigned w, unsigned h,
+                              const LodePNGColorMode* mode, unsigned opaque)
+{
+  unsigned error = 0;
+  size_t i;
+  ColorProfileState state;
+  size_t numpixels = (size_t)w * h;
   unsigned sixteen = 0;
-  if(bpp <= 8) maxnumcolors = bpp == 1 ? 2 : (bpp == 2 ? 4 : (bpp == 4 ? 16 : 256));
 
-  color_tree_init(&tree);
+  color_profile_state_init(&state, mode, opaque);
 
   /*Check if the 16-bit input is truly 16-bit*/
   if(mode->bitdepth == 16)
@@ -3543,25 +4822,25 @@ unsigned get_color_profile(LodePNGColorProfile* profile,
   {
     unsigned short r = 0, g = 0, b = 0, a = 0;
     profile->bits = 16;
-    bits_done = numcolors_done = 1; /*counting colors no longer useful, palette doesn't support 16-bit*/
+    state.bits_done = state.numcolors_done = 1; /*counting colors no longer useful, palette doesn't support 16-bit*/
 
     for(i = 0; i < numpixels; i++)
     {
       getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode);
       
-      if(!colored_done && (r != g || r != b))
+      if(!state.colored_done && (r != g || r != b))
       {
         profile->colored = 1;
-        colored_done = 1;
+        state.colored_done = 1;
       }
 
-      if(!alpha_done)
+      if(!state.alpha_done)
       {
         unsigned matchkey = (r == profile->key_r && g == profile->key_g && b == profile->key_b);
         if(a != 65535 && (a != 0 || (profile->key && !matchkey)))
         {
           profile->alpha = 1;
-          alpha_done = 1;
+          state.alpha_done = 1;
           if(profile->bits < 8) profile->bits = 8; /*PNG has no alphachannel modes with less than 8-bit per channel*/
         }
         else if(a == 0 && !profile->alpha && !profile->key)
@@ -3575,81 +4854,16 @@ unsigned get_color_profile(LodePNGColorProfile* profile,
         {
           /* Color key cannot be used if an opaque pixel also has that RGB color. */
           profile->alpha = 1;
-          alpha_done = 1;
+          state.alpha_done = 1;
         }
       }
 
-      if(alpha_done && numcolors_done && colored_done && bits_done) break;
+      if(color_profile_state_done(&state)) break;
     }
   }
   else /* < 16-bit */
   {
-    for(i = 0; i < numpixels; i++)
-    {
-      unsigned char r = 0, g = 0, b = 0, a = 0;
-      getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode);
-
-      if(!bits_done && profile->bits < 8)
-      {
-        /*only r is checked, < 8 bits is only relevant for greyscale*/
-        unsigned bits = getValueRequiredBits(r);
-        if(bits > profile->bits) profile->bits = bits;
-      }
-      bits_done = (profile->bits >= bpp);
-
-      if(!colored_done && (r != g || r != b))
-      {
-        profile->colored = 1;
-        colored_done = 1;
-        if(profile->bits < 8) profile->bits = 8; /*PNG has no colored modes with less than 8-bit per channel*/
-      }
-
-      if(!alpha_done)
-      {
-        unsigned matchkey = (r == profile->key_r && g == profile->key_g && b == profile->key_b);
-        if(a != 255 && (a != 0 || (profile->key && !matchkey)))
-        {
-          profile->alpha = 1;
-          alpha_done = 1;
-          if(profile->bits < 8) profile->bits = 8; /*PNG has no alphachannel modes with less than 8-bit per channel*/
-        }
-        else if(a == 0 && !profile->alpha && !profile->key)
-        {
-          profile->key = 1;
-          profile->key_r = r;
-          profile->key_g = g;
-          profile->key_b = b;
-        }
-        else if(a == 255 && profile->key && matchkey)
-        {
-          /* Color key cannot be used if an opaque pixel also has that RGB color. */
-          profile->alpha = 1;
-          alpha_done = 1;
-          if(profile->bits < 8) profile->bits = 8; /*PNG has no alphachannel modes with less than 8-bit per channel*/
-        }
-      }
-
-      if(!numcolors_done)
-      {
-        if(!color_tree_has(&tree, r, g, b, a))
-        {
-          color_tree_add(&tree, r, g, b, a, profile->numcolors);
-          if(profile->numcolors < 256)
-          {
-            unsigned char* p = profile->palette;
-            unsigned n = profile->numcolors;
-            p[n * 4 + 0] = r;
-            p[n * 4 + 1] = g;
-            p[n * 4 + 2] = b;
-            p[n * 4 + 3] = a;
-          }
-          profile->numcolors++;
-          numcolors_done = profile->numcolors >= maxnumcolors;
-        }
-      }
-
-      if(alpha_done && numcolors_done && colored_done && bits_done) break;
-    }
+    color_profile_scan8(profile, &state, in, 0, numpixels, mode);
 
     /*make the profile's key always 16-bit for consistency - repeat each byte twice*/
     profile->key_r *= 257;
@@ -3657,25 +4871,94 @@ unsigned get_color_profile(LodePNGColorProfile* profile,
     profile->key_b *= 257;
   }
 
-  color_tree_cleanup(&tree);
+  color_tree_cleanup(&state.tree);
   return error;
 }
 
+/*profile must already have been inited with mode.
+It's ok to set some parameters of profile to done already.*/
+unsigned get_color_profile(LodePNGColorProfile* profile,
+                           const unsigned char* in, unsigned w, unsigned h,
+                           const LodePNGColorMode* mode)
+{
+  return color_profile(profile, in, w, h, mode, 0);
+}
+
+/*the sample of get_color_profile_sampled: this many runs of PROFILE_SAMPLE_RUN pixels spread over the image*/
+#define PROFILE_SAMPLE_RUNS 256
+#define PROFILE_SAMPLE_RUN 64
+
+/*
+Same result as get_color_profile, in two phases. First only a sample of pixels
+spread over the image is scanned. Since colors, alpha and bits can only be added,
+the sample proves the answer if it already shows that the image is colored,
+needs more than 256 colors (so no palette) and has nothing left to find for alpha
+and bits: typical for photographs, which are then done after a fraction of the
+pixels. Otherwise the exhaustive scan is done as usual. An RGBA image is only
+proven this way if the caller declares it opaque, since opaque pixels never
+finish the alpha check.
+*/
+static unsigned color_profile_sampled(LodePNGColorProfile* profile,
+                                      const unsigned char* in, unsigned w, unsigned h,
+                                      const LodePNGColorMode* mode, unsigned opaque)
+{
+  size_t numpixels = (size_t)w * h;
+  size_t run;
+  unsigned proven;
+  LodePNGColorProfile sample;
+  ColorProfileState state;
+
+  /*not worth it for small images, and 16-bit images need their full 16-bit check anyway*/
+  if(mode->bitdepth == 16 || numpixels < 4 * PROFILE_SAMPLE_RUNS * PROFILE_SAMPLE_RUN)
+  {
+    return color_profile(profile, in, w, h, mode, opaque);
+  }
+
+  sample = *profile;
+  color_profile_state_init(&state, mode, opaque);
+  for(run = 0; run < PROFILE_SAMPLE_RUNS && !color_profile_state_done(&state); run++)
+  {
+    size_t begin = run * (numpixels / PROFILE_SAMPLE_RUNS);
+    color_profile_scan8(&sample, &state, in, begin, begin + PROFILE_SAMPLE_RUN, mode);
+  }
+  proven = color_profile_state_done(&state) && sample.numcolors > 256;
+  color_tree_cleanup(&state.tree);
+
+  if(!proven) return color_profile(profile, in, w, h, mode, opaque);
+
+  *profile = sample;
+  /*make the profile's key always 16-bit for consistency - repeat each byte twice*/
+  profile->key_r *= 257;
+  profile->key_g *= 257;
+  profile->key_b *= 257;
+  return 0;
+}
+
+unsigned get_color_profile_sampled(LodePNGColorProfile* profile,
+                                   const unsigned char* in, unsigned w, unsigned h,
+                                   const LodePNGColorMode* mode)
+{
+  return color_profile_sampled(profile, in, w, h, mode, 0);
+}
+
 /*Automatically chooses color type that gives smallest amount of bits in the
 output image, e.g. grey if there are only greyscale pixels, palette if there
 are less than 256 colors, ...
 Updates values of mode with a potentially smaller color model. mode_out should
-contain the user chosen color model, but will be overwritten with the new chosen one.*/
-unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out,
-                                   const unsigned char* image, unsigned w, unsigned h,
-                                   const LodePNGColorMode* mode_in)
+contain the user chosen color model, but will be overwritten with the new chosen one.
+If sampled, the profile comes from get_color_profile_sampled. If opaque, the
+alpha of the pixels is not looked at.*/
+static unsigned auto_choose_color(LodePNGColorMode* mode_out,
+                                  const unsigned char* image, unsigned w, unsigned h,
+                                  const LodePNGColorMode* mode_in, unsigned sampled, unsigned opaque)
 {
   LodePNGColorProfile prof;
   unsigned error = 0;
   unsigned i, n, palettebits, grey_ok, palette_ok;
 
   lodepng_color_profile_init(&prof);
-  error = get_color_profile(&prof, image, w, h, mode_in);
+  if(sampled) error = color_profile_sampled(&prof, image, w, h, mode_in, opaque);
+  else error = color_profile(&prof, image, w, h, mode_in, opaque);
   if(error) return error;
   mode_out->key_defined = 0;
 
@@ -3727,6 +5010,13 @@ unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out,
   return error;
 }
 
+unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out,
+                                   const unsigned char* image, unsigned w, unsigned h,
+                                   const LodePNGColorMode* mode_in)
+{
+  return auto_choose_color(mode_out, image, w, h, mode_in, 0, 0);
+}
+
 #endif /* #ifdef LODEPNG_COMPILE_ENCODER */
 
 /*
@@ -4832,7 +6122,7 @@ static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info)
 }
 
 static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
-                              LodePNGCompressSettings* zlibsettings)
+                              const LodePNGCompressSettings* zlibsettings)
 {
   ucvector zlibdata;
   unsigned error = 0;
@@ -4872,7 +6162,7 @@ static unsigned addChunk_tEXt(ucvector* out, const char* keyword, const char* te
 }
 
 static unsigned addChunk_zTXt(ucvector* out, const char* keyword, const char* textstring,
-                              LodePNGCompressSettings* zlibsettings)
+                              const LodePNGCompressSettings* zlibsettings)
 {
   unsigned error = 0;
   ucvector data, compressed;
@@ -4899,7 +6189,7 @@ static unsigned addChunk_zTXt(ucvector* out, const char* keyword, const char* te
 }
 
 static unsigned addChunk_iTXt(ucvector* out, unsigned compressed, const char* keyword, const char* langtag,
-                              const char* transkey, const char* textstring, LodePNGCompressSettings* zlibsettings)
+                              const char* transkey, const char* textstring, const LodePNGCompressSettings* zlibsettings)
 {
   unsigned error = 0;
   ucvector data;
@@ -5077,24 +6367,29 @@ static float flog2(float f)
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+/*Filters an image one scanline at a time, choosing the filter type of each scanline
+with the filter strategy of the encoder settings.*/
+typedef struct ScanlineFilter
 {
-  /*
-  For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
-  the scanlines with 1 extra byte per scanline
-  */
+  LodePNGFilterStrategy strategy;
+  size_t linebytes; /*the width of a scanline in bytes, not including the filter type*/
+  size_t bytewidth; /*used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  const unsigned char* predefined_filters; /*for LFS_PREDEFINED*/
+  LodePNGCompressSettings zlibsettings; /*for LFS_BRUTE_FORCE*/
+  ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
+} ScanlineFilter;
 
+static unsigned scanline_filter_init(ScanlineFilter* filter, unsigned w,
+                                     const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+{
   unsigned bpp = lodepng_get_bpp(info);
-  /*the width of a scanline in bytes, not including the filter type*/
-  size_t linebytes = (w * bpp + 7) / 8;
-  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
-  unsigned x, y;
-  unsigned error = 0;
-  LodePNGFilterStrategy strategy = settings->filter_strategy;
+  unsigned type;
+
+  filter->linebytes = ((size_t)w * bpp + 7) / 8;
+  filter->bytewidth = (bpp + 7) / 8;
+  filter->strategy = settings->filter_strategy;
+  filter->predefined_filters = settings->predefined_filters;
+  for(type = 0; type < 5; type++) ucvector_init(&filter->attempt[type]);
 
   /*
   There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
@@ -5110,190 +6405,191 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   heuristic is used.
   */
   if(settings->filter_palette_zero &&
-     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) strategy = LFS_ZERO;
+     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) filter->strategy = LFS_ZERO;
 
   if(bpp == 0) return 31; /*error: invalid color type*/
 
-  if(strategy == LFS_ZERO)
+  if(filter->strategy == LFS_BRUTE_FORCE)
   {
-    for(y = 0; y < h; y++)
-    {
-      size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
-      size_t inindex = linebytes * y;
-      out[outindex] = 0; /*filter type byte*/
-      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, 0);
-      prevline = &in[inindex];
-    }
+    filter->zlibsettings = settings->zlibsettings;
+    /*use fixed tree on the attempts so that the tree is not adapted to the filtertype on purpose,
+    to simulate the true case where the tree is the same for the whole image. Sometimes it gives
+    better result with dynamic tree anyway. Using the fixed tree sometimes gives worse, but in rare
+    cases better compression. It does make this a bit less slow, so it's worth doing this.*/
+    filter->zlibsettings.btype = 1;
+    /*a custom encoder likely doesn't read the btype setting and is optimized for complete PNG
+    images only, so disable it*/
+    filter->zlibsettings.custom_zlib = 0;
+    filter->zlibsettings.custom_deflate = 0;
   }
-  else if(strategy == LFS_MINSUM)
-  {
-    /*adaptive filtering*/
-    size_t sum[5];
-    ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
-    size_t smallest = 0;
-    unsigned char type, bestType = 0;
 
+  if(filter->strategy == LFS_MINSUM || filter->strategy == LFS_ENTROPY || filter->strategy == LFS_BRUTE_FORCE)
+  {
     for(type = 0; type < 5; type++)
     {
-      ucvector_init(&attempt[type]);
-      if(!ucvector_resize(&attempt[type], linebytes)) return 83; /*alloc fail*/
+      if(!ucvector_resize(&filter->attempt[type], filter->linebytes)) return 83; /*alloc fail*/
     }
+  }
+  else if(filter->strategy != LFS_ZERO && filter->strategy != LFS_PREDEFINED)
+  {
+    return 88; /* unknown filter strategy */
+  }
 
-    if(!error)
-    {
-      for(y = 0; y < h; y++)
-      {
-        /*try the 5 filter types*/
-        for(type = 0; type < 5; type++)
-        {
-          filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          sum[type] = 0;
-          if(type == 0)
-          {
-            for(x = 0; x < linebytes; x++) sum[type] += (unsigned char)(attempt[type].data[x]);
-          }
-          else
-          {
-            for(x = 0; x < linebytes; x++)
-            {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type].data[x];
-              sum[type] += s < 128 ? s : (255U - s);
-            }
-          }
-
-          /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum[type] < smallest)
-          {
-            bestType = type;
-            smallest = sum[type];
-          }
-        }
+  return 0;
+}
 
-        prevline = &in[y * linebytes];
+static void scanline_filter_cleanup(ScanlineFilter* filter)
+{
+  unsigned type;
+  for(type = 0; type < 5; type++) ucvector_cleanup(&filter->attempt[type]);
+}
 
-        /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x < linebytes; x++) out[y * (linebytes + 1) + 1 + x] = attempt[bestType].data[x];
-      }
-    }
+/*
+Filters scanline y of the image into out, which gets the filter type byte followed by
+linebytes filtered bytes. prevline is the unfiltered previous scanline, or 0 for the first.
+*/
+static void scanline_filter_apply(ScanlineFilter* filter, unsigned char* out, const unsigned char* scanline,
+                                  const unsigned char* prevline, unsigned y)
+{
+  size_t linebytes = filter->linebytes;
+  size_t bytewidth = filter->bytewidth;
+  size_t x;
+  unsigned char type, bestType = 0;
 
-    for(type = 0; type < 5; type++) ucvector_cleanup(&attempt[type]);
+  if(filter->strategy == LFS_ZERO || filter->strategy == LFS_PREDEFINED)
+  {
+    type = filter->strategy == LFS_ZERO ? 0 : filter->predefined_filters[y];
+    out[0] = type; /*filter type byte*/
+    filterScanline(&out[1], scanline, prevline, linebytes, bytewidth, type);
+    return;
   }
-  else if(strategy == LFS_ENTROPY)
+
+  if(filter->strategy == LFS_MINSUM)
   {
-    float sum[5];
-    ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
-    float smallest = 0;
-    unsigned type, bestType = 0;
-    unsigned count[256];
+    /*adaptive filtering*/
+    size_t sum[5];
+    size_t smallest = 0;
 
+    /*try the 5 filter types*/
     for(type = 0; type < 5; type++)
     {
-      ucvector_init(&attempt[type]);
-      if(!ucvector_resize(&attempt[type], linebytes)) return 83; /*alloc fail*/
-    }
+      const unsigned char* attempt = filter->attempt[type].data;
+      filterScanline(filter->attempt[type].data, scanline, prevline, linebytes, bytewidth, type);
 
-    for(y = 0; y < h; y++)
-    {
-      /*try the 5 filter types*/
-      for(type = 0; type < 5; type++)
+      /*calculate the sum of the result*/
+      sum[type] = 0;
+      if(type == 0)
       {
-        filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
-        for(x = 0; x < 256; x++) count[x] = 0;
-        for(x = 0; x < linebytes; x++) count[attempt[type].data[x]]++;
-        count[type]++; /*the filter type itself is part of the scanline*/
-        sum[type] = 0;
-        for(x = 0; x < 256; x++)
-        {
-          float p = count[x] / (float)(linebytes + 1);
-          sum[type] += count[x] == 0 ? 0 : flog2(1 / p) * p;
-        }
-        /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-        if(type == 0 || sum[type] < smallest)
+        for(x = 0; x < linebytes; x++) sum[type] += (unsigned char)(attempt[x]);
+      }
+      else
+      {
+        for(x = 0; x < linebytes; x++)
         {
-          bestType = type;
-          smallest = sum[type];
+          /*For differences, each byte should be treated as signed, values above 127 are negative
+          (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
+          This means filtertype 0 is almost never chosen, but that is justified.*/
+          unsigned char s = attempt[x];
+          sum[type] += s < 128 ? s : (255U - s);
         }
       }
 
-      prevline = &in[y * linebytes];
-
-      /*now fill the out values*/
-      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      for(x = 0; x < linebytes; x++) out[y * (linebytes + 1) + 1 + x] = attempt[bestType].data[x];
+      /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
+      if(type == 0 || sum[type] < smallest)
+      {
+        bestType = type;
+        smallest = sum[type];
+      }
     }
-
-    for(type = 0; type < 5; type++) ucvector_cleanup(&attempt[type]);
   }
-  else if(strategy == LFS_PREDEFINED)
+  else if(filter->strategy == LFS_ENTROPY)
   {
-    for(y = 0; y < h; y++)
+    float sum[5];
+    float smallest = 0;
+    unsigned count[256];
+
+    /*try the 5 filter types*/
+    for(type = 0; type < 5; type++)
     {
-      size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
-      size_t inindex = linebytes * y;
-      unsigned char type = settings->predefined_filters[y];
-      out[outindex] = type; /*filter type byte*/
-      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type);
-      prevline = &in[inindex];
+      const unsigned char* attempt = filter->attempt[type].data;
+      filterScanline(filter->attempt[type].data, scanline, prevline, linebytes, bytewidth, type);
+      for(x = 0; x < 256; x++) count[x] = 0;
+      for(x = 0; x < linebytes; x++) count[attempt[x]]++;
+      count[type]++; /*the filter type itself is part of the scanline*/
+      sum[type] = 0;
+      for(x = 0; x < 256; x++)
+      {
+        float p = count[x] / (float)(linebytes + 1);
+        sum[type] += count[x] == 0 ? 0 : flog2(1 / p) * p;
+      }
+      /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
+      if(type == 0 || sum[type] < smallest)
+      {
+        bestType = type;
+        smallest = sum[type];
+      }
     }
   }
-  else if(strategy == LFS_BRUTE_FORCE)
+  else /*LFS_BRUTE_FORCE*/
   {
     /*brute force filter chooser.
     deflate the scanline after every filter attempt to see which one deflates best.
     This is very slow and gives only slightly smaller, sometimes even larger, result*/
     size_t size[5];
-    ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t smallest = 0;
-    unsigned type = 0, bestType = 0;
     unsigned char* dummy;
-    LodePNGCompressSettings zlibsettings = settings->zlibsettings;
-    /*use fixed tree on the attempts so that the tree is not adapted to the filtertype on purpose,
-    to simulate the true case where the tree is the same for the whole image. Sometimes it gives
-    better result with dynamic tree anyway. Using the fixed tree sometimes gives worse, but in rare
-    cases better compression. It does make this a bit less slow, so it's worth doing this.*/
-    zlibsettings.btype = 1;
-    /*a custom encoder likely doesn't read the btype setting and is optimized for complete PNG
-    images only, so disable it*/
-    zlibsettings.custom_zlib = 0;
-    zlibsettings.custom_deflate = 0;
+
+    /*try the 5 filter types*/
     for(type = 0; type < 5; type++)
     {
-      ucvector_init(&attempt[type]);
-      ucvector_resize(&attempt[type], linebytes); /*todo: give error if resize failed*/
-    }
-    for(y = 0; y < h; y++) /*try the 5 filter types*/
-    {
-      for(type = 0; type < 5; type++)
+      size_t testsize = filter->attempt[type].size;
+      /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
+
+      filterScanline(filter->attempt[type].data, scanline, prevline, linebytes, bytewidth, type);
+      size[type] = 0;
+      dummy = 0;
+      zlib_compress(&dummy, &size[type], filter->attempt[type].data, testsize, &filter->zlibsettings);
+      lodepng_free(dummy);
+      /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
+      if(type == 0 || size[type] < smallest)
       {
-        unsigned testsize = attempt[type].size;
-        /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
-
-        filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
-        size[type] = 0;
-        dummy = 0;
-        zlib_compress(&dummy, &size[type], attempt[type].data, testsize, &zlibsettings);
-        lodepng_free(dummy);
-        /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
-        if(type == 0 || size[type] < smallest)
-        {
-          bestType = type;
-          smallest = size[type];
-        }
+        bestType = type;
+        smallest = size[type];
       }
+    }
+  }
+
+  /*now fill the out values*/
+  out[0] = bestType; /*the first byte of a scanline will be the filter type*/
+  for(x = 0; x < linebytes; x++) out[1 + x] = filter->attempt[bestType].data[x];
+}
+
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+{
+  /*
+  For PNG filter method 0
+  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
+  the scanlines with 1 extra byte per scanline
+  */
+
+  ScanlineFilter scanlinefilter;
+  const unsigned char* prevline = 0;
+  unsigned y;
+  unsigned error = scanline_filter_init(&scanlinefilter, w, info, settings);
+
+  if(!error)
+  {
+    size_t linebytes = scanlinefilter.linebytes;
+    for(y = 0; y < h; y++)
+    {
+      /*the extra filterbyte added to each row*/
+      scanline_filter_apply(&scanlinefilter, &out[y * (linebytes + 1)], &in[y * linebytes], prevline, y);
       prevline = &in[y * linebytes];
-      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      for(x = 0; x < linebytes; x++) out[y * (linebytes + 1) + 1 + x] = attempt[bestType].data[x];
     }
-    for(type = 0; type < 5; type++) ucvector_cleanup(&attempt[type]);
   }
-  else return 88; /* unknown filter strategy */
 
+  scanline_filter_cleanup(&scanlinefilter);
   return error;
 }
 
@@ -5508,6 +6804,143 @@ static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t data
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+/*writes the signature and all chunks that come before the IDAT chunks*/
+static unsigned addChunksBeforeIDAT(ucvector* out, unsigned w, unsigned h,
+                                    const LodePNGInfo* info, const LodePNGEncoderSettings* settings)
+{
+  unsigned error = 0;
+  writeSignature(out);
+  /*IHDR*/
+  addChunk_IHDR(out, w, h, info->color.colortype, info->color.bitdepth, info->interlace_method);
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*unknown chunks between IHDR and PLTE*/
+  if(info->unknown_chunks_data[0])
+  {
+    error = addUnknownChunks(out, info->unknown_chunks_data[0], info->unknown_chunks_size[0]);
+    if(error) return error;
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  /*PLTE*/
+  if(info->color.colortype == LCT_PALETTE)
+  {
+    addChunk_PLTE(out, &info->color);
+  }
+  if(settings->force_palette && (info->color.colortype == LCT_RGB || info->color.colortype == LCT_RGBA))
+  {
+    addChunk_PLTE(out, &info->color);
+  }
+  /*tRNS*/
+  if(info->color.colortype == LCT_PALETTE && getPaletteTranslucency(info->color.palette, info->color.palettesize) != 0)
+  {
+    addChunk_tRNS(out, &info->color);
+  }
+  if((info->color.colortype == LCT_GREY || info->color.colortype == LCT_RGB) && info->color.key_defined)
+  {
+    addChunk_tRNS(out, &info->color);
+  }
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*bKGD (must come between PLTE and the IDAt chunks*/
+  if(info->background_defined) addChunk_bKGD(out, info);
+  /*pHYs (must come before the IDAT chunks)*/
+  if(info->phys_defined) addChunk_pHYs(out, info);
+
+  /*unknown chunks between PLTE and IDAT*/
+  if(info->unknown_chunks_data[1])
+  {
+    error = addUnknownChunks(out, info->unknown_chunks_data[1], info->unknown_chunks_size[1]);
+    if(error) return error;
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return error;
+}
+
+/*writes all chunks that come after the IDAT chunks, up to and including IEND*/
+static unsigned addChunksAfterIDAT(ucvector* out, const LodePNGInfo* info, const LodePNGEncoderSettings* settings)
+{
+  unsigned error = 0;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  size_t i;
+  /*tIME*/
+  if(info->time_defined) addChunk_tIME(out, &info->time);
+  /*tEXt and/or zTXt*/
+  for(i = 0; i < info->text_num; i++)
+  {
+    if(strlen(info->text_keys[i]) > 79)
+    {
+      error = 66; /*text chunk too large*/
+      break;
+    }
+    if(strlen(info->text_keys[i]) < 1)
+    {
+      error = 67; /*text chunk too small*/
+      break;
+    }
+    if(settings->text_compression)
+    {
+      addChunk_zTXt(out, info->text_keys[i], info->text_strings[i], &settings->zlibsettings);
+    }
+    else
+    {
+      addChunk_tEXt(out, info->text_keys[i], info->text_strings[i]);
+    }
+  }
+  /*LodePNG version id in text chunk*/
+  if(settings->add_id)
+  {
+    unsigned alread_added_id_text = 0;
+    for(i = 0; i < info->text_num; i++)
+    {
+      if(!strcmp(info->text_keys[i], "LodePNG"))
+      {
+        alread_added_id_text = 1;
+        break;
+      }
+    }
+    if(alread_added_id_text == 0)
+    {
+      addChunk_tEXt(out, "LodePNG", VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
+    }
+  }
+  /*iTXt*/
+  for(i = 0; i < info->itext_num; i++)
+  {
+    if(strlen(info->itext_keys[i]) > 79)
+    {
+      error = 66; /*text chunk too large*/
+      break;
+    }
+    if(strlen(info->itext_keys[i]) < 1)
+    {
+      error = 67; /*text chunk too small*/
+      break;
+    }
+    addChunk_iTXt(out, settings->text_compression,
+                  info->itext_keys[i], info->itext_langtags[i], info->itext_transkeys[i], info->itext_strings[i],
+                  &settings->zlibsettings);
+  }
+
+  /*unknown chunks between IDAT and IEND*/
+  if(info->unknown_chunks_data[2])
+  {
+    error = addUnknownChunks(out, info->unknown_chunks_data[2], info->unknown_chunks_size[2]);
+    if(error) return error;
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  addChunk_IEND(out);
+  return error;
+}
+
+/*the scanline stride for LCL_RLE, if not set by the user*/
+static void setScanlineStride(LodePNGCompressSettings* zlibsettings, unsigned w, const LodePNGInfo* info)
+{
+  if(zlibsettings->stride == 0 && info->interlace_method == 0)
+  {
+    /*filtered scanline length including the filter type byte, so LCL_RLE can copy from the row above*/
+    size_t linebytes = 1 + ((size_t)w * lodepng_get_bpp(&info->color) + 7) / 8;
+    if(linebytes <= 32768) zlibsettings->stride = (unsigned)linebytes;
+  }
+}
+
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state)
@@ -5516,6 +6949,7 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   ucvector outv;
   unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
   size_t datasize = 0;
+  LodePNGCompressSettings zlibsettings; /*IDAT compression settings, with the scanline stride filled in*/
 
   /*provide some proper output values if error will happen*/
   *out = 0;
@@ -5534,7 +6968,8 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
 
   if(state->encoder.auto_convert)
   {
-    state->error = lodepng_auto_choose_color(&info.color, image, w, h, &state->info_raw);
+    state->error = auto_choose_color(&info.color, image, w, h, &state->info_raw,
+                                     state->encoder.sample_profile, state->encoder.opaque);
   }
   if(state->error) return state->error;
 
@@ -5571,123 +7006,14 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   ucvector_init(&outv);
   while(!state->error) /*while only executed once, to break on error*/
   {
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    size_t i;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*write signature and chunks*/
-    writeSignature(&outv);
-    /*IHDR*/
-    addChunk_IHDR(&outv, w, h, info.color.colortype, info.color.bitdepth, info.interlace_method);
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*unknown chunks between IHDR and PLTE*/
-    if(info.unknown_chunks_data[0])
-    {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[0], info.unknown_chunks_size[0]);
-      if(state->error) break;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*PLTE*/
-    if(info.color.colortype == LCT_PALETTE)
-    {
-      addChunk_PLTE(&outv, &info.color);
-    }
-    if(state->encoder.force_palette && (info.color.colortype == LCT_RGB || info.color.colortype == LCT_RGBA))
-    {
-      addChunk_PLTE(&outv, &info.color);
-    }
-    /*tRNS*/
-    if(info.color.colortype == LCT_PALETTE && getPaletteTranslucency(info.color.palette, info.color.palettesize) != 0)
-    {
-      addChunk_tRNS(&outv, &info.color);
-    }
-    if((info.color.colortype == LCT_GREY || info.color.colortype == LCT_RGB) && info.color.key_defined)
-    {
-      addChunk_tRNS(&outv, &info.color);
-    }
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*bKGD (must come between PLTE and the IDAt chunks*/
-    if(info.background_defined) addChunk_bKGD(&outv, &info);
-    /*pHYs (must come before the IDAT chunks)*/
-    if(info.phys_defined) addChunk_pHYs(&outv, &info);
-
-    /*unknown chunks between PLTE and IDAT*/
-    if(info.unknown_chunks_data[1])
-    {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[1], info.unknown_chunks_size[1]);
-      if(state->error) break;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+    state->error = addChunksBeforeIDAT(&outv, w, h, &info, &state->encoder);
+    if(state->error) break;
     /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+    zlibsettings = state->encoder.zlibsettings;
+    setScanlineStride(&zlibsettings, w, &info);
+    state->error = addChunk_IDAT(&outv, data, datasize, &zlibsettings);
     if(state->error) break;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*tIME*/
-    if(info.time_defined) addChunk_tIME(&outv, &info.time);
-    /*tEXt and/or zTXt*/
-    for(i = 0; i < info.text_num; i++)
-    {
-      if(strlen(info.text_keys[i]) > 79)
-      {
-        state->error = 66; /*text chunk too large*/
-        break;
-      }
-      if(strlen(info.text_keys[i]) < 1)
-      {
-        state->error = 67; /*text chunk too small*/
-        break;
-      }
-      if(state->encoder.text_compression)
-      {
-        addChunk_zTXt(&outv, info.text_keys[i], info.text_strings[i], &state->encoder.zlibsettings);
-      }
-      else
-      {
-        addChunk_tEXt(&outv, info.text_keys[i], info.text_strings[i]);
-      }
-    }
-    /*LodePNG version id in text chunk*/
-    if(state->encoder.add_id)
-    {
-      unsigned alread_added_id_text = 0;
-      for(i = 0; i < info.text_num; i++)
-      {
-        if(!strcmp(info.text_keys[i], "LodePNG"))
-        {
-          alread_added_id_text = 1;
-          break;
-        }
-      }
-      if(alread_added_id_text == 0)
-      {
-        addChunk_tEXt(&outv, "LodePNG", VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
-      }
-    }
-    /*iTXt*/
-    for(i = 0; i < info.itext_num; i++)
-    {
-      if(strlen(info.itext_keys[i]) > 79)
-      {
-        state->error = 66; /*text chunk too large*/
-        break;
-      }
-      if(strlen(info.itext_keys[i]) < 1)
-      {
-        state->error = 67; /*text chunk too small*/
-        break;
-      }
-      addChunk_iTXt(&outv, state->encoder.text_compression,
-                    info.itext_keys[i], info.itext_langtags[i], info.itext_transkeys[i], info.itext_strings[i],
-                    &state->encoder.zlibsettings);
-    }
-
-    /*unknown chunks between IDAT and IEND*/
-    if(info.unknown_chunks_data[2])
-    {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[2], info.unknown_chunks_size[2]);
-      if(state->error) break;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    addChunk_IEND(&outv);
+    state->error = addChunksAfterIDAT(&outv, &info, &state->encoder);
 
     break; /*this isn't really a while loop; no error happened so break out now!*/
   }
@@ -5701,6 +7027,198 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   return state->error;
 }
 
+#ifdef LODEPNG_COMPILE_ZLIB
+
+/*size of the IDAT chunks the streaming encoder writes, only the last one can be smaller*/
+#define STREAM_IDAT_SIZE 65536
+
+struct LodePNGEncodeStream
+{
+  LodePNGInfo info; /*the PNG info, with the PNG color type*/
+  LodePNGColorMode info_raw; /*color type of the rows given by the user*/
+  LodePNGEncoderSettings settings;
+  unsigned w, h;
+  unsigned y; /*amount of rows given so far*/
+  ScanlineFilter filter;
+  unsigned char* row; /*the current row in the PNG color type, unfiltered*/
+  unsigned char* prevrow; /*the previous row in the PNG color type, unfiltered*/
+  unsigned char* filtered; /*the current row with filter type byte, as it goes into the zlib stream*/
+  unsigned char* predefined_filters; /*copy of the filter types of the settings for LFS_PREDEFINED, or 0*/
+  ZlibStream zlib;
+  LodePNGStreamWriteFunc write;
+  void* user;
+};
+
+/*writes the first size bytes of the zlib stream output in IDAT chunks of at most STREAM_IDAT_SIZE bytes*/
+static unsigned stream_write_IDAT(LodePNGEncodeStream* stream, size_t size)
+{
+  unsigned error = 0;
+  ucvector chunk;
+  ucvector* zlibdata = &stream->zlib.out;
+  size_t pos = 0;
+
+  ucvector_init(&chunk);
+  while(pos < size && !error)
+  {
+    size_t length = size - pos < STREAM_IDAT_SIZE ? size - pos : STREAM_IDAT_SIZE;
+    chunk.size = 0;
+    error = addChunk(&chunk, "IDAT", &zlibdata->data[pos], length);
+    if(!error) error = stream->write(chunk.data, chunk.size, stream->user);
+    pos += length;
+  }
+  ucvector_cleanup(&chunk);
+
+  memmove(zlibdata->data, &zlibdata->data[size], zlibdata->size - size);
+  zlibdata->size -= size;
+  return error;
+}
+
+static void stream_cleanup(LodePNGEncodeStream* stream)
+{
+  lodepng_info_cleanup(&stream->info);
+  lodepng_color_mode_cleanup(&stream->info_raw);
+  scanline_filter_cleanup(&stream->filter);
+  zlib_stream_cleanup(&stream->zlib);
+  lodepng_free(stream->row);
+  lodepng_free(stream->prevrow);
+  lodepng_free(stream->filtered);
+  lodepng_free(stream->predefined_filters);
+  lodepng_free(stream);
+}
+
+unsigned lodepng_encode_stream_begin(LodePNGEncodeStream** out, unsigned w, unsigned h, const LodePNGState* state,
+                                     LodePNGStreamWriteFunc write, void* user)
+{
+  LodePNGEncodeStream* stream;
+  LodePNGCompressSettings zlibsettings;
+  ucvector header;
+  size_t linebytes;
+  unsigned error = 0, zliberror;
+
+  *out = 0;
+
+  if((state->info_png.color.colortype == LCT_PALETTE || state->encoder.force_palette)
+      && (state->info_png.color.palettesize == 0 || state->info_png.color.palettesize > 256))
+  {
+    return 68; /*invalid palette size, it is only allowed to be 1-256*/
+  }
+  if(state->info_png.interlace_method > 1) return 71; /*error: unexisting interlace mode*/
+  if(state->info_png.interlace_method == 1) return 93; /*Adam7 needs the whole image*/
+  error = checkColorValidity(state->info_png.color.colortype, state->info_png.color.bitdepth);
+  if(error) return error; /*error: unexisting color type given*/
+  error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
+  if(error) return error; /*error: unexisting color type given*/
+
+  stream = (LodePNGEncodeStream*)lodepng_malloc(sizeof(LodePNGEncodeStream));
+  if(!stream) return 83; /*alloc fail*/
+
+  lodepng_info_init(&stream->info);
+  lodepng_color_mode_init(&stream->info_raw);
+  stream->settings = state->encoder;
+  stream->w = w;
+  stream->h = h;
+  stream->y = 0;
+  stream->predefined_filters = 0;
+  stream->write = write;
+  stream->user = user;
+
+  /*the filter and the zlib stream are both always set up, so that stream_cleanup is valid whatever fails*/
+  error = scanline_filter_init(&stream->filter, w, &state->info_png.color, &stream->settings);
+  linebytes = stream->filter.linebytes;
+  zlibsettings = state->encoder.zlibsettings;
+  setScanlineStride(&zlibsettings, w, &state->info_png);
+  zliberror = zlib_stream_init(&stream->zlib, &zlibsettings);
+  if(!error) error = zliberror;
+
+  stream->row = (unsigned char*)lodepng_malloc(linebytes);
+  stream->prevrow = (unsigned char*)lodepng_malloc(linebytes);
+  stream->filtered = (unsigned char*)lodepng_malloc(linebytes + 1);
+  if(!error && (!stream->row || !stream->prevrow || !stream->filtered)) error = 83; /*alloc fail*/
+
+  /*the state may be gone when the rows come, so the stream keeps its own filter types*/
+  if(!error && stream->filter.strategy == LFS_PREDEFINED)
+  {
+    stream->predefined_filters = (unsigned char*)lodepng_malloc(h ? h : 1);
+    if(!stream->predefined_filters) error = 83; /*alloc fail*/
+    else
+    {
+      if(h) memcpy(stream->predefined_filters, state->encoder.predefined_filters, h);
+      stream->filter.predefined_filters = stream->predefined_filters;
+      stream->settings.predefined_filters = stream->predefined_filters;
+    }
+  }
+
+  if(!error) error = lodepng_info_copy(&stream->info, &state->info_png);
+  if(!error) error = lodepng_color_mode_copy(&stream->info_raw, &state->info_raw);
+
+  ucvector_init(&header);
+  if(!error) error = addChunksBeforeIDAT(&header, w, h, &stream->info, &stream->settings);
+  if(!error) error = write(header.data, header.size, user);
+  ucvector_cleanup(&header);
+
+  if(error) stream_cleanup(stream);
+  else *out = stream;
+  return error;
+}
+
+unsigned lodepng_encode_stream_rows(LodePNGEncodeStream* stream, const unsigned char* rows, unsigned numrows)
+{
+  unsigned error = 0;
+  unsigned i;
+  size_t linebytes = stream->filter.linebytes;
+  size_t rawlinebytes = ((size_t)stream->w * lodepng_get_bpp(&stream->info_raw) + 7) / 8;
+  unsigned convert = !lodepng_color_mode_equal(&stream->info_raw, &stream->info.color);
+
+  if(numrows > stream->h - stream->y) return 95; /*more rows than the image has*/
+
+  for(i = 0; i < numrows && !error; i++)
+  {
+    const unsigned char* in = &rows[i * rawlinebytes];
+    unsigned char* swap;
+
+    if(convert) error = lodepng_convert(stream->row, in, &stream->info.color, &stream->info_raw, stream->w, 1);
+    else memcpy(stream->row, in, linebytes);
+    if(error) break;
+
+    scanline_filter_apply(&stream->filter, stream->filtered, stream->row,
+                          stream->y == 0 ? 0 : stream->prevrow, stream->y);
+    error = zlib_stream_write(&stream->zlib, stream->filtered, linebytes + 1);
+
+    swap = stream->prevrow;
+    stream->prevrow = stream->row;
+    stream->row = swap;
+    stream->y++;
+
+    /*write all full IDAT chunks*/
+    if(!error && stream->zlib.out.size >= STREAM_IDAT_SIZE)
+    {
+      error = stream_write_IDAT(stream, stream->zlib.out.size - stream->zlib.out.size % STREAM_IDAT_SIZE);
+    }
+  }
+
+  return error;
+}
+
+unsigned lodepng_encode_stream_end(LodePNGEncodeStream* stream)
+{
+  unsigned error = 0;
+  ucvector footer;
+
+  if(stream->y != stream->h) error = 95; /*not all rows were given*/
+  if(!error) error = zlib_stream_finish(&stream->zlib);
+  if(!error) error = stream_write_IDAT(stream, stream->zlib.out.size);
+
+  ucvector_init(&footer);
+  if(!error) error = addChunksAfterIDAT(&footer, &stream->info, &stream->settings);
+  if(!error) error = stream->write(footer.data, footer.size, stream->user);
+  ucvector_cleanup(&footer);
+
+  stream_cleanup(stream);
+  return error;
+}
+
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsigned char* image,
                                unsigned w, unsigned h, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -5756,6 +7274,8 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
   settings->filter_palette_zero = 1;
   settings->filter_strategy = LFS_MINSUM;
   settings->auto_convert = 1;
+  settings->sample_profile = 1;
+  settings->opaque = 0;
   settings->force_palette = 0;
   settings->predefined_filters = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
@@ -5866,6 +7386,13 @@ const char* lodepng_error_text(unsigned code)
     case 89: return "text chunk keyword too short or long: must have size 1-79";
     /*the windowsize in the LodePNGCompressSettings. Requiring POT(==> & instead of %) makes encoding 12% faster.*/
     case 90: return "windowsize must be a power of two";
+    case 91: return "invalid compression level given in LodePNGCompressSettings.level";
+    case 92: return "too many symbols or too large maximum bit length for a huffman tree";
+    case 93: return "the streaming encoder does not support Adam7 interlacing";
+    case 94: return "the streaming encoder can not use custom_zlib or custom_deflate";
+    case 95: return "the streaming encoder did not get exactly the amount of rows of the image";
+    case 96: return "failed to write the output of the streaming encoder to file";
+    case 97: return "LCL_ARCHIVE parsed a match that was not found (internal error)";
   }
   return "unknown error code";
 }
@@ -272,6 +272,20 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
+/*
+Named compression levels. Every level other than LCL_CUSTOM runs its own deflate
+code path and ignores btype, use_lz77, windowsize, minmatch, nicematch and lazymatching.
+*/
+typedef enum LodePNGCompressLevel
+{
+  LCL_CUSTOM = 0, /*use btype, windowsize, etc... as given*/
+  LCL_STORED = 1, /*no compression, stored blocks only. Fastest to write, largest output*/
+  LCL_FASTEST = 2, /*fixed huffman tree, greedy matching with a single hash probe per position*/
+  LCL_RLE = 3, /*dynamic huffman tree, only matches at distance 1 and at distance stride*/
+  LCL_MAX = 4, /*dynamic huffman tree, full 32768 window and hash chains, lazy matching*/
+  LCL_ARCHIVE = 5 /*optimal parsing with an iterated cost model and block splitting. Very slow, smallest output*/
+} LodePNGCompressLevel;
+
 /*
 Settings for zlib compression. Tweaking these settings tweaks the balance
 between speed and compression ratio.
@@ -287,6 +301,14 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
 
+  LodePNGCompressLevel level; /*named level, overrides the LZ77 settings above. Default: LCL_CUSTOM*/
+  /*second match distance tried by LCL_RLE, <= 32768. The PNG encoder sets it to the
+  filtered scanline length if it is 0, so that runs can also be copied from the row above. Default: 0*/
+  unsigned stride;
+  /*amount of times LCL_ARCHIVE parses every block with a cost model from the previous parse.
+  More can give smaller output, at the cost of time. Default: 15*/
+  unsigned iterations;
+
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
                           const unsigned char*, size_t,
@@ -571,6 +593,11 @@ void lodepng_color_profile_init(LodePNGColorProfile* profile);
 unsigned get_color_profile(LodePNGColorProfile* profile,
                            const unsigned char* image, unsigned w, unsigned h,
                            const LodePNGColorMode* mode_in);
+/*Same result as get_color_profile, but first looks at only a sample of the pixels, and
+only scans the whole image if the sample can't prove the result. Fast on photographs.*/
+unsigned get_color_profile_sampled(LodePNGColorProfile* profile,
+                                   const unsigned char* image, unsigned w, unsigned h,
+                                   const LodePNGColorMode* mode_in);
 /*The function LodePNG uses internally to decide the PNG color with auto_convert.
 Chooses an optimal color model, e.g. grey if only grey pixels, palette if < 256 colors, ...*/
 unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out,
@@ -583,6 +610,10 @@ typedef struct LodePNGEncoderSettings
   LodePNGCompressSettings zlibsettings; /*settings for the zlib encoder, such as window size, ...*/
 
   unsigned auto_convert; /*automatically choose output PNG color type. Default: true*/
+  /*let auto_convert first profile a sample of the pixels, see get_color_profile_sampled. Default: true*/
+  unsigned sample_profile;
+  /*the alpha of the input is known to be 255 everywhere, auto_convert does not check it. Default: false*/
+  unsigned opaque;
 
   /*If true, follows the official PNG heuristic: if the PNG uses a palette or lower than
   8 bit depth, set all filters to zero. Otherwise use the filter_strategy. Note that to
@@ -663,6 +694,37 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+Streaming encoder: encodes a PNG while the rows of the image come in, without having
+the whole image, the filtered image or the compressed data in memory at once.
+The encoded PNG goes to the write function as it is produced, with IDAT chunks of
+64KB. See the documentation chapter "streaming encoder".
+*/
+typedef struct LodePNGEncodeStream LodePNGEncodeStream;
+
+/*Called with the next piece of the encoded PNG. Returns 0, or an error code which stops the encoder.*/
+typedef unsigned (*LodePNGStreamWriteFunc)(const unsigned char* data, size_t size, void* user);
+
+/*
+Starts a stream for an image of w * h pixels: writes everything up to the first
+IDAT chunk. state gives the settings and color types like for lodepng_encode, but
+auto_convert is not used: the PNG gets the color type of state->info_png. The state
+is not used anymore after this call, the stream keeps a copy of the h filter types
+of encoder.predefined_filters if they are used. On success *stream must be given to
+lodepng_encode_stream_end, on error *stream is 0.
+*/
+unsigned lodepng_encode_stream_begin(LodePNGEncodeStream** stream, unsigned w, unsigned h,
+                                     const LodePNGState* state, LodePNGStreamWriteFunc write, void* user);
+
+/*Encodes the next numrows rows, in the color type of state->info_raw. Each row starts
+at a byte boundary, so rows with less than 8 bits per pixel end with padding bits.*/
+unsigned lodepng_encode_stream_rows(LodePNGEncodeStream* stream, const unsigned char* rows, unsigned numrows);
+
+/*Ends the PNG after all rows are given, and frees the stream, also if there was an error.*/
+unsigned lodepng_encode_stream_end(LodePNGEncodeStream* stream);
+#endif /*LODEPNG_COMPILE_ZLIB*/
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
@@ -770,6 +832,7 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize,
 /*
 Find length-limited Huffman code for given frequencies. This function is in the
 public interface only for tests, it's used internally by lodepng_deflate.
+Supports up to 288 codes and a maxbitlen of at most 15, and allocates no memory.
 */
 unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequencies,
                                       size_t numcodes, unsigned maxbitlen);
@@ -802,6 +865,14 @@ filename: the path to the file to save to
 return value: error code (0 means ok)
 */
 unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const char* filename);
+
+#ifdef LODEPNG_COMPILE_ENCODER
+/*
+A LodePNGStreamWriteFunc writing to an open file: give the FILE* as user. The
+streaming encoder then writes each IDAT chunk to the file as soon as it is full.
+*/
+unsigned lodepng_stream_write_file(const unsigned char* data, size_t size, void* file);
+#endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_DISK*/
 
 #ifdef LODEPNG_COMPILE_CPP
@@ -1154,6 +1225,13 @@ The following settings are supported (some are in sub-structs):
 *) auto_convert: when this option is enabled, the encoder will
 automatically choose the smallest possible color mode (including color key) that
 can encode the colors of all pixels without information loss.
+*) sample_profile: default 1. Lets auto_convert decide from a sample of the
+   pixels when the sample already proves the result, e.g. for a photograph with
+   more than 256 colors. The chosen color mode is the same either way.
+*) opaque: default 0. Declares that all pixels of an input with alpha are
+   opaque, so that auto_convert skips the alpha check. Without it, an opaque
+   RGBA image can only be profiled by scanning all pixels. If it is set while
+   some alpha is not 255, the alpha is lost.
 *) btype: the block type for LZ77. 0 = uncompressed, 1 = fixed huffman tree,
    2 = dynamic huffman tree (best compression). Should be 2 for proper
    compression.
@@ -1161,6 +1239,13 @@ can encode the colors of all pixels without information loss.
    true for proper compression.
 *) windowsize: the window size used by the LZ77 encoder (1 - 32768). Has value
    2048 by default, but can be set to 32768 for better, but slow, compression.
+*) level: a named compression level, LCL_CUSTOM by default. LCL_STORED,
+   LCL_FASTEST and LCL_RLE trade compression ratio for encoding speed, LCL_MAX
+   and LCL_ARCHIVE trade speed for ratio. Each has its own code path, and all of
+   them ignore btype, use_lz77, windowsize, minmatch, nicematch and lazymatching.
+   LCL_ARCHIVE splits the data in blocks where the symbol statistics change, and
+   finds the cheapest sequence of literals and matches for each block, iterating
+   the cost model iterations times. It uses all cores if compiled with OpenMP.
 *) force_palette: if colortype is 2 or 6, you can make the encoder write a PLTE
    chunk if force_palette is true. This can used as suggested palette to convert
    to by viewers that don't support more than 256 colors (if those still exist)
@@ -1170,6 +1255,18 @@ can encode the colors of all pixels without information loss.
   large texts but a larger result on small texts (such as a single program name).
   It's all tEXt or all zTXt though, there's no separate setting per text yet.
 
+The streaming encoder (lodepng_encode_stream_begin, lodepng_encode_stream_rows
+and lodepng_encode_stream_end) encodes the rows while they are given, and writes
+each IDAT chunk as soon as it is full, for example to a file with
+lodepng_stream_write_file. Its memory use doesn't depend on the height of the
+image: it only keeps two rows, the deflate window and one deflate block. It uses
+the same settings as lodepng_encode, with these differences:
+*) auto_convert is ignored, the PNG gets the color type of info_png.
+*) Adam7 interlacing is not supported.
+*) custom_zlib and custom_deflate can not be used.
+*) Every deflate block holds 128KB of input, so the output of btype 1, LCL_FASTEST
+   and big images with btype 2 can differ in size a little from lodepng_encode.
+
 
 6. color conversions
 --------------------
@@ -2,9 +2,12 @@
 #include <QtConcurrent>
 #include <QFutureWatcher>
 #include <QFileDialog>
+#include <QFile>
 #include <QShortcut>
 
+#include <algorithm>
 #include <iostream>
+#include <vector>
 #include <thread>
 
 
@@ -17,6 +20,7 @@
 #include <skepu2.hpp>
 
 #include "lodepng.h"
+#include "compression.h"
 #include "skepuimg.h"
 #include "ui_mainwindow.h"
 
@@ -33,6 +37,13 @@ public:
 		this->ui.cpuThreadsBox->setValue(imgp::getCPUThreads());
 		this->ui.backendBox->setCurrentIndex(this->ui.backendBox->findText(QString::fromStdString(imgp::getBackend())));
 		
+		for (const Compression::Preset &preset : Compression::presets())
+			this->ui.savePresetBox->addItem(QString::fromStdString(preset.name));
+		this->ui.savePresetBox->setCurrentText("Balanced");
+		for (const std::string &name : Compression::backendNames())
+			this->ui.compressionBox->addItem(QString::fromStdString(name));
+		this->ui.compressionBox->setCurrentText(QString::fromStdString(Compression::getBackend()));
+		
 		this->sk_stencil = skepu2::Matrix<float>(3, 3);
 		
 		this->filterWatcher = new QFutureWatcher<float>();
@@ -41,6 +52,9 @@ public:
 		this->loadWatcher = new QFutureWatcher<float>();
 		connect(this->loadWatcher, SIGNAL(finished()), this, SLOT(loadingFinished()));
 		
+		this->saveWatcher = new QFutureWatcher<float>();
+		connect(this->saveWatcher, SIGNAL(finished()), this, SLOT(savingFinished()));
+		
 		connect(this->ui.hueSlider, SIGNAL(sliderMoved(int)), this, SLOT(on_hueButton_clicked(int)));
 		
 		QObject::connect(new QShortcut(QKeySequence("Ctrl+L"), this), SIGNAL(activated()), this, SLOT(tabToLoad()));
@@ -58,7 +72,7 @@ private slots:
 			this->showMessage("Blur filtering ...");
 			this->filtering = true;
 			int sigma = this->ui.blurRadiusBox->value();
-			QFuture<float> future = QtConcurrent::run(imgp::gaussian<RGBPixel>, &this->sk_image, sigma);
+			QFuture<float> future = QtConcurrent::run(imgp::gaussian<RGBXPixel>, &this->sk_image, sigma, &this->sk_properties);
 			this->filterWatcher->setFuture(future);
 		}
 	}
@@ -76,7 +90,7 @@ private slots:
 			this->showMessage("Blur filtering ...");
 			this->filtering = true;
 			int radius = this->ui.blurRadiusBox->value();
-			QFuture<float> future = QtConcurrent::run(imgp::median, &this->sk_image, radius);
+			QFuture<float> future = QtConcurrent::run(imgp::median<RGBXPixel>, &this->sk_image, radius, &this->sk_properties);
 			this->filterWatcher->setFuture(future);
 		}
 	}
@@ -88,7 +102,7 @@ private slots:
 			this->showMessage("Hue adjustment ...");
 			this->filtering = true;
 			float hue = this->ui.hueSlider->value() * 3.1416f / 180.0f;
-			QFuture<float> future = QtConcurrent::run(imgp::hue, &this->sk_image, hue);
+			QFuture<float> future = QtConcurrent::run(imgp::hue<RGBXPixel>, &this->sk_image, hue, &this->sk_properties);
 			this->filterWatcher->setFuture(future);
 		}
 	}
@@ -101,7 +115,7 @@ private slots:
 			this->filtering = true;
 			float scale = this->ui.scaleSlider->value() / 10.0;
 			this->sk_image.resize(this->ui.heightBox->value(), this->ui.widthBox->value());
-			QFuture<float> future = QtConcurrent::run(imgp::mandelbrot, &this->sk_image, scale);
+			QFuture<float> future = QtConcurrent::run(imgp::mandelbrot<RGBXPixel>, &this->sk_image, scale, &this->sk_properties);
 			this->filterWatcher->setFuture(future);
 		}
 	}
@@ -112,7 +126,7 @@ private slots:
 		{
 			this->showMessage("Edge detection filtering ...");
 			this->filtering = true;
-			QFuture<float> future = QtConcurrent::run(imgp::edge_rgb, &this->sk_image);
+			QFuture<float> future = QtConcurrent::run(imgp::edge_rgb<RGBXPixel>, &this->sk_image, &this->sk_properties);
 			this->filterWatcher->setFuture(future);
 		}
 	}
@@ -124,7 +138,7 @@ private slots:
 			this->showMessage("Desaturating ...");
 			this->filtering = true;
 			float sat = this->ui.hueSlider->value() / 360.f;
-			QFuture<float> future = QtConcurrent::run(imgp::desaturate, &this->sk_image, sat);
+			QFuture<float> future = QtConcurrent::run(imgp::desaturate<RGBXPixel>, &this->sk_image, sat, &this->sk_properties);
 			this->filterWatcher->setFuture(future);
 		}
 	}
@@ -135,7 +149,7 @@ private slots:
 		{
 			this->showMessage("Black/White filtering ...");
 			this->filtering = true;
-			QFuture<float> future = QtConcurrent::run(imgp::blackwhite, &this->sk_image);
+			QFuture<float> future = QtConcurrent::run(imgp::blackwhite<RGBXPixel>, &this->sk_image, &this->sk_properties);
 			this->filterWatcher->setFuture(future);
 		}
 	}
@@ -144,11 +158,15 @@ private slots:
 	{
 		if (!this->filtering)
 		{
+			if (!this->readStencil())
+			{
+				this->showMessage("Invalid stencil: rows of numbers, odd in number and length, all of the same length.");
+				return;
+			}
 			this->showMessage("Stencil filtering ...");
 			this->filtering = true;
 			float scaling = 1 / this->ui.coeffScaling->text().toFloat();
-			this->readStencil();
-			QFuture<float> future = QtConcurrent::run(imgp::stencil, &this->sk_image, &this->sk_stencil, scaling);
+			QFuture<float> future = QtConcurrent::run(imgp::stencil<RGBXPixel>, &this->sk_image, &this->sk_stencil, scaling, &this->sk_properties);
 			this->filterWatcher->setFuture(future);
 		}
 	}
@@ -159,7 +177,7 @@ private slots:
 		{
 			this->showMessage("Grayscale filtering ...");
 			this->filtering = true;
-			QFuture<float> future = QtConcurrent::run(imgp::invert<RGBPixel>, &this->sk_image);
+			QFuture<float> future = QtConcurrent::run(imgp::invert<RGBXPixel>, &this->sk_image, &this->sk_properties);
 			this->filterWatcher->setFuture(future);
 		}
 	}
@@ -173,39 +191,172 @@ private slots:
 			this->ui.filenameField->setText(*dialog.selectedFiles().begin());
 	}
 	
-	static float loadImage(std::string fileName, skepu2::Matrix<RGBPixel> *sk_img)
+	static float loadImage(std::string fileName, skepu2::Matrix<RGBXPixel> *sk_img, imgp::ImageProperties *properties)
 	{
 		unsigned error;
-		unsigned char *img;
-		unsigned width = 0, height = 0;
 		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
 		{
-			error = lodepng_decode_file(&img, &width, &height, fileName.c_str(), LCT_RGB, 8);
+			unsigned char *png = nullptr, *img = nullptr;
+			size_t pngsize = 0;
+			unsigned width = 0, height = 0;
+			LodePNGState state;
+			lodepng_state_init(&state);
+			Compression::configure(&state);
+			state.info_raw.colortype = LCT_RGBA; // decoded straight into the padded pixels
+			state.info_raw.bitdepth = 8;
+			
+			error = lodepng_load_file(&png, &pngsize, fileName.c_str());
+			if (!error) error = lodepng_decode(&img, &width, &height, &state, png, pngsize);
 			if (!error)
 			{
-				*sk_img = std::move(skepu2::Matrix<RGBPixel>(height, width));
-				memcpy(&(*sk_img)[0], &img[0], width * height * 3);
+				*sk_img = std::move(skepu2::Matrix<RGBXPixel>(height, width));
+				memcpy(&(*sk_img)[0], &img[0], width * height * 4);
+				
+				// The image is opaque: transparency is dropped as before, x is kept at 255
+				if (lodepng_can_have_alpha(&state.info_png.color))
+				{
+					RGBXPixel *pixels = &(*sk_img)[0];
+					for (size_t i = 0; i < (size_t)width * height; i++)
+						pixels[i].x = 255;
+				}
+				readProperties(properties, &state.info_png.color);
 			}
 			else { std::cerr << "ERROR!" << lodepng_error_text(error) << "\n"; }
+			lodepng_state_cleanup(&state);
+			free(png);
+			free(img);
 		});
 		return (!error) ? time.count() / 1E6 : -1;
 	}
 	
 	void on_loadButton_clicked()
 	{
+		if (this->filtering)
+			return;
+		
 		this->showMessage("Loading image ...");
+		this->filtering = true; // replaces the image, which filters and saving must not use meanwhile
 		this->ui.loadButton->setEnabled(false);
+		this->ui.saveButton->setEnabled(false);
 		std::string filePath = this->ui.filenameField->text().toStdString();
-		QFuture<float> future = QtConcurrent::run(loadImage, filePath, &this->sk_image);
+		QFuture<float> future = QtConcurrent::run(loadImage, filePath, &this->sk_image, &this->sk_properties);
 		this->loadWatcher->setFuture(future);
 	}
 	
+	// What the color type of a loaded PNG tells about the decoded RGB pixels.
+	static void readProperties(imgp::ImageProperties *properties, const LodePNGColorMode *color)
+	{
+		properties->reset();
+		if (color->colortype == LCT_GREY || color->colortype == LCT_GREY_ALPHA)
+		{
+			properties->grayscale = true;
+			properties->bitDepth = std::min(color->bitdepth, 8u); // 16 bit is cut to 8 when decoding
+		}
+		else if (color->colortype == LCT_PALETTE)
+		{
+			for (size_t i = 0; i < color->palettesize; i++)
+			{
+				const unsigned char *rgba = &color->palette[i * 4];
+				properties->palette.push_back({ rgba[0], rgba[1], rgba[2] });
+			}
+		}
+	}
+	
+	// Picks the PNG color type from the properties instead of letting lodepng scan the pixels.
+	// False if too little is known, then lodepng chooses.
+	static bool writeProperties(LodePNGColorMode *color, const imgp::ImageProperties *properties)
+	{
+		if (properties->grayscale)
+		{
+			color->colortype = LCT_GREY;
+			color->bitdepth = properties->bitDepth;
+			return true;
+		}
+		
+		size_t colors = properties->palette.size();
+		if (colors == 0 || colors > 256)
+			return false;
+		
+		lodepng_palette_clear(color);
+		for (RGBPixel pixel : properties->palette)
+			if (lodepng_palette_add(color, pixel.red, pixel.green, pixel.blue, 255))
+				return false;
+		color->colortype = LCT_PALETTE;
+		color->bitdepth = (colors <= 2) ? 1 : (colors <= 4) ? 2 : (colors <= 16) ? 4 : 8;
+		return true;
+	}
+	
+	// Encodes the image directly from the host copy of the matrix, no intermediate buffer.
+	static float saveImage(std::string fileName, skepu2::Matrix<RGBXPixel> *sk_img, const imgp::ImageProperties *properties,
+		LodePNGCompressLevel level)
+	{
+		unsigned error;
+		std::chrono::microseconds time = skepu2::benchmark::measureExecTime([&]
+		{
+			sk_img->updateHost();
+			unsigned char *png = nullptr;
+			size_t pngsize = 0;
+			LodePNGState state;
+			lodepng_state_init(&state);
+			Compression::configure(&state);
+			state.info_raw.colortype = LCT_RGBA; // x is 255, no alpha is written
+			state.info_raw.bitdepth = 8;
+			state.encoder.zlibsettings.level = level;
+			if (level == LCL_STORED)
+				state.encoder.filter_strategy = LFS_ZERO; // filtering does not pay off without compression
+			if (writeProperties(&state.info_png.color, properties))
+				state.encoder.auto_convert = 0;
+			else
+				state.encoder.opaque = 1; // x is always 255: lets auto_convert decide from a sample
+			
+			lodepng_encode(&png, &pngsize, reinterpret_cast<const unsigned char*>(&(*sk_img)[0]),
+				sk_img->total_cols(), sk_img->total_rows(), &state);
+			error = state.error;
+			if (!error) error = lodepng_save_file(png, pngsize, fileName.c_str());
+			if (error) { std::cerr << "ERROR!" << lodepng_error_text(error) << "\n"; }
+			lodepng_state_cleanup(&state);
+			free(png);
+		});
+		return (!error) ? time.count() / 1E6 : -1;
+	}
+	
+	void on_saveButton_clicked()
+	{
+		if (this->filtering)
+			return;
+		
+		QString filePath = QFileDialog::getSaveFileName(this, tr("Save Image"), QString(), tr("Images (*.png)"));
+		if (filePath.isEmpty())
+			return;
+		
+		LodePNGCompressLevel level = Compression::presets()[this->ui.savePresetBox->currentIndex()].level;
+		
+		this->showMessage("Saving image ...");
+		this->filtering = true; // the image must not change or be replaced while it is encoded
+		this->ui.loadButton->setEnabled(false);
+		this->ui.saveButton->setEnabled(false);
+		QFuture<float> future = QtConcurrent::run(saveImage, filePath.toStdString(), &this->sk_image, &this->sk_properties, level);
+		this->saveWatcher->setFuture(future);
+	}
+	
+	void savingFinished()
+	{
+		float time = this->saveWatcher->result();
+		this->showMessage(time >= 0 ? "Saving done." : "Saving failed.");
+		std::cout << "Time: " << time << "\n";
+		this->ui.loadButton->setEnabled(true);
+		this->ui.saveButton->setEnabled(true);
+		this->filtering = false;
+	}
+	
 	void loadingFinished()
 	{
 		this->showMessage("Loading done.");
 		float time = this->loadWatcher->result();
 		std::cout << "Time: " << time << "\n";
 		this->ui.loadButton->setEnabled(true);
+		this->ui.saveButton->setEnabled(true);
+		this->filtering = false;
 		if (time >= 0)
 		{
 			this->displayImage();
@@ -226,45 +377,78 @@ private slots:
 		imgp::setBackend(text.toStdString());
 	}
 	
+	void on_compressionBox_currentTextChanged(QString text)
+	{
+		this->showMessage("Changed PNG compression!");
+		Compression::setBackend(text.toStdString());
+	}
+	
 	void on_cpuThreadsBox_valueChanged(int value)
 	{
 		this->showMessage("Changed number of OpenMP threads!");
 		imgp::setCPUThreads(value);
 	}
 	
+	void on_loadStencilButton_clicked()
+	{
+		QString fileName = QFileDialog::getOpenFileName(this, tr("Load Stencil"), QString(), tr("Text files (*.txt);;All files (*)"));
+		if (fileName.isEmpty())
+			return;
+		
+		QFile file(fileName);
+		if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+		{
+			this->showMessage("Could not open stencil file!");
+			return;
+		}
+		this->ui.stencilText->setPlainText(QString::fromUtf8(file.readAll()));
+	}
+	
 	void on_clearStencilButton_clicked()
 	{
-		this->ui.coeff0_0->setText("0.0");
-		this->ui.coeff0_1->setText("0.0");
-		this->ui.coeff0_2->setText("0.0");
-		this->ui.coeff1_0->setText("0.0");
-		this->ui.coeff1_1->setText("1.0");
-		this->ui.coeff1_2->setText("0.0");
-		this->ui.coeff2_0->setText("0.0");
-		this->ui.coeff2_1->setText("0.0");
-		this->ui.coeff2_2->setText("0.0");
+		this->ui.stencilText->setPlainText("0 0 0\n0 1 0\n0 0 0");
 	}
 
 private:
 	
-	void readStencil()
+	// One row of the stencil per line, coefficients separated by spaces or commas.
+	bool readStencil()
 	{
-		this->sk_stencil(0, 0) = this->ui.coeff0_0->text().toFloat();
-		this->sk_stencil(0, 1) = this->ui.coeff0_1->text().toFloat();
-		this->sk_stencil(0, 2) = this->ui.coeff0_2->text().toFloat();
-		this->sk_stencil(1, 0) = this->ui.coeff1_0->text().toFloat();
-		this->sk_stencil(1, 1) = this->ui.coeff1_1->text().toFloat();
-		this->sk_stencil(1, 2) = this->ui.coeff1_2->text().toFloat();
-		this->sk_stencil(2, 0) = this->ui.coeff2_0->text().toFloat();
-		this->sk_stencil(2, 1) = this->ui.coeff2_1->text().toFloat();
-		this->sk_stencil(2, 2) = this->ui.coeff2_2->text().toFloat();
+		std::vector<std::vector<float>> rows;
+		for (const QString &line : this->ui.stencilText->toPlainText().split('\n', QString::SkipEmptyParts))
+		{
+			QStringList fields = line.split(QRegExp("[\\s,]+"), QString::SkipEmptyParts);
+			if (fields.isEmpty())
+				continue;
+			
+			std::vector<float> row;
+			for (const QString &field : fields)
+			{
+				bool ok;
+				row.push_back(field.toFloat(&ok));
+				if (!ok)
+					return false;
+			}
+			if (!rows.empty() && row.size() != rows[0].size())
+				return false;
+			rows.push_back(row);
+		}
+		
+		if (rows.size() % 2 == 0 || rows[0].size() % 2 == 0)
+			return false;
+		
+		this->sk_stencil = skepu2::Matrix<float>(rows.size(), rows[0].size());
+		for (size_t i = 0; i < rows.size(); i++)
+			for (size_t j = 0; j < rows[i].size(); j++)
+				this->sk_stencil(i, j) = rows[i][j];
+		return true;
 	}
 	
 	void displayImage()
 	{
 		this->sk_image.updateHost();
 		QImage img(reinterpret_cast<unsigned char*>(&this->sk_image[0]),
-			this->sk_image.total_cols(), this->sk_image.total_rows(), QImage::Format_RGB888);
+			this->sk_image.total_cols(), this->sk_image.total_rows(), QImage::Format_RGBX8888);
 		QPixmap pixmap;
 		pixmap.convertFromImage(img);
 		this->ui.imageView->setPixmap(pixmap);
@@ -276,9 +460,10 @@ private:
 	}
 	
 	Ui::MainWindow ui;
-	skepu2::Matrix<RGBPixel> sk_image;
+	skepu2::Matrix<RGBXPixel> sk_image;
+	imgp::ImageProperties sk_properties;
 	skepu2::Matrix<float> sk_stencil;
-	QFutureWatcher<float> *filterWatcher, *loadWatcher;
+	QFutureWatcher<float> *filterWatcher, *loadWatcher, *saveWatcher;
 	bool filtering = false;
 };
 
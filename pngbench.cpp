@@ -0,0 +1,204 @@
+// Encode and decode throughput and compression ratio of every compression backend and preset.
+// Usage: pngbench [directory with PNG images, default images] [repetitions, default 3]
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "lodepng.h"
+#include "compression.h"
+
+struct Image
+{
+	std::string name;
+	std::vector<unsigned char> pixels;
+	unsigned width, height;
+	LodePNGColorMode color;
+};
+
+// Fastest of the repetitions, in seconds
+template<typename F>
+double bestTime(int repetitions, F f)
+{
+	double best = 1E30;
+	for (int i = 0; i < repetitions; ++i)
+	{
+		auto start = std::chrono::steady_clock::now();
+		f();
+		std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+		best = std::min(best, time.count());
+	}
+	return best;
+}
+
+std::vector<Image> loadImages(std::string directory)
+{
+	std::vector<Image> images;
+	DIR *dir = opendir(directory.c_str());
+	if (!dir)
+		return images;
+
+	std::vector<std::string> names;
+	while (dirent *entry = readdir(dir))
+	{
+		std::string name = entry->d_name;
+		if (name.size() > 4 && name.substr(name.size() - 4) == ".png")
+			names.push_back(name);
+	}
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+
+	for (const std::string &name : names)
+	{
+		unsigned char *png = nullptr, *pixels = nullptr;
+		size_t pngsize = 0;
+		Image image;
+		image.name = name;
+		LodePNGState state;
+		lodepng_state_init(&state);
+		state.decoder.color_convert = 0; // keep the color type of the file, so that the raw size matches it
+		unsigned error = lodepng_load_file(&png, &pngsize, (directory + "/" + name).c_str());
+		if (!error) error = lodepng_decode(&pixels, &image.width, &image.height, &state, png, pngsize);
+		if (!error)
+		{
+			size_t size = lodepng_get_raw_size(image.width, image.height, &state.info_png.color);
+			image.pixels.assign(pixels, pixels + size);
+			lodepng_color_mode_init(&image.color);
+			lodepng_color_mode_copy(&image.color, &state.info_png.color);
+			images.push_back(std::move(image));
+		}
+		else fprintf(stderr, "%s: %s\n", name.c_str(), lodepng_error_text(error));
+		lodepng_state_cleanup(&state);
+		free(png);
+		free(pixels);
+	}
+	return images;
+}
+
+int main(int argc, char *argv[])
+{
+	std::string directory = (argc > 1) ? argv[1] : "images";
+	int repetitions = (argc > 2) ? std::max(1, atoi(argv[2])) : 3;
+
+	std::vector<Image> images = loadImages(directory);
+	if (images.empty())
+	{
+		fprintf(stderr, "No PNG images in %s\n", directory.c_str());
+		return 1;
+	}
+
+	size_t rawTotal = 0;
+	for (const Image &image : images)
+		rawTotal += image.pixels.size();
+	printf("%zu images, %.1f MB raw, best of %d\n\n", images.size(), rawTotal / 1E6, repetitions);
+	printf("%-10s %-14s %12s %8s %14s %14s\n", "backend", "preset", "PNG bytes", "ratio", "encode MB/s", "decode MB/s");
+
+	for (const std::string &backend : Compression::backendNames())
+		for (const Compression::Preset &preset : Compression::presets())
+		{
+			size_t pngTotal = 0;
+			double encodeTime = 0, decodeTime = 0;
+			unsigned error = 0;
+
+			for (const Image &image : images)
+			{
+				LodePNGState state;
+				lodepng_state_init(&state);
+				Compression::configure(&state, backend);
+				lodepng_color_mode_copy(&state.info_raw, &image.color);
+				lodepng_color_mode_copy(&state.info_png.color, &image.color);
+				state.encoder.auto_convert = 0;
+				state.encoder.zlibsettings.level = preset.level;
+				if (preset.level == LCL_STORED)
+					state.encoder.filter_strategy = LFS_ZERO;
+				state.decoder.color_convert = 0;
+
+				unsigned char *png = nullptr;
+				size_t pngsize = 0;
+				encodeTime += bestTime(repetitions, [&]
+				{
+					free(png);
+					png = nullptr;
+					pngsize = 0;
+					error = lodepng_encode(&png, &pngsize, image.pixels.data(), image.width, image.height, &state);
+				});
+
+				std::vector<unsigned char> decoded;
+				if (!error) decodeTime += bestTime(repetitions, [&]
+				{
+					unsigned char *pixels = nullptr;
+					unsigned width, height;
+					error = lodepng_decode(&pixels, &width, &height, &state, png, pngsize);
+					if (!error) decoded.assign(pixels, pixels + image.pixels.size());
+					free(pixels);
+				});
+				if (!error && decoded != image.pixels)
+					error = 1;
+
+				pngTotal += pngsize;
+				free(png);
+				lodepng_state_cleanup(&state);
+				if (error)
+				{
+					fprintf(stderr, "%s with %s/%s: %s\n", image.name.c_str(), backend.c_str(), preset.name.c_str(),
+						error == 1 ? "decoded image differs" : lodepng_error_text(error));
+					break;
+				}
+			}
+
+			if (!error)
+				printf("%-10s %-14s %12zu %8.3f %14.1f %14.1f\n", backend.c_str(), preset.name.c_str(), pngTotal,
+					(double)rawTotal / pngTotal, rawTotal / 1E6 / encodeTime, rawTotal / 1E6 / decodeTime);
+		}
+
+	// The viewer saves opaque RGBA and lets auto_convert pick the color type. Declared opaque,
+	// the profile can come from a sample; otherwise every pixel is scanned for alpha.
+	printf("\n%-25s %14s %14s\n", "auto_convert, RGBA input", "scan MB/s", "opaque MB/s");
+	for (const Image &image : images)
+	{
+		LodePNGColorMode rgba;
+		lodepng_color_mode_init(&rgba); // 8-bit RGBA
+		std::vector<unsigned char> pixels(lodepng_get_raw_size(image.width, image.height, &rgba));
+		unsigned error = lodepng_convert(pixels.data(), image.pixels.data(), &rgba, &image.color, image.width, image.height);
+
+		double times[2];
+		std::vector<unsigned char> encoded[2];
+		for (int opaque = 0; opaque < 2 && !error; ++opaque)
+		{
+			LodePNGState state;
+			lodepng_state_init(&state);
+			state.info_raw.colortype = LCT_RGBA;
+			state.info_raw.bitdepth = 8;
+			state.encoder.opaque = opaque;
+			state.encoder.zlibsettings.level = LCL_STORED; // so that the profile dominates
+			state.encoder.filter_strategy = LFS_ZERO;
+
+			times[opaque] = bestTime(repetitions, [&]
+			{
+				unsigned char *png = nullptr;
+				size_t pngsize = 0;
+				error = lodepng_encode(&png, &pngsize, pixels.data(), image.width, image.height, &state);
+				if (!error) encoded[opaque].assign(png, png + pngsize);
+				free(png);
+			});
+			lodepng_state_cleanup(&state);
+		}
+
+		if (error)
+			fprintf(stderr, "%s as RGBA: %s\n", image.name.c_str(), lodepng_error_text(error));
+		else if (encoded[0] != encoded[1])
+			fprintf(stderr, "%s as RGBA: opaque changed the PNG\n", image.name.c_str());
+		else
+			printf("%-25s %14.1f %14.1f\n", image.name.c_str(),
+				pixels.size() / 1E6 / times[0], pixels.size() / 1E6 / times[1]);
+	}
+
+	for (Image &image : images)
+		lodepng_color_mode_cleanup(&image.color);
+	return 0;
+}
@@ -0,0 +1,11 @@
+TEMPLATE		 = app
+TARGET			 = pngbench
+
+CONFIG		+= c++11 console
+CONFIG		-= qt app_bundle
+QMAKE_CXXFLAGS += -fopenmp
+QMAKE_LFLAGS += -fopenmp
+
+SOURCES		 = pngbench.cpp lodepng.cpp compression.cpp
+
+include(compression.pri)